@@ -0,0 +1,830 @@
+#include "ActiveObject.h"
+#include "Scheduler.h"
+#include "Fault.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Maximum queued events applied with one _SM_EventBatch() call
+#define SM_DISPATCH_BATCH   32
+
+// The instance executing events on this thread, see StateMachine.c
+extern TH_THREAD_LOCAL SM_StateMachine* _SM_BatchMachine;
+
+static void SM_DispatchThread(void* arg);
+static SM_CoalesceRule* SM_FindRule(SM_Mailbox* mailbox, SM_EventFunc eventFunc);
+static void SM_LockRule(SM_CoalesceRule* rule);
+static void SM_Coalesce(SM_CoalesceRule* rule, const SM_Message* msg);
+static UINT32 SM_Deadline(UINT32 deadlineMs);
+static SM_EventQueue* SM_Route(SM_Mailbox* mailbox, SM_Message* msg);
+static BOOL SM_Before(const SM_PriorityEntry* a, const SM_PriorityEntry* b);
+static void SM_HeapPush(SM_PriorityEntry* heap, UINT32 count, const SM_PriorityEntry* entry);
+static UINT32 SM_HeapPop(SM_PriorityEntry* heap, UINT32 count);
+static UINT32 SM_GetPriority(SM_Mailbox* mailbox, SM_Message* msgs, UINT32 maxCount);
+static void SM_LockGet(SM_Mailbox* mailbox);
+static void SM_DropOldest(SM_Mailbox* mailbox, SM_EventQueue* queue);
+static BOOL SM_Overflow(SM_Mailbox* mailbox, SM_EventQueue* queue, BOOL fault, UINT64* pWaitStart, BOOL* pResult);
+static BOOL SM_PostMessage(SM_StateMachine* self, const SM_Message* msg, BOOL fault);
+
+//----------------------------------------------------------------------------
+// SM_DispatchThread
+//----------------------------------------------------------------------------
+static void SM_DispatchThread(void* arg)
+{
+    SM_StateMachine* self = (SM_StateMachine*)arg;
+    SM_Mailbox* mailbox = self->pMailbox;
+    SM_Message msgs[SM_DISPATCH_BATCH];
+    UINT32 count;
+
+    for (;;)
+    {
+        count = _SM_MailboxGet(mailbox, msgs, SM_DISPATCH_BATCH);
+        if (count == 0)
+        {
+            // Mailbox empty. Tell producers the dispatcher is about to sleep, 
+            // then check once more for a message posted in the meantime.
+            ATOMIC_Exchange32(&mailbox->waiting, TRUE);
+            count = _SM_MailboxGet(mailbox, msgs, SM_DISPATCH_BATCH);
+            if (count == 0)
+            {
+                // All queued events executed and a stop was requested?
+                if (ATOMIC_Load32(&mailbox->exit))
+                    break;
+
+                SEM_WAIT(mailbox->hSem, SEM_WAIT_INFINITE);
+                continue;
+            }
+        }
+
+        // Execute the queued external events on the dispatcher thread
+        _SM_EventBatch(self, msgs, count);
+    }
+}
+
+//----------------------------------------------------------------------------
+// _SM_ActiveStart
+//----------------------------------------------------------------------------
+void _SM_ActiveStart(SM_StateMachine* self, SM_Mailbox* mailbox)
+{
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(mailbox);
+    ASSERT_TRUE(self->pMailbox == NULL);
+
+    _SM_MailboxInit(mailbox);
+    ATOMIC_Store32(&mailbox->waiting, FALSE);
+    ATOMIC_Store32(&mailbox->exit, FALSE);
+    mailbox->hSem = SEM_CREATE();
+
+    self->pMailbox = mailbox;
+    mailbox->hThread = TH_CREATE(SM_DispatchThread, self);
+}
+
+//----------------------------------------------------------------------------
+// _SM_ActiveStop
+//----------------------------------------------------------------------------
+void _SM_ActiveStop(SM_StateMachine* self)
+{
+    SM_Mailbox* mailbox = NULL;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(self->pMailbox);
+
+    mailbox = self->pMailbox;
+    _SM_MailboxClose(mailbox);
+
+    // Let the dispatcher thread drain the mailbox and exit
+    ATOMIC_Store32(&mailbox->exit, TRUE);
+    SEM_SIGNAL(mailbox->hSem);
+
+    TH_JOIN(mailbox->hThread);
+
+    SEM_DESTROY(mailbox->hSem);
+    mailbox->hThread = NULL;
+    mailbox->hSem = NULL;
+    self->pMailbox = NULL;
+}
+
+//----------------------------------------------------------------------------
+// SM_FindRule
+//----------------------------------------------------------------------------
+static SM_CoalesceRule* SM_FindRule(SM_Mailbox* mailbox, SM_EventFunc eventFunc)
+{
+    UINT32 i;
+
+    for (i=0; i<mailbox->coalesceCount; i++)
+    {
+        if (mailbox->coalesce[i].eventFunc == eventFunc)
+            return &mailbox->coalesce[i];
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+// SM_LockRule
+//----------------------------------------------------------------------------
+static void SM_LockRule(SM_CoalesceRule* rule)
+{
+    // Held for a message copy at most, so spin
+    while (!ATOMIC_CompareExchange32(&rule->lock, FALSE, TRUE))
+        ATOMIC_Pause();
+}
+
+//----------------------------------------------------------------------------
+// SM_Coalesce
+//----------------------------------------------------------------------------
+static void SM_Coalesce(SM_CoalesceRule* rule, const SM_Message* msg)
+{
+    SM_Message* queued = &rule->msg;
+
+    switch (rule->policy)
+    {
+    case SM_COALESCE_LATEST:
+        _SM_ReleaseEventData(queued->pEventData, (SM_DataOwnership)queued->ownership, 
+            queued->destructor, queued->destructorContext);
+        memcpy(queued, msg, sizeof(SM_Message));
+        return;
+    case SM_COALESCE_MERGE:
+        rule->merge(queued->inlineSize ? queued->inlineData.bytes : queued->pEventData,
+            msg->inlineSize ? msg->inlineData.bytes : msg->pEventData);
+        break;
+    default:
+        break;
+    }
+
+    // The queued event stays. Release the new event data.
+    _SM_ReleaseEventData(msg->pEventData, (SM_DataOwnership)msg->ownership, 
+        msg->destructor, msg->destructorContext);
+}
+
+//----------------------------------------------------------------------------
+// SM_Deadline
+//----------------------------------------------------------------------------
+static UINT32 SM_Deadline(UINT32 deadlineMs)
+{
+    UINT32 deadline = (UINT32)(TH_GetTimeNs() / 1000000) + deadlineMs;
+
+    // 0 is no deadline
+    return deadline ? deadline : 1;
+}
+
+//----------------------------------------------------------------------------
+// SM_Route
+//----------------------------------------------------------------------------
+static SM_EventQueue* SM_Route(SM_Mailbox* mailbox, SM_Message* msg)
+{
+    SM_PriorityLanes* lanes = mailbox->pPriority;
+    SM_Priority priority = SM_PRIORITY_NORMAL;
+    UINT32 i;
+
+    for (i=0; i<lanes->ruleCount; i++)
+    {
+        if (lanes->rules[i].eventFunc == msg->eventFunc)
+        {
+            priority = lanes->rules[i].priority;
+            if (lanes->rules[i].deadlineMs && !msg->deadline)
+                msg->deadline = SM_Deadline(lanes->rules[i].deadlineMs);
+            break;
+        }
+    }
+
+    if (priority == SM_PRIORITY_HIGH)
+        return &lanes->high;
+    if (priority == SM_PRIORITY_LOW)
+        return &lanes->low;
+    return &mailbox->queue;
+}
+
+//----------------------------------------------------------------------------
+// SM_Before
+//----------------------------------------------------------------------------
+static BOOL SM_Before(const SM_PriorityEntry* a, const SM_PriorityEntry* b)
+{
+    if (a->priority != b->priority)
+        return a->priority < b->priority;
+
+    // Within a level, events with a deadline first, earliest first
+    if ((a->deadline != 0) != (b->deadline != 0))
+        return a->deadline != 0;
+    if (a->deadline != b->deadline)
+        return (INT32)(a->deadline - b->deadline) < 0;
+
+    // Then in the order taken from the queues
+    return (INT32)(a->sequence - b->sequence) < 0;
+}
+
+//----------------------------------------------------------------------------
+// SM_HeapPush
+//----------------------------------------------------------------------------
+static void SM_HeapPush(SM_PriorityEntry* heap, UINT32 count, const SM_PriorityEntry* entry)
+{
+    UINT32 i = count, parent;
+
+    while (i > 0)
+    {
+        parent = (i - 1) / 2;
+        if (!SM_Before(entry, &heap[parent]))
+            break;
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = *entry;
+}
+
+//----------------------------------------------------------------------------
+// SM_HeapPop
+//----------------------------------------------------------------------------
+static UINT32 SM_HeapPop(SM_PriorityEntry* heap, UINT32 count)
+{
+    SM_PriorityEntry* last = &heap[--count];
+    UINT32 index = heap[0].index;
+    UINT32 i = 0, child;
+
+    // Sift the last entry down from the top
+    while ((child = 2 * i + 1) < count)
+    {
+        if (child + 1 < count && SM_Before(&heap[child + 1], &heap[child]))
+            child++;
+        if (!SM_Before(&heap[child], last))
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    if (count > 0)
+        heap[i] = *last;
+    return index;
+}
+
+//----------------------------------------------------------------------------
+// SM_GetPriority
+//----------------------------------------------------------------------------
+static UINT32 SM_GetPriority(SM_Mailbox* mailbox, SM_Message* msgs, UINT32 maxCount)
+{
+    SM_PriorityLanes* lanes = mailbox->pPriority;
+    SM_EventQueue* queues[SM_PRIORITY_LEVELS];
+    SM_PriorityEntry entry;
+    UINT32 heapCount = ATOMIC_Load32(&lanes->heapCount);
+    UINT32 count = 0, level, index;
+
+    queues[SM_PRIORITY_HIGH] = &lanes->high;
+    queues[SM_PRIORITY_NORMAL] = &mailbox->queue;
+    queues[SM_PRIORITY_LOW] = &lanes->low;
+
+    // Take every queued event, most urgent level first
+    for (level=0; level<SM_PRIORITY_LEVELS; level++)
+    {
+        while (heapCount < lanes->heapCapacity)
+        {
+            index = lanes->freeEvents[heapCount];
+            if (!EQ_Get(queues[level], &lanes->events[index]))
+                break;
+            entry.priority = level;
+            entry.deadline = lanes->events[index].deadline;
+            entry.sequence = lanes->sequence++;
+            entry.index = index;
+            SM_HeapPush(lanes->heap, heapCount++, &entry);
+        }
+    }
+
+    // Deliver by priority, deadline and posting order
+    while (count < maxCount && heapCount > 0)
+    {
+        index = SM_HeapPop(lanes->heap, heapCount--);
+        memcpy(&msgs[count++], &lanes->events[index], sizeof(SM_Message));
+        lanes->freeEvents[heapCount] = index;
+    }
+
+    ATOMIC_Store32(&lanes->heapCount, heapCount);
+    return count;
+}
+
+//----------------------------------------------------------------------------
+// SM_LockGet
+//----------------------------------------------------------------------------
+static void SM_LockGet(SM_Mailbox* mailbox)
+{
+    // Held while taking queued events, so spin
+    while (!ATOMIC_CompareExchange32(&mailbox->getLock, FALSE, TRUE))
+        ATOMIC_Pause();
+}
+
+//----------------------------------------------------------------------------
+// SM_DropOldest
+//----------------------------------------------------------------------------
+static void SM_DropOldest(SM_Mailbox* mailbox, SM_EventQueue* queue)
+{
+    SM_CoalesceRule* rule = NULL;
+    SM_Message oldest;
+    BOOL taken;
+
+    // Take the oldest event as the consumer would
+    SM_LockGet(mailbox);
+    taken = EQ_Get(queue, &oldest);
+    ATOMIC_Store32(&mailbox->getLock, FALSE);
+
+    // Emptied by the consumer, or the oldest event not yet published
+    if (!taken)
+    {
+        ATOMIC_Pause();
+        return;
+    }
+
+    // A coalesced event placeholder drops the coalesced event
+    if (mailbox->coalesceCount)
+        rule = SM_FindRule(mailbox, oldest.eventFunc);
+    if (rule)
+    {
+        SM_LockRule(rule);
+        memcpy(&oldest, &rule->msg, sizeof(SM_Message));
+        rule->pending = FALSE;
+        ATOMIC_Store32(&rule->lock, FALSE);
+    }
+
+    _SM_ReleaseEventData(oldest.pEventData, (SM_DataOwnership)oldest.ownership, 
+        oldest.destructor, oldest.destructorContext);
+    ATOMIC_FetchAdd64(&mailbox->droppedOldest, 1);
+}
+
+//----------------------------------------------------------------------------
+// SM_Overflow
+//----------------------------------------------------------------------------
+static BOOL SM_Overflow(SM_Mailbox* mailbox, SM_EventQueue* queue, BOOL fault, UINT64* pWaitStart, BOOL* pResult)
+{
+    UINT64 now;
+
+    switch (mailbox->overflow)
+    {
+    case SM_OVERFLOW_DROP_NEWEST:
+        ATOMIC_FetchAdd64(&mailbox->droppedNewest, 1);
+        *pResult = TRUE;
+        return FALSE;
+    case SM_OVERFLOW_DROP_OLDEST:
+        SM_DropOldest(mailbox, queue);
+        return TRUE;
+    case SM_OVERFLOW_BLOCK:
+        // The thread that makes room may be waiting for this one
+        if (_SM_BatchMachine)
+            break;
+
+        now = TH_GetTimeNs();
+        if (*pWaitStart == 0)
+        {
+            *pWaitStart = now;
+            ATOMIC_FetchAdd64(&mailbox->blocked, 1);
+        }
+        if (mailbox->overflowTimeoutMs != SM_WAIT_INFINITE && 
+            now - *pWaitStart >= (UINT64)mailbox->overflowTimeoutMs * 1000000)
+            break;
+
+        // Yield while the consumer catches up, then sleep
+        if (now - *pWaitStart < 1000000)
+            TH_Yield();
+        else
+            TH_Sleep(1);
+        return TRUE;
+    case SM_OVERFLOW_FAULT:
+        if (fault)
+            ASSERT();
+        break;
+    default:
+        break;
+    }
+
+    ATOMIC_FetchAdd64(&mailbox->rejected, 1);
+    *pResult = FALSE;
+    return FALSE;
+}
+
+//----------------------------------------------------------------------------
+// SM_PostMessage
+//----------------------------------------------------------------------------
+static BOOL SM_PostMessage(SM_StateMachine* self, const SM_Message* msg, BOOL fault)
+{
+    SM_Mailbox* mailbox = NULL;
+    SM_EventQueue* queue = NULL;
+    SM_CoalesceRule* rule = NULL;
+    SM_Message routed, placeholder;
+    UINT64 waitStart = 0;
+    BOOL queued = FALSE, result = FALSE;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(msg->eventFunc);
+    ASSERT_TRUE(self->pMailbox);
+
+    mailbox = self->pMailbox;
+    queue = &mailbox->queue;
+
+    // Queue by priority and stamp the deadline
+    if (mailbox->pPriority)
+    {
+        memcpy(&routed, msg, sizeof(SM_Message));
+        queue = SM_Route(mailbox, &routed);
+        msg = &routed;
+    }
+
+    if (mailbox->coalesceCount)
+        rule = SM_FindRule(mailbox, msg->eventFunc);
+
+    while (!queued)
+    {
+        if (rule)
+        {
+            SM_LockRule(rule);
+            if (rule->pending)
+            {
+                // An event of this type is already queued. Coalesce with it; 
+                // the instance is already runnable.
+                SM_Coalesce(rule, msg);
+                ATOMIC_FetchAdd32(&mailbox->coalesced, 1);
+                ATOMIC_Store32(&rule->lock, FALSE);
+                return TRUE;
+            }
+
+            // Queue a placeholder. _SM_MailboxGet() swaps in rule->msg.
+            placeholder.eventFunc = msg->eventFunc;
+            placeholder.pEventData = NULL;
+            placeholder.inlineSize = 0;
+            placeholder.ownership = SM_DATA_BORROWED;
+            placeholder.deadline = msg->deadline;
+            queued = EQ_Put(queue, &placeholder);
+            if (queued)
+            {
+                memcpy(&rule->msg, msg, sizeof(SM_Message));
+                rule->pending = TRUE;
+            }
+            ATOMIC_Store32(&rule->lock, FALSE);
+        }
+        else
+        {
+            queued = EQ_Put(queue, msg);
+        }
+
+        // Mailbox full. Retry once the overflow policy made room, otherwise 
+        // the event data is released like an ignored event.
+        if (!queued && !SM_Overflow(mailbox, queue, fault, &waitStart, &result))
+        {
+            _SM_ReleaseEventData(msg->pEventData, (SM_DataOwnership)msg->ownership, 
+                msg->destructor, msg->destructorContext);
+            return result;
+        }
+    }
+
+    if (waitStart)
+        ATOMIC_FetchAdd64(&mailbox->blockedNs, (INT64)(TH_GetTimeNs() - waitStart));
+
+    if (mailbox->pScheduler)
+    {
+        // Make an idle scheduled instance runnable
+        if (!ATOMIC_Exchange32(&mailbox->scheduled, TRUE))
+            _SCH_Ready(mailbox->pScheduler, self);
+    }
+    else if (ATOMIC_Exchange32(&mailbox->waiting, FALSE))
+    {
+        // Only signal when the dispatcher thread is idle
+        SEM_SIGNAL(mailbox->hSem);
+    }
+
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// _SM_Post
+//----------------------------------------------------------------------------
+BOOL _SM_Post(SM_StateMachine* self, SM_EventFunc eventFunc, void* pEventData)
+{
+    SM_Message msg;
+
+    msg.eventFunc = eventFunc;
+    msg.pEventData = pEventData;
+    msg.inlineSize = 0;
+    msg.ownership = SM_DATA_OWNED;
+    msg.deadline = 0;
+    return SM_PostMessage(self, &msg, TRUE);
+}
+
+//----------------------------------------------------------------------------
+// _SM_PostCopy
+//----------------------------------------------------------------------------
+BOOL _SM_PostCopy(SM_StateMachine* self, SM_EventFunc eventFunc, const void* pEventData, size_t dataSize)
+{
+    SM_Message msg;
+
+    msg.eventFunc = eventFunc;
+    msg.pEventData = NULL;
+    msg.inlineSize = 0;
+    msg.ownership = SM_DATA_OWNED;
+    msg.deadline = 0;
+
+    // Small event data travels inside the mailbox slot
+    if (pEventData && dataSize <= SM_INLINE_DATA_SIZE)
+    {
+        memcpy(msg.inlineData.bytes, pEventData, dataSize);
+        msg.inlineSize = (UINT16)dataSize;
+    }
+    else if (pEventData)
+    {
+        // Out of event data memory fails the post like a full mailbox
+        msg.pEventData = SM_XAlloc(dataSize);
+        if (!msg.pEventData)
+        {
+            ASSERT_TRUE(self && self->pMailbox);
+            if (self->pMailbox->overflow == SM_OVERFLOW_FAULT)
+                ASSERT();
+            ATOMIC_FetchAdd64(&self->pMailbox->rejected, 1);
+            return FALSE;
+        }
+        memcpy(msg.pEventData, pEventData, dataSize);
+    }
+    return SM_PostMessage(self, &msg, TRUE);
+}
+
+//----------------------------------------------------------------------------
+// _SM_PostRef
+//----------------------------------------------------------------------------
+BOOL _SM_PostRef(SM_StateMachine* self, SM_EventFunc eventFunc, void* pEventData, 
+    SM_DataOwnership ownership, SM_DataDestructor destructor, void* context)
+{
+    SM_Message msg;
+
+    // The queued event holds its own reference to shared event data
+    if (pEventData && ownership == SM_DATA_SHARED)
+        SM_SharedAddRef(pEventData);
+
+    msg.eventFunc = eventFunc;
+    msg.pEventData = pEventData;
+    msg.inlineSize = 0;
+    msg.ownership = (BYTE)ownership;
+    msg.deadline = 0;
+    msg.destructor = destructor;
+    msg.destructorContext = context;
+    return SM_PostMessage(self, &msg, TRUE);
+}
+
+//----------------------------------------------------------------------------
+// _SM_PostDeadline
+//----------------------------------------------------------------------------
+BOOL _SM_PostDeadline(SM_StateMachine* self, SM_EventFunc eventFunc, void* pEventData, UINT32 deadlineMs)
+{
+    SM_Message msg;
+
+    msg.eventFunc = eventFunc;
+    msg.pEventData = pEventData;
+    msg.inlineSize = 0;
+    msg.ownership = SM_DATA_OWNED;
+    msg.deadline = SM_Deadline(deadlineMs);
+    return SM_PostMessage(self, &msg, TRUE);
+}
+
+//----------------------------------------------------------------------------
+// _SM_TryPost
+//----------------------------------------------------------------------------
+BOOL _SM_TryPost(SM_StateMachine* self, SM_EventFunc eventFunc)
+{
+    SM_Mailbox* mailbox = self->pMailbox;
+    SM_Message msg;
+    BOOL result = FALSE;
+
+    // A stopped instance has no mailbox. Stopping an instance waits for a 
+    // post in progress (see _SM_MailboxClose).
+    if (!mailbox)
+        return FALSE;
+    ATOMIC_FetchAdd32(&mailbox->tryPosts, 1);
+    ATOMIC_Fence();
+
+    // Fails instead of faulting on a full SM_OVERFLOW_FAULT mailbox
+    if (!ATOMIC_Load32(&mailbox->closed) && self->pMailbox == mailbox)
+    {
+        msg.eventFunc = eventFunc;
+        msg.pEventData = NULL;
+        msg.inlineSize = 0;
+        msg.ownership = SM_DATA_OWNED;
+        msg.deadline = 0;
+        result = SM_PostMessage(self, &msg, FALSE);
+    }
+
+    ATOMIC_FetchAdd32(&mailbox->tryPosts, (UINT32)-1);
+    return result;
+}
+
+//----------------------------------------------------------------------------
+// SM_PriorityCreate
+//----------------------------------------------------------------------------
+SM_PriorityLanes* SM_PriorityCreate(UINT32 capacity)
+{
+    SM_PriorityLanes init = {
+        { (EQ_Slot*)calloc(capacity, sizeof(EQ_Slot)), capacity, 0, 0, 0, 0 },
+        { (EQ_Slot*)calloc(capacity, sizeof(EQ_Slot)), capacity, 0, 0, 0, 0 },
+        (SM_PriorityEntry*)calloc(capacity, sizeof(SM_PriorityEntry)),
+        (SM_Message*)calloc(capacity, sizeof(SM_Message)),
+        (UINT32*)calloc(capacity, sizeof(UINT32)),
+        capacity, 0, 0 };
+    SM_PriorityLanes* lanes = NULL;
+
+    // Each level queue capacity must be a power of 2
+    ASSERT_TRUE(capacity > 0 && (capacity & (capacity - 1)) == 0);
+    ASSERT_TRUE(init.high.slots && init.low.slots && init.heap && init.events && init.freeEvents);
+
+    lanes = (SM_PriorityLanes*)malloc(sizeof(SM_PriorityLanes));
+    ASSERT_TRUE(lanes);
+    memcpy(lanes, &init, sizeof(SM_PriorityLanes));
+    return lanes;
+}
+
+//----------------------------------------------------------------------------
+// SM_PriorityDestroy
+//----------------------------------------------------------------------------
+void SM_PriorityDestroy(SM_PriorityLanes* lanes)
+{
+    if (!lanes)
+        return;
+    free(lanes->high.slots);
+    free(lanes->low.slots);
+    free(lanes->heap);
+    free(lanes->events);
+    free(lanes->freeEvents);
+    free(lanes);
+}
+
+//----------------------------------------------------------------------------
+// _SM_MailboxPriority
+//----------------------------------------------------------------------------
+void _SM_MailboxPriority(SM_Mailbox* mailbox, SM_EventFunc eventFunc, 
+    SM_Priority priority, UINT32 deadlineMs)
+{
+    SM_PriorityLanes* lanes = NULL;
+    UINT32 i;
+
+    ASSERT_TRUE(mailbox);
+    ASSERT_TRUE(mailbox->pPriority);
+    ASSERT_TRUE(eventFunc);
+    ASSERT_TRUE(priority < SM_PRIORITY_LEVELS);
+
+    // Rules can't change while events are posted
+    ASSERT_TRUE(mailbox->hThread == NULL && mailbox->pScheduler == NULL);
+
+    lanes = mailbox->pPriority;
+    for (i=0; i<lanes->ruleCount && lanes->rules[i].eventFunc != eventFunc; i++)
+        ;
+    if (i == lanes->ruleCount)
+    {
+        ASSERT_TRUE(lanes->ruleCount < SM_PRIORITY_RULES_MAX);
+        lanes->ruleCount++;
+    }
+
+    lanes->rules[i].eventFunc = eventFunc;
+    lanes->rules[i].priority = priority;
+    lanes->rules[i].deadlineMs = deadlineMs;
+}
+
+//----------------------------------------------------------------------------
+// _SM_MailboxInit
+//----------------------------------------------------------------------------
+void _SM_MailboxInit(SM_Mailbox* mailbox)
+{
+    UINT32 i;
+
+    ASSERT_TRUE(mailbox);
+
+    EQ_Init(&mailbox->queue);
+    ATOMIC_Store32(&mailbox->getLock, FALSE);
+    ATOMIC_Store32(&mailbox->closed, FALSE);
+    if (mailbox->pPriority)
+    {
+        EQ_Init(&mailbox->pPriority->high);
+        EQ_Init(&mailbox->pPriority->low);
+        ATOMIC_Store32(&mailbox->pPriority->heapCount, 0);
+        mailbox->pPriority->sequence = 0;
+        for (i=0; i<mailbox->pPriority->heapCapacity; i++)
+            mailbox->pPriority->freeEvents[i] = i;
+    }
+}
+
+//----------------------------------------------------------------------------
+// _SM_MailboxClose
+//----------------------------------------------------------------------------
+void _SM_MailboxClose(SM_Mailbox* mailbox)
+{
+    ASSERT_TRUE(mailbox);
+
+    // Fail new _SM_TryPost calls, then wait out those in progress. Their 
+    // consumer still runs, so a post waiting for room completes.
+    ATOMIC_Store32(&mailbox->closed, TRUE);
+    ATOMIC_Fence();
+    while (ATOMIC_Load32(&mailbox->tryPosts))
+        TH_Yield();
+}
+
+//----------------------------------------------------------------------------
+// _SM_MailboxDepth
+//----------------------------------------------------------------------------
+UINT32 _SM_MailboxDepth(SM_Mailbox* mailbox)
+{
+    UINT32 depth = 0;
+
+    ASSERT_TRUE(mailbox);
+
+    depth = EQ_Depth(&mailbox->queue);
+    if (mailbox->pPriority)
+    {
+        depth += EQ_Depth(&mailbox->pPriority->high) + EQ_Depth(&mailbox->pPriority->low) + 
+            ATOMIC_Load32(&mailbox->pPriority->heapCount);
+    }
+    return depth;
+}
+
+//----------------------------------------------------------------------------
+// _SM_MailboxCoalesce
+//----------------------------------------------------------------------------
+void _SM_MailboxCoalesce(SM_Mailbox* mailbox, SM_EventFunc eventFunc, 
+    SM_CoalescePolicy policy, SM_MergeFunc merge)
+{
+    SM_CoalesceRule* rule = NULL;
+
+    ASSERT_TRUE(mailbox);
+    ASSERT_TRUE(eventFunc);
+    ASSERT_TRUE((policy == SM_COALESCE_MERGE) == (merge != NULL));
+
+    // Rules can't change while events are posted
+    ASSERT_TRUE(mailbox->hThread == NULL && mailbox->pScheduler == NULL);
+
+    rule = SM_FindRule(mailbox, eventFunc);
+    if (!rule)
+    {
+        ASSERT_TRUE(mailbox->coalesceCount < SM_COALESCE_MAX);
+        rule = &mailbox->coalesce[mailbox->coalesceCount++];
+    }
+
+    rule->eventFunc = eventFunc;
+    rule->policy = policy;
+    rule->merge = merge;
+    ATOMIC_Store32(&rule->lock, FALSE);
+    rule->pending = FALSE;
+}
+
+//----------------------------------------------------------------------------
+// _SM_MailboxGet
+//----------------------------------------------------------------------------
+UINT32 _SM_MailboxGet(SM_Mailbox* mailbox, SM_Message* msgs, UINT32 maxCount)
+{
+    SM_CoalesceRule* rule = NULL;
+    UINT32 count, i;
+
+    // Producers dropping the oldest event also take events
+    if (mailbox->overflow == SM_OVERFLOW_DROP_OLDEST)
+        SM_LockGet(mailbox);
+
+    if (mailbox->pPriority)
+        count = SM_GetPriority(mailbox, msgs, maxCount);
+    else
+        count = EQ_GetBatch(&mailbox->queue, msgs, maxCount);
+
+    if (mailbox->overflow == SM_OVERFLOW_DROP_OLDEST)
+        ATOMIC_Store32(&mailbox->getLock, FALSE);
+
+    // Swap each coalesced event placeholder for the coalesced event. Posts 
+    // after this queue a new placeholder.
+    if (mailbox->coalesceCount)
+    {
+        for (i=0; i<count; i++)
+        {
+            rule = SM_FindRule(mailbox, msgs[i].eventFunc);
+            if (rule)
+            {
+                SM_LockRule(rule);
+                memcpy(&msgs[i], &rule->msg, sizeof(SM_Message));
+                rule->pending = FALSE;
+                ATOMIC_Store32(&rule->lock, FALSE);
+            }
+        }
+    }
+
+    return count;
+}
+
+//----------------------------------------------------------------------------
+// _SM_MailboxOverflow
+//----------------------------------------------------------------------------
+void _SM_MailboxOverflow(SM_Mailbox* mailbox, SM_OverflowPolicy policy, UINT32 timeoutMs)
+{
+    ASSERT_TRUE(mailbox);
+    ASSERT_TRUE(policy <= SM_OVERFLOW_BLOCK);
+
+    // The policy can't change while events are posted
+    ASSERT_TRUE(mailbox->hThread == NULL && mailbox->pScheduler == NULL);
+
+    mailbox->overflow = policy;
+    mailbox->overflowTimeoutMs = timeoutMs;
+}
+
+//----------------------------------------------------------------------------
+// _SM_MailboxGetStats
+//----------------------------------------------------------------------------
+void _SM_MailboxGetStats(SM_Mailbox* mailbox, SM_OverflowStats* stats)
+{
+    ASSERT_TRUE(mailbox);
+    ASSERT_TRUE(stats);
+
+    stats->rejected = (UINT64)ATOMIC_Load64(&mailbox->rejected);
+    stats->droppedNewest = (UINT64)ATOMIC_Load64(&mailbox->droppedNewest);
+    stats->droppedOldest = (UINT64)ATOMIC_Load64(&mailbox->droppedOldest);
+    stats->blocked = (UINT64)ATOMIC_Load64(&mailbox->blocked);
+    stats->blockedNs = (UINT64)ATOMIC_Load64(&mailbox->blockedNs);
+}
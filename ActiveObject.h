@@ -0,0 +1,291 @@
+// The ActiveObject module adds an opt-in active object mode to a state 
+// machine instance. An active instance owns an event mailbox and a 
+// dispatcher thread. SM_Post() queues an external event and returns 
+// immediately; the dispatcher thread executes the queued events one at a 
+// time, so run-to-completion holds per instance without a global lock. 
+//
+// The mailbox is a lock-free EventQueue. Producers never take a lock and
+// only touch the dispatcher's semaphore when the dispatcher is idle.
+//
+// Event data posted with SM_Post() must be created with SM_XAlloc, exactly 
+// as for SM_Event(). Once an instance is active, only post events to it; 
+// calling SM_Event() from another thread bypasses the mailbox. 
+// SM_PostCopy() instead copies the event data; small event data is carried 
+// inside the mailbox slot and nothing is allocated. SM_PostShared(), 
+// SM_PostBorrowed() and SM_PostExternal() queue event data with the 
+// ownership modes of SM_EventShared() etc. (see StateMachine.h); borrowed 
+// data must stay valid until the event executes.
+//
+// A mailbox may instead be attached to a Scheduler (see Scheduler.h), in 
+// which case a worker thread from a shared pool executes the queued events.
+//
+// A post to a full mailbox fails by default; the caller sees FALSE and the
+// failure is counted (see SM_MailboxGetStats). SM_MailboxOverflow() selects
+// another policy: fault, drop the new or the oldest event, or wait for room.
+//
+// Events where only the latest occurrence matters, e.g. a periodic poll, 
+// may be coalesced with SM_MailboxCoalesce() before the mailbox is started. 
+// At most one event of a coalesced type is then queued. Posting it again 
+// while it is queued either drops the new event (SM_COALESCE_DROP), 
+// replaces the queued event data (SM_COALESCE_LATEST) or merges the new 
+// event data into the queued event data with a callback (SM_COALESCE_MERGE). 
+// The coalesced event executes at the queue position of its first post.
+// Merged event data must be owned, i.e. posted with SM_Post or SM_PostCopy.
+//
+// A mailbox defined with SM_MAILBOX_PRIORITY_DEFINE delivers events by 
+// priority. SM_MailboxPriority() assigns an event type a priority level and 
+// an optional deadline in ms after posting; other events are 
+// SM_PRIORITY_NORMAL without a deadline, and SM_PostDeadline() sets the 
+// deadline of a single event. Each level has its own queue, so routine 
+// traffic can't fill the room of urgent events. Queued events execute 
+// highest priority first, within a level earliest deadline first, then 
+// events without a deadline in posting order. A running event is never 
+// preempted. A high priority event waits for at most two batches (64) of 
+// already taken lower priority events, regardless of the backlog. On a 
+// Scheduler, the instance itself still waits its turn among instances.
+//
+// #include "ActiveObject.h"
+// SM_DEFINE(Motor1SM, &motorObj1)
+// SM_MAILBOX_PRIORITY_DEFINE(Motor1SM, 16)
+//
+// void main() 
+// {
+//      SM_MailboxCoalesce(Motor1SM, MTR_SetSpeed, SM_COALESCE_LATEST, NULL);
+//      SM_MailboxPriority(Motor1SM, MTR_Halt, SM_PRIORITY_HIGH, 0);
+//      SM_MailboxOverflow(Motor1SM, SM_OVERFLOW_BLOCK, 10);
+//      SM_ActiveStart(Motor1SM);
+//      SM_Post(Motor1SM, MTR_Halt, NULL);
+//      SM_ActiveStop(Motor1SM);
+// }
+
+#ifndef _ACTIVE_OBJECT_H
+#define _ACTIVE_OBJECT_H
+
+#include "DataTypes.h"
+#include "StateMachine.h"
+#include "EventQueue.h"
+#include "Atomic.h"
+#include "Semaphore.h"
+#include "Thread.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct SM_Scheduler;
+
+// Maximum coalesced event types per mailbox
+#ifndef SM_COALESCE_MAX
+#define SM_COALESCE_MAX     2
+#endif
+
+typedef enum
+{
+    SM_COALESCE_DROP,       // Keep the queued event, drop the new one
+    SM_COALESCE_LATEST,     // Replace the queued event data with the new event data
+    SM_COALESCE_MERGE       // Merge the new event data into the queued event data
+} SM_CoalescePolicy;
+
+// Merges the event data of a new event into the event data of the queued 
+// event. The new event data is released afterwards.
+typedef void (*SM_MergeFunc)(void* pQueuedData, const void* pEventData);
+
+typedef struct
+{
+    SM_EventFunc eventFunc;
+    SM_CoalescePolicy policy;
+    SM_MergeFunc merge;
+    ATOMIC32 lock;          // Guards pending and msg
+    BOOL pending;           // Placeholder for msg queued in the mailbox
+    SM_Message msg;         // Event executed in place of the placeholder
+} SM_CoalesceRule;
+
+// Maximum event types with a priority rule per mailbox
+#ifndef SM_PRIORITY_RULES_MAX
+#define SM_PRIORITY_RULES_MAX   4
+#endif
+
+typedef enum
+{
+    SM_PRIORITY_HIGH,
+    SM_PRIORITY_NORMAL,
+    SM_PRIORITY_LOW,
+    SM_PRIORITY_LEVELS
+} SM_Priority;
+
+typedef struct
+{
+    SM_EventFunc eventFunc;
+    SM_Priority priority;
+    UINT32 deadlineMs;      // Deadline after posting, or 0 for none
+} SM_PriorityRule;
+
+// Delivery order of an event taken from a priority queue
+typedef struct
+{
+    UINT32 priority;
+    UINT32 deadline;        // SM_Message::deadline
+    UINT32 sequence;        // Order taken from the queues
+    UINT32 index;           // Event in SM_PriorityLanes::events
+} SM_PriorityEntry;
+
+// Priority delivery of a mailbox. The mailbox queue holds the 
+// SM_PRIORITY_NORMAL events. Taken events are owned by the consumer.
+typedef struct SM_PriorityLanes
+{
+    SM_EventQueue high;
+    SM_EventQueue low;
+    SM_PriorityEntry* const heap;       // Taken events, most urgent first
+    SM_Message* const events;           // Taken event storage
+    UINT32* const freeEvents;           // Unused events indexes from heapCount on
+    const UINT32 heapCapacity;
+    ATOMIC32 heapCount;
+    UINT32 sequence;
+    SM_PriorityRule rules[SM_PRIORITY_RULES_MAX];   // See SM_MailboxPriority
+    UINT32 ruleCount;
+} SM_PriorityLanes;
+
+// Waits for room without a timeout (see SM_MailboxOverflow)
+#define SM_WAIT_INFINITE    (0xFFFFFFFF)
+
+typedef enum
+{
+    SM_OVERFLOW_FAIL,           // Fail the post (the default)
+    SM_OVERFLOW_FAULT,          // Call FaultHandler, fail the post
+    SM_OVERFLOW_DROP_NEWEST,    // Drop the posted event, the post succeeds
+    SM_OVERFLOW_DROP_OLDEST,    // Drop the oldest queued event, queue the posted event
+    SM_OVERFLOW_BLOCK           // Wait for room up to the timeout, then fail the post
+} SM_OverflowPolicy;
+
+// Overflows of a mailbox since it was defined
+typedef struct
+{
+    UINT64 rejected;            // Posts failed
+    UINT64 droppedNewest;       // Posted events dropped
+    UINT64 droppedOldest;       // Queued events dropped
+    UINT64 blocked;             // Posts that waited for room
+    UINT64 blockedNs;           // Total time posts waited for room
+} SM_OverflowStats;
+
+// Use SM_MAILBOX_DEFINE to declare an SM_Mailbox object
+typedef struct SM_Mailbox
+{
+    SM_EventQueue queue;
+    ATOMIC32 waiting;
+    ATOMIC32 exit;
+    SEMAPHORE_HANDLE hSem;
+    THREAD_HANDLE hThread;
+    struct SM_Scheduler* pScheduler;    // Scheduler executing the instance, or NULL
+    ATOMIC32 scheduled;                 // Instance runnable or running on a scheduler
+    SM_PriorityLanes* pPriority;        // Priority delivery, or NULL (see SM_MAILBOX_PRIORITY_DEFINE)
+    SM_CoalesceRule coalesce[SM_COALESCE_MAX];  // See SM_MailboxCoalesce
+    UINT32 coalesceCount;
+    ATOMIC32 coalesced;                 // Events dropped, replaced or merged
+    SM_OverflowPolicy overflow;         // See SM_MailboxOverflow
+    UINT32 overflowTimeoutMs;
+    ATOMIC32 getLock;                   // Serializes taking events, SM_OVERFLOW_DROP_OLDEST only
+    ATOMIC64 rejected;                  // See SM_OverflowStats
+    ATOMIC64 droppedNewest;
+    ATOMIC64 droppedOldest;
+    ATOMIC64 blocked;
+    ATOMIC64 blockedNs;
+    ATOMIC32 closed;                    // Stopping or stopped, _SM_TryPost fails
+    ATOMIC32 tryPosts;                  // _SM_TryPost calls in progress
+} SM_Mailbox;
+
+// Defines the mailbox message storage and mailbox instance for a state 
+// machine. On the example below, the SM_Mailbox instance is Motor1SMMailbox.
+// _smName_ - the state machine name used with SM_DEFINE
+// _capacity_ - maximum number of queued events. Must be a power of 2.
+// e.g. SM_MAILBOX_DEFINE(Motor1SM, 16)
+#define SM_MAILBOX_DEFINE(_smName_, _capacity_) \
+    static EQ_Slot _smName_##MailboxSlots[_capacity_]; \
+    static SM_Mailbox _smName_##Mailbox = { { _smName_##MailboxSlots, _capacity_, 0, 0, 0, 0 }, \
+        0, 0, NULL, NULL, NULL, 0, NULL };
+
+// Defines a mailbox with priority delivery (see SM_MailboxPriority). Each 
+// priority level queues up to _capacity_ events. Must be a power of 2.
+// e.g. SM_MAILBOX_PRIORITY_DEFINE(Motor1SM, 16)
+#define SM_MAILBOX_PRIORITY_DEFINE(_smName_, _capacity_) \
+    static EQ_Slot _smName_##MailboxSlots[_capacity_]; \
+    static EQ_Slot _smName_##MailboxHighSlots[_capacity_]; \
+    static EQ_Slot _smName_##MailboxLowSlots[_capacity_]; \
+    static SM_PriorityEntry _smName_##MailboxHeap[_capacity_]; \
+    static SM_Message _smName_##MailboxEvents[_capacity_]; \
+    static UINT32 _smName_##MailboxFree[_capacity_]; \
+    static SM_PriorityLanes _smName_##MailboxLanes = { \
+        { _smName_##MailboxHighSlots, _capacity_, 0, 0, 0, 0 }, \
+        { _smName_##MailboxLowSlots, _capacity_, 0, 0, 0, 0 }, \
+        _smName_##MailboxHeap, _smName_##MailboxEvents, _smName_##MailboxFree, \
+        _capacity_, 0, 0 }; \
+    static SM_Mailbox _smName_##Mailbox = { { _smName_##MailboxSlots, _capacity_, 0, 0, 0, 0 }, \
+        0, 0, NULL, NULL, NULL, 0, &_smName_##MailboxLanes };
+
+// Public functions
+#define SM_ActiveStart(_smName_) \
+    _SM_ActiveStart(&_smName_##Obj, &_smName_##Mailbox)
+#define SM_ActiveStop(_smName_) \
+    _SM_ActiveStop(&_smName_##Obj)
+#define SM_Post(_smName_, _eventFunc_, _eventData_) \
+    (SM_CHECK_EVENT(_eventFunc_, _eventData_), \
+    _SM_Post(&_smName_##Obj, (SM_EventFunc)_eventFunc_, _eventData_))
+#define SM_PostCopy(_smName_, _eventFunc_, _eventData_) \
+    (SM_CHECK_EVENT(_eventFunc_, _eventData_), \
+    _SM_PostCopy(&_smName_##Obj, (SM_EventFunc)_eventFunc_, _eventData_, sizeof(*(_eventData_))))
+#define SM_PostBorrowed(_smName_, _eventFunc_, _eventData_) \
+    (SM_CHECK_EVENT(_eventFunc_, _eventData_), \
+    _SM_PostRef(&_smName_##Obj, (SM_EventFunc)_eventFunc_, _eventData_, SM_DATA_BORROWED, NULL, NULL))
+#define SM_PostShared(_smName_, _eventFunc_, _eventData_) \
+    (SM_CHECK_EVENT(_eventFunc_, _eventData_), \
+    _SM_PostRef(&_smName_##Obj, (SM_EventFunc)_eventFunc_, _eventData_, SM_DATA_SHARED, NULL, NULL))
+#define SM_PostExternal(_smName_, _eventFunc_, _eventData_, _destructor_, _context_) \
+    (SM_CHECK_EVENT(_eventFunc_, _eventData_), \
+    _SM_PostRef(&_smName_##Obj, (SM_EventFunc)_eventFunc_, _eventData_, SM_DATA_EXTERNAL, _destructor_, _context_))
+#define SM_PostDeadline(_smName_, _eventFunc_, _eventData_, _deadlineMs_) \
+    (SM_CHECK_EVENT(_eventFunc_, _eventData_), \
+    _SM_PostDeadline(&_smName_##Obj, (SM_EventFunc)_eventFunc_, _eventData_, _deadlineMs_))
+#define SM_MailboxDepth(_smName_) \
+    _SM_MailboxDepth(&_smName_##Mailbox)
+#define SM_MailboxHighWater(_smName_) \
+    EQ_HighWater(&_smName_##Mailbox.queue)
+#define SM_MailboxCoalesce(_smName_, _eventFunc_, _policy_, _merge_) \
+    _SM_MailboxCoalesce(&_smName_##Mailbox, (SM_EventFunc)_eventFunc_, _policy_, (SM_MergeFunc)_merge_)
+#define SM_MailboxCoalesced(_smName_) \
+    ATOMIC_Load32(&_smName_##Mailbox.coalesced)
+#define SM_MailboxPriority(_smName_, _eventFunc_, _priority_, _deadlineMs_) \
+    _SM_MailboxPriority(&_smName_##Mailbox, (SM_EventFunc)_eventFunc_, _priority_, _deadlineMs_)
+#define SM_MailboxOverflow(_smName_, _policy_, _timeoutMs_) \
+    _SM_MailboxOverflow(&_smName_##Mailbox, _policy_, _timeoutMs_)
+#define SM_MailboxGetStats(_smName_, _stats_) \
+    _SM_MailboxGetStats(&_smName_##Mailbox, _stats_)
+
+// Priority delivery for mailboxes created at runtime. Assign the result to 
+// SM_Mailbox::pPriority before the mailbox is started.
+SM_PriorityLanes* SM_PriorityCreate(UINT32 capacity);
+void SM_PriorityDestroy(SM_PriorityLanes* lanes);
+
+// Private functions
+void _SM_ActiveStart(SM_StateMachine* self, SM_Mailbox* mailbox);
+void _SM_ActiveStop(SM_StateMachine* self);
+BOOL _SM_Post(SM_StateMachine* self, SM_EventFunc eventFunc, void* pEventData);
+BOOL _SM_PostCopy(SM_StateMachine* self, SM_EventFunc eventFunc, const void* pEventData, size_t dataSize);
+BOOL _SM_PostRef(SM_StateMachine* self, SM_EventFunc eventFunc, void* pEventData, 
+    SM_DataOwnership ownership, SM_DataDestructor destructor, void* context);
+BOOL _SM_PostDeadline(SM_StateMachine* self, SM_EventFunc eventFunc, void* pEventData, UINT32 deadlineMs);
+BOOL _SM_TryPost(SM_StateMachine* self, SM_EventFunc eventFunc);
+void _SM_MailboxPriority(SM_Mailbox* mailbox, SM_EventFunc eventFunc, 
+    SM_Priority priority, UINT32 deadlineMs);
+void _SM_MailboxInit(SM_Mailbox* mailbox);
+void _SM_MailboxClose(SM_Mailbox* mailbox);
+UINT32 _SM_MailboxDepth(SM_Mailbox* mailbox);
+void _SM_MailboxCoalesce(SM_Mailbox* mailbox, SM_EventFunc eventFunc, 
+    SM_CoalescePolicy policy, SM_MergeFunc merge);
+UINT32 _SM_MailboxGet(SM_Mailbox* mailbox, SM_Message* msgs, UINT32 maxCount);
+void _SM_MailboxOverflow(SM_Mailbox* mailbox, SM_OverflowPolicy policy, UINT32 timeoutMs);
+void _SM_MailboxGetStats(SM_Mailbox* mailbox, SM_OverflowStats* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _ACTIVE_OBJECT_H
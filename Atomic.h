@@ -0,0 +1,84 @@
+// The Atomic module provides the small set of atomic operations used by the
+// lock-free code. GCC and Clang use the __atomic builtins, Visual C++ uses
+// the Interlocked intrinsics. Loads have acquire and stores have release 
+// semantics. Read-modify-write operations are sequentially consistent. 
+
+#ifndef _ATOMIC_H
+#define _ATOMIC_H
+
+#include "DataTypes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_MSC_VER)
+    #include <intrin.h>
+    #define ATOMIC_INLINE static __inline
+#else
+    #define ATOMIC_INLINE static inline
+#endif
+
+typedef volatile UINT32 ATOMIC32;
+typedef volatile INT64 ATOMIC64;
+typedef void* volatile ATOMIC_PTR;
+
+#if defined(_MSC_VER)
+
+ATOMIC_INLINE UINT32 ATOMIC_Load32(const ATOMIC32* p) { UINT32 v = *p; _ReadWriteBarrier(); return v; }
+ATOMIC_INLINE void ATOMIC_Store32(ATOMIC32* p, UINT32 v) { _ReadWriteBarrier(); *p = v; }
+ATOMIC_INLINE UINT32 ATOMIC_FetchAdd32(ATOMIC32* p, UINT32 v) { return (UINT32)_InterlockedExchangeAdd((volatile long*)p, (long)v); }
+ATOMIC_INLINE UINT32 ATOMIC_Exchange32(ATOMIC32* p, UINT32 v) { return (UINT32)_InterlockedExchange((volatile long*)p, (long)v); }
+ATOMIC_INLINE BOOL ATOMIC_CompareExchange32(ATOMIC32* p, UINT32 expected, UINT32 desired) 
+    { return (UINT32)_InterlockedCompareExchange((volatile long*)p, (long)desired, (long)expected) == expected; }
+
+ATOMIC_INLINE INT64 ATOMIC_Load64(const ATOMIC64* p) { return _InterlockedCompareExchange64((ATOMIC64*)p, 0, 0); }
+ATOMIC_INLINE void ATOMIC_Store64(ATOMIC64* p, INT64 v) { _InterlockedExchange64(p, v); }
+ATOMIC_INLINE INT64 ATOMIC_FetchAdd64(ATOMIC64* p, INT64 v) { return _InterlockedExchangeAdd64(p, v); }
+ATOMIC_INLINE BOOL ATOMIC_CompareExchange64(ATOMIC64* p, INT64 expected, INT64 desired)
+    { return _InterlockedCompareExchange64(p, desired, expected) == expected; }
+
+ATOMIC_INLINE void* ATOMIC_LoadPtr(ATOMIC_PTR* p) { void* v = *p; _ReadWriteBarrier(); return v; }
+ATOMIC_INLINE void ATOMIC_StorePtr(ATOMIC_PTR* p, void* v) { _ReadWriteBarrier(); *p = v; }
+ATOMIC_INLINE void* ATOMIC_ExchangePtr(ATOMIC_PTR* p, void* v) { return _InterlockedExchangePointer(p, v); }
+ATOMIC_INLINE BOOL ATOMIC_CompareExchangePtr(ATOMIC_PTR* p, void* expected, void* desired)
+    { return _InterlockedCompareExchangePointer(p, desired, expected) == expected; }
+
+#define ATOMIC_Fence()      MemoryBarrier()
+#define ATOMIC_Pause()      YieldProcessor()
+
+#else
+
+ATOMIC_INLINE UINT32 ATOMIC_Load32(const ATOMIC32* p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+ATOMIC_INLINE void ATOMIC_Store32(ATOMIC32* p, UINT32 v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+ATOMIC_INLINE UINT32 ATOMIC_FetchAdd32(ATOMIC32* p, UINT32 v) { return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST); }
+ATOMIC_INLINE UINT32 ATOMIC_Exchange32(ATOMIC32* p, UINT32 v) { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST); }
+ATOMIC_INLINE BOOL ATOMIC_CompareExchange32(ATOMIC32* p, UINT32 expected, UINT32 desired)
+    { return __atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); }
+
+ATOMIC_INLINE INT64 ATOMIC_Load64(const ATOMIC64* p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+ATOMIC_INLINE void ATOMIC_Store64(ATOMIC64* p, INT64 v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+ATOMIC_INLINE INT64 ATOMIC_FetchAdd64(ATOMIC64* p, INT64 v) { return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST); }
+ATOMIC_INLINE BOOL ATOMIC_CompareExchange64(ATOMIC64* p, INT64 expected, INT64 desired)
+    { return __atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); }
+
+ATOMIC_INLINE void* ATOMIC_LoadPtr(ATOMIC_PTR* p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+ATOMIC_INLINE void ATOMIC_StorePtr(ATOMIC_PTR* p, void* v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+ATOMIC_INLINE void* ATOMIC_ExchangePtr(ATOMIC_PTR* p, void* v) { return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST); }
+ATOMIC_INLINE BOOL ATOMIC_CompareExchangePtr(ATOMIC_PTR* p, void* expected, void* desired)
+    { return __atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); }
+
+#define ATOMIC_Fence()      __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#if defined(__x86_64__) || defined(__i386__)
+    #define ATOMIC_Pause()  __builtin_ia32_pause()
+#else
+    #define ATOMIC_Pause()  ((void)0)
+#endif
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _ATOMIC_H
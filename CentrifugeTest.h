@@ -13,16 +13,34 @@ BOOL CFG_IsPollActive(); - 这是一个查询函数，可能用于检查当前
 // 引入相关的数据类型和状态机定义文件
 #include "DataTypes.h"   // 可能定义了一些专门的数据类型
 #include "StateMachine.h"   // 提供状态机相关的宏定义和函数接口
+#include "Timer.h"
+#include "Atomic.h"
+
+// Centrifuge test instance data. Additional instances may be defined with
+// SM_DEFINE_TYPED(name, &instance, CentrifugeTest); only active objects or
+// instances attached to a Scheduler receive CFG_Poll timer events.
+typedef struct
+{
+    INT speed;           // 离心机的转速
+    ATOMIC32 pollActive; // 轮询活动状态标志
+    SM_Timer pollTimer;  // Periodic CFG_Poll event while polling
+    ATOMIC32 testCount;  // Tests completed or failed
+} CentrifugeTest;
 
 // 使用宏声明一个名为CentrifugeTestSM的状态机的私有实例
 SM_DECLARE(CentrifugeTestSM)
 
-// 声明三个状态机事件函数。这些事件没有附带数据。
-EVENT_DECLARE(CFG_Start, NoEventData)
-EVENT_DECLARE(CFG_Cancel, NoEventData)
-EVENT_DECLARE(CFG_Poll, NoEventData)
+// Event IDs, state machine type and event functions, generated from 
+// CentrifugeTest.sm
+#include "CentrifugeTest_sm.h"
 
 // 定义一个函数，用于检查是否处于Poll状态
 BOOL CFG_IsPollActive();
 
+// Number of tests that completed or failed. When CentrifugeTestSM runs as an
+// active object or on a Scheduler, CFG_Poll events are generated by a timer
+// (see Timer.h) and TMR_Init() must be called first. Called synchronously 
+// with SM_Event(), the caller sends CFG_Poll while CFG_IsPollActive().
+UINT32 CFG_GetTestCount(void);
+
 #endif // _CENTRIFUGE_TEST_H
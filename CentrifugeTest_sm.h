@@ -0,0 +1,24 @@
+// Generated by sm_gen from CentrifugeTest.sm. Do not edit.
+
+#ifndef _CENTRIFUGE_TEST_SM_H
+#define _CENTRIFUGE_TEST_SM_H
+
+#include "StateMachine.h"
+
+// CentrifugeTest event IDs, the rows of the transition matrix (SM_DispatchById)
+enum CentrifugeTestEvents
+{
+    CFG_START_EVENT,
+    CFG_CANCEL_EVENT,
+    CFG_POLL_EVENT,
+    CFG_MAX_EVENTS
+};
+
+// CentrifugeTest state machine type, for SM_DEFINE_TYPED
+SM_CONST_DECLARE(CentrifugeTest)
+
+EVENT_DECLARE(CFG_Start, NoEventData)
+EVENT_DECLARE(CFG_Cancel, NoEventData)
+EVENT_DECLARE(CFG_Poll, NoEventData)
+
+#endif // _CENTRIFUGE_TEST_SM_H
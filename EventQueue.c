@@ -0,0 +1,136 @@
+#include "EventQueue.h"
+#include "Fault.h"
+
+// Get the slot for a ticket. The capacity is a power of 2 so ticket 
+// wraparound maps onto the same slot sequence.
+#define EQ_SLOT(_self_, _ticket_) \
+    (&(_self_)->slots[(_ticket_) & ((_self_)->capacity - 1)])
+
+//----------------------------------------------------------------------------
+// EQ_Init
+//----------------------------------------------------------------------------
+void EQ_Init(SM_EventQueue* self)
+{
+    UINT32 i;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(self->capacity > 0);
+    ASSERT_TRUE((self->capacity & (self->capacity - 1)) == 0);
+
+    // A slot is free for ticket t when its sequence equals t
+    for (i=0; i<self->capacity; i++)
+        ATOMIC_Store32(&self->slots[i].sequence, i);
+
+    ATOMIC_Store32(&self->reserved, 0);
+    ATOMIC_Store32(&self->tail, 0);
+    ATOMIC_Store32(&self->highWater, 0);
+    self->head = 0;
+}
+
+//----------------------------------------------------------------------------
+// EQ_Put
+//----------------------------------------------------------------------------
+BOOL EQ_Put(SM_EventQueue* self, const SM_Message* msg)
+{
+    UINT32 ticket, depth;
+    EQ_Slot* slot;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(msg);
+
+    // Reserve room. A reservation succeeds only while fewer than capacity
+    // messages are outstanding, which guarantees the ticket's slot was 
+    // consumed. The depth never exceeds capacity, so a full queue fails 
+    // only the producers that find it full.
+    do
+    {
+        depth = ATOMIC_Load32(&self->reserved);
+        if (depth >= self->capacity)
+            return FALSE;
+    } while (!ATOMIC_CompareExchange32(&self->reserved, depth, depth + 1));
+
+    // Take a slot ticket
+    ticket = ATOMIC_FetchAdd32(&self->tail, 1);
+    slot = EQ_SLOT(self, ticket);
+
+    // The reservation guarantees the consumer released this slot. The 
+    // acquire load orders our write after the consumer's read.
+    while (ATOMIC_Load32(&slot->sequence) != ticket)
+        ATOMIC_Pause();
+
+    // Copy the message and publish the slot to the consumer
+    slot->msg = *msg;
+    ATOMIC_Store32(&slot->sequence, ticket + 1);
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// EQ_Get
+//----------------------------------------------------------------------------
+BOOL EQ_Get(SM_EventQueue* self, SM_Message* msg)
+{
+    EQ_Slot* slot;
+    UINT32 depth;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(msg);
+
+    slot = EQ_SLOT(self, self->head);
+
+    // Has the producer holding the head ticket published its message?
+    if (ATOMIC_Load32(&slot->sequence) != self->head + 1)
+        return FALSE;
+
+    *msg = slot->msg;
+
+    // Release the slot for the ticket one lap ahead
+    ATOMIC_Store32(&slot->sequence, self->head + self->capacity);
+    self->head++;
+
+    // Depth only grows between removals, so sampling it here captures 
+    // the high-water mark without burdening producers
+    depth = ATOMIC_FetchAdd32(&self->reserved, (UINT32)-1);
+    if (depth > ATOMIC_Load32(&self->highWater))
+        ATOMIC_Store32(&self->highWater, depth);
+
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// EQ_GetBatch
+//----------------------------------------------------------------------------
+UINT32 EQ_GetBatch(SM_EventQueue* self, SM_Message* msgs, UINT32 maxCount)
+{
+    UINT32 count = 0;
+
+    ASSERT_TRUE(msgs || maxCount == 0);
+
+    while (count < maxCount && EQ_Get(self, &msgs[count]))
+        count++;
+
+    return count;
+}
+
+//----------------------------------------------------------------------------
+// EQ_Depth
+//----------------------------------------------------------------------------
+UINT32 EQ_Depth(SM_EventQueue* self)
+{
+    ASSERT_TRUE(self);
+
+    return ATOMIC_Load32(&self->reserved);
+}
+
+//----------------------------------------------------------------------------
+// EQ_HighWater
+//----------------------------------------------------------------------------
+UINT32 EQ_HighWater(SM_EventQueue* self)
+{
+    UINT32 depth;
+
+    ASSERT_TRUE(self);
+
+    // Include messages queued since the last removal
+    depth = EQ_Depth(self);
+    return (depth > ATOMIC_Load32(&self->highWater)) ? depth : ATOMIC_Load32(&self->highWater);
+}
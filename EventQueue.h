@@ -0,0 +1,71 @@
+// The EventQueue module is a bounded, lock-free, multi-producer single-
+// consumer queue of SM_Message external events. Any number of threads may 
+// call EQ_Put() concurrently. Exactly one thread, the thread executing the 
+// target state machine, calls EQ_Get(). 
+//
+// EQ_Put() is lock-free: a producer reserves room with a compare-and-swap 
+// on the queue depth, takes a slot ticket with an atomic add, copies the 
+// message and publishes the slot. The compare-and-swap is retried only when
+// another thread changed the depth meanwhile. It never takes a lock. 
+//
+// The capacity must be a power of 2. Call EQ_Init() before first use.
+//
+// #include "EventQueue.h"
+// EQ_DEFINE(myQueue, 64)
+//
+// void main() 
+// {
+//      SM_Message msg = { MTR_Halt, NULL };
+//      EQ_Init(&myQueue);
+//      EQ_Put(&myQueue, &msg);
+//      EQ_Get(&myQueue, &msg);
+// }
+
+#ifndef _EVENT_QUEUE_H
+#define _EVENT_QUEUE_H
+
+#include "DataTypes.h"
+#include "StateMachine.h"
+#include "Atomic.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct
+{
+    SM_Message msg;
+    ATOMIC32 sequence;
+} EQ_Slot;
+
+// Use EQ_DEFINE to declare an SM_EventQueue object
+typedef struct
+{
+    EQ_Slot* const slots;
+    const UINT32 capacity;
+    ATOMIC32 reserved;      // Messages put but not yet removed (queue depth)
+    ATOMIC32 tail;          // Next producer slot ticket
+    UINT32 head;            // Next consumer slot ticket (consumer only)
+    ATOMIC32 highWater;     // Maximum depth observed
+} SM_EventQueue;
+
+// Defines the slot storage and an SM_EventQueue instance.
+// _name_ - the queue name
+// _capacity_ - maximum number of queued messages. Must be a power of 2.
+// e.g. EQ_DEFINE(myQueue, 64)
+#define EQ_DEFINE(_name_, _capacity_) \
+    static EQ_Slot _name_##Slots[_capacity_]; \
+    static SM_EventQueue _name_ = { _name_##Slots, _capacity_, 0, 0, 0, 0 };
+
+void EQ_Init(SM_EventQueue* self);
+BOOL EQ_Put(SM_EventQueue* self, const SM_Message* msg);
+BOOL EQ_Get(SM_EventQueue* self, SM_Message* msg);
+UINT32 EQ_GetBatch(SM_EventQueue* self, SM_Message* msgs, UINT32 maxCount);
+UINT32 EQ_Depth(SM_EventQueue* self);
+UINT32 EQ_HighWater(SM_EventQueue* self);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _EVENT_QUEUE_H
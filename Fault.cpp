@@ -14,11 +14,25 @@ assert(0): 这是一个兜底的断言，它在非Win32平台上起作用，或
     #include "windows.h" // 对于Win32平台，包含Windows特定的头文件
 #endif
 
+static FaultHook _faultHook;
+
+//----------------------------------------------------------------------------
+// FaultSetHook
+//----------------------------------------------------------------------------
+void FaultSetHook(FaultHook hook)
+{
+    _faultHook = hook;
+}
+
 //----------------------------------------------------------------------------
 // FaultHandler
 //----------------------------------------------------------------------------
 void FaultHandler(const char* file, unsigned short line)
 {
+    // A hook may handle the fault and let execution continue
+    if (_faultHook && _faultHook(file, line))
+        return;
+
 #if WIN32
     // 如果你的程序运行到这里，说明一个ASSERT宏触发了断言失败。
     DebugBreak(); // 在Windows上调用DebugBreak()函数，引发一个调试中断。
@@ -33,6 +33,12 @@ extern "C" {
 // @param[in] line - 发生软件断言的行号
 void FaultHandler(const char* file, unsigned short line);
 
+// Optional fault hook, e.g. for load tests that count faults. FaultHandler 
+// calls the hook first; if it returns nonzero the fault is handled and 
+// execution continues after the assertion.
+typedef int (*FaultHook)(const char* file, unsigned short line);
+void FaultSetHook(FaultHook hook);
+
 #ifdef __cplusplus
 }
 #endif
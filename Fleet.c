@@ -0,0 +1,285 @@
+#include "Fleet.h"
+#include "Fault.h"
+#include "Atomic.h"
+#include <string.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+    #define FLEET_SSSE3
+    #include <tmmintrin.h>
+    #ifdef _MSC_VER
+        #include <intrin.h>
+        #define FLEET_TARGET_SSSE3
+    #else
+        #define FLEET_TARGET_SSSE3 __attribute__((target("ssse3")))
+    #endif
+#endif
+
+// Instances resolved per lookup call
+#define FLEET_LANES     16
+
+// Resolves the next state of FLEET_LANES instances. Returns a bit mask of 
+// the instances whose next state is not EVENT_IGNORED.
+typedef UINT32 (*FleetLookupFunc)(const BYTE* transitions, BYTE maxStates, const BYTE* states, BYTE* next);
+
+// Lookup function kind, probed on the first broadcast
+enum { FLEET_LOOKUP_NONE, FLEET_LOOKUP_SCALAR, FLEET_LOOKUP_SSSE3 };
+static ATOMIC32 _lookupKind;
+
+//----------------------------------------------------------------------------
+// _FleetLookupScalar
+//----------------------------------------------------------------------------
+static UINT32 _FleetLookupScalar(const BYTE* transitions, BYTE maxStates, const BYTE* states, BYTE* next)
+{
+    UINT32 mask = 0;
+    int lane;
+
+    (void)maxStates;
+    for (lane = 0; lane < FLEET_LANES; lane++)
+    {
+        next[lane] = transitions[states[lane]];
+        if (next[lane] != EVENT_IGNORED)
+            mask |= 1u << lane;
+    }
+    return mask;
+}
+
+#ifdef FLEET_SSSE3
+//----------------------------------------------------------------------------
+// _FleetLookupSsse3
+//----------------------------------------------------------------------------
+FLEET_TARGET_SSSE3
+static UINT32 _FleetLookupSsse3(const BYTE* transitions, BYTE maxStates, const BYTE* states, BYTE* next)
+{
+    const __m128i lowNibble = _mm_set1_epi8(0x0F);
+    __m128i s = _mm_loadu_si128((const __m128i*)states);
+    __m128i index = _mm_and_si128(s, lowNibble);
+    __m128i chunk = _mm_and_si128(_mm_srli_epi16(s, 4), lowNibble);
+    __m128i result = _mm_setzero_si128();
+    int k;
+
+    // Each PSHUFB looks up 16 transition table entries; select the lanes 
+    // whose state falls in the current 16 entry chunk
+    for (k = 0; k * 16 <= maxStates; k++)
+    {
+        __m128i table = _mm_loadu_si128((const __m128i*)(transitions + k * 16));
+        __m128i select = _mm_cmpeq_epi8(chunk, _mm_set1_epi8((char)k));
+        result = _mm_or_si128(result, _mm_and_si128(select, _mm_shuffle_epi8(table, index)));
+    }
+
+    _mm_storeu_si128((__m128i*)next, result);
+    return (UINT32)~_mm_movemask_epi8(_mm_cmpeq_epi8(result, _mm_set1_epi8((char)EVENT_IGNORED))) & 0xFFFF;
+}
+
+//----------------------------------------------------------------------------
+// _FleetHasSsse3
+//----------------------------------------------------------------------------
+static BOOL _FleetHasSsse3(void)
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 9)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3") != 0;
+#endif
+}
+#endif
+
+//----------------------------------------------------------------------------
+// _FleetGetLookup
+//----------------------------------------------------------------------------
+static FleetLookupFunc _FleetGetLookup(void)
+{
+    UINT32 kind = ATOMIC_Load32(&_lookupKind);
+
+    // Threads broadcasting on different fleets may probe at the same time;
+    // each stores the same kind
+    if (kind == FLEET_LOOKUP_NONE)
+    {
+#ifdef FLEET_SSSE3
+        kind = _FleetHasSsse3() ? FLEET_LOOKUP_SSSE3 : FLEET_LOOKUP_SCALAR;
+#else
+        kind = FLEET_LOOKUP_SCALAR;
+#endif
+        ATOMIC_Store32(&_lookupKind, kind);
+    }
+
+#ifdef FLEET_SSSE3
+    if (kind == FLEET_LOOKUP_SSSE3)
+        return _FleetLookupSsse3;
+#endif
+    return _FleetLookupScalar;
+}
+
+//----------------------------------------------------------------------------
+// _FleetGetRow
+//----------------------------------------------------------------------------
+static const SM_FleetRow* _FleetGetRow(SM_Fleet* self, SM_EventFunc eventFunc)
+{
+    SM_FleetRow* row;
+    UINT16 i;
+
+    for (i = 0; i < self->numRows; i++)
+    {
+        if (self->rows[i].eventFunc == eventFunc)
+            return &self->rows[i];
+    }
+
+    // Increase SM_FLEET_MAX_EVENTS
+    ASSERT_TRUE(self->numRows < SM_FLEET_MAX_EVENTS);
+
+    row = &self->rows[self->numRows];
+
+    // Unused entries stay ignored; states at or past maxStates are invalid
+    memset(row->transitions, EVENT_IGNORED, sizeof(row->transitions));
+    row->selfConst = _SM_GetTransitions(eventFunc, row->transitions);
+    row->eventFunc = eventFunc;
+    self->numRows++;
+    return row;
+}
+
+//----------------------------------------------------------------------------
+// _FleetDispatch
+//----------------------------------------------------------------------------
+static void _FleetDispatch(SM_Fleet* self, const SM_StateMachineConst* selfConst, BYTE eventId, UINT32 index, BYTE newState, void* pEventData, size_t copySize, BOOL borrowed)
+{
+    // A temporary instance without a mailbox; state functions must not keep it
+    SM_StateMachine sm = { self->name, self->instances + (size_t)index * self->instanceSize, 0, 0, 0, 0 };
+
+    sm.currentState = self->states[index];
+
+    // Event ID + 1 of a broadcast by ID, for the trace and recorder hooks
+    sm.eventId = eventId;
+
+    // Every instance reads the same borrowed event data
+    if (borrowed)
+    {
+        sm.pForeignData = pEventData;
+        sm.foreignOwnership = SM_DATA_BORROWED;
+    }
+
+    // Each instance consumes its own copy of broadcast event data
+    if (copySize > 0 && copySize <= SM_INLINE_DATA_SIZE)
+    {
+        memcpy(sm.inlineData.bytes, pEventData, copySize);
+        pEventData = sm.inlineData.bytes;
+    }
+    else if (copySize > 0)
+    {
+        void* pData = SM_XAlloc(copySize);
+        ASSERT_TRUE(pData);
+        memcpy(pData, pEventData, copySize);
+        pEventData = pData;
+    }
+
+    _SM_ExternalEvent(&sm, selfConst, newState, pEventData);
+    self->states[index] = sm.currentState;
+}
+
+//----------------------------------------------------------------------------
+// _FleetBroadcast
+//----------------------------------------------------------------------------
+static UINT32 _FleetBroadcast(SM_Fleet* self, const SM_StateMachineConst* selfConst, BYTE eventId, const BYTE* transitions, void* pEventData, size_t dataSize, BOOL borrowed)
+{
+    FleetLookupFunc lookup = _FleetGetLookup();
+    BYTE next[FLEET_LANES];
+    BYTE tail[FLEET_LANES];
+    UINT32 dispatched = 0;
+    UINT32 base;
+
+    ASSERT_TRUE(borrowed || (pEventData == NULL) == (dataSize == 0));
+
+    for (base = 0; base < self->count; base += FLEET_LANES)
+    {
+        const BYTE* states = self->states + base;
+        UINT32 lanes = self->count - base;
+        UINT32 mask;
+
+        // Pad the final partial group with a state that maps to EVENT_IGNORED
+        if (lanes < FLEET_LANES)
+        {
+            memset(tail, selfConst->maxStates, sizeof(tail));
+            memcpy(tail, states, lanes);
+            states = tail;
+        }
+
+        // First pass: resolve next states. Second pass: run the state 
+        // machine of each instance that does not ignore the event.
+        mask = lookup(transitions, selfConst->maxStates, states, next);
+        while (mask)
+        {
+            UINT32 lane = 0;
+
+            while (!(mask & (1u << lane)))
+                lane++;
+            mask &= ~(1u << lane);
+
+            _FleetDispatch(self, selfConst, eventId, base + lane, next[lane], pEventData, dataSize, borrowed);
+            dispatched++;
+        }
+    }
+
+    if (pEventData && !borrowed)
+        SM_XFree(pEventData);
+    return dispatched;
+}
+
+//----------------------------------------------------------------------------
+// _SM_FleetBroadcast
+//----------------------------------------------------------------------------
+UINT32 _SM_FleetBroadcast(SM_Fleet* self, SM_EventFunc eventFunc, void* pEventData, size_t dataSize)
+{
+    const SM_FleetRow* row;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(eventFunc);
+
+    row = _FleetGetRow(self, eventFunc);
+    return _FleetBroadcast(self, row->selfConst, 0, row->transitions, pEventData, dataSize, FALSE);
+}
+
+//----------------------------------------------------------------------------
+// _SM_FleetBroadcastBorrowed
+//----------------------------------------------------------------------------
+UINT32 _SM_FleetBroadcastBorrowed(SM_Fleet* self, SM_EventFunc eventFunc, void* pEventData)
+{
+    const SM_FleetRow* row;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(eventFunc);
+
+    row = _FleetGetRow(self, eventFunc);
+    return _FleetBroadcast(self, row->selfConst, 0, row->transitions, pEventData, 0, TRUE);
+}
+
+//----------------------------------------------------------------------------
+// _SM_FleetBroadcastById
+//----------------------------------------------------------------------------
+UINT32 _SM_FleetBroadcastById(SM_Fleet* self, const SM_StateMachineConst* selfConst, BYTE eventId, void* pEventData, size_t dataSize)
+{
+    BYTE transitions[256];
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(selfConst && selfConst->transitionMatrix);
+    ASSERT_TRUE(eventId < selfConst->maxEvents);
+
+    // Pad the matrix row for the 16 entry table lookups
+    memset(transitions, EVENT_IGNORED, sizeof(transitions));
+    memcpy(transitions, selfConst->transitionMatrix + eventId * selfConst->maxStates, selfConst->maxStates);
+    return _FleetBroadcast(self, selfConst, (BYTE)(eventId + 1), transitions, pEventData, dataSize, FALSE);
+}
+
+//----------------------------------------------------------------------------
+// _SM_FleetEvent
+//----------------------------------------------------------------------------
+void _SM_FleetEvent(SM_Fleet* self, UINT32 index, SM_EventFunc eventFunc, void* pEventData)
+{
+    const SM_FleetRow* row;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(index < self->count);
+
+    row = _FleetGetRow(self, eventFunc);
+    _FleetDispatch(self, row->selfConst, 0, index, row->transitions[self->states[index]], pEventData, 0, FALSE);
+}
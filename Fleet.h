@@ -0,0 +1,104 @@
+// The Fleet module stores N instances of one state machine type as a 
+// structure of arrays: every instance's current state lives in one 
+// contiguous byte array, separate from the instance data array. 
+//
+// SM_FleetBroadcast() sends one external event to every instance. A first 
+// pass resolves each instance's next state from the event's transition 
+// table using SIMD byte table lookups over the state array. Only instances
+// whose result is not EVENT_IGNORED then execute their state functions.
+// Each instance receives its own copy of the event data, or with 
+// SM_FleetBroadcastBorrowed() all instances read the caller's event data.
+//
+// The event function's transition table is resolved once per fleet and 
+// event function (see _SM_GetTransitions), so broadcast events must be 
+// plain EVENT_DEFINE transition maps. State machine types with a transition
+// matrix can broadcast by event ID instead. A fleet is driven by one thread 
+// at a time.
+//
+// State functions of fleet instances receive a temporary SM_StateMachine 
+// that lives only for the one event and has no mailbox. They must not keep
+// self, e.g. in an SM_Timer, nor post to it. Broadcasts by event ID carry
+// the ID to the trace and recorder hooks. The temporary instance has the 
+// fleet's name, so the Recorder writes every fleet event under one instance
+// named after the fleet; REC_Replay() cannot replay it to the fleet.
+//
+// #include "Fleet.h"
+// SM_FLEET_DEFINE(MotorFleet, Motor, 100000)
+//
+// void main() 
+// {
+//      SM_FleetBroadcast(MotorFleet, MTR_Halt, NULL, 0);
+//      SM_FleetBroadcastById(MotorFleet, Motor, MTR_HALT_EVENT, NULL, 0);
+// }
+
+#ifndef _FLEET_H
+#define _FLEET_H
+
+#include "DataTypes.h"
+#include "StateMachine.h"
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Number of event transition tables cached per fleet
+#define SM_FLEET_MAX_EVENTS     8
+
+typedef struct
+{
+    SM_EventFunc eventFunc;
+    const SM_StateMachineConst* selfConst;
+    BYTE transitions[256];
+} SM_FleetRow;
+
+// Use SM_FLEET_DEFINE to declare an SM_Fleet object
+typedef struct
+{
+    const CHAR* name;
+    BYTE* states;                   // Current state of each instance, or a snapshot (see Snapshot.h)
+    char* instances;                // Instance data array, or a snapshot
+    const size_t instanceSize;
+    const UINT32 count;
+    SM_FleetRow rows[SM_FLEET_MAX_EVENTS];
+    UINT16 numRows;
+} SM_Fleet;
+
+// Defines the state array, the instance data array and an SM_Fleet instance.
+// Every instance starts in state 0 with zeroed instance data. On the example 
+// below, the SM_Fleet instance is MotorFleetObj.
+// _fleetName_ - the fleet name
+// _instance_ - the instance data type
+// _count_ - number of instances
+// e.g. SM_FLEET_DEFINE(MotorFleet, Motor, 1000)
+#define SM_FLEET_DEFINE(_fleetName_, _instance_, _count_) \
+    static BYTE _fleetName_##States[_count_]; \
+    static _instance_ _fleetName_##Instances[_count_]; \
+    static SM_Fleet _fleetName_##Obj = { #_fleetName_, _fleetName_##States, \
+        (char*)_fleetName_##Instances, sizeof(_instance_), _count_ };
+
+// Public functions
+#define SM_FleetBroadcast(_fleetName_, _eventFunc_, _eventData_, _dataSize_) \
+    _SM_FleetBroadcast(&_fleetName_##Obj, (SM_EventFunc)_eventFunc_, _eventData_, _dataSize_)
+#define SM_FleetBroadcastBorrowed(_fleetName_, _eventFunc_, _eventData_) \
+    _SM_FleetBroadcastBorrowed(&_fleetName_##Obj, (SM_EventFunc)_eventFunc_, _eventData_)
+#define SM_FleetBroadcastById(_fleetName_, _smType_, _eventId_, _eventData_, _dataSize_) \
+    _SM_FleetBroadcastById(&_fleetName_##Obj, &_smType_##Const, _eventId_, _eventData_, _dataSize_)
+#define SM_FleetEvent(_fleetName_, _index_, _eventFunc_, _eventData_) \
+    _SM_FleetEvent(&_fleetName_##Obj, _index_, (SM_EventFunc)_eventFunc_, _eventData_)
+#define SM_FleetGetInstance(_fleetName_, _index_) \
+    ((void*)(_fleetName_##Obj.instances + (size_t)(_index_) * _fleetName_##Obj.instanceSize))
+#define SM_FleetGetState(_fleetName_, _index_) \
+    (_fleetName_##Obj.states[_index_])
+
+// Private functions
+UINT32 _SM_FleetBroadcast(SM_Fleet* self, SM_EventFunc eventFunc, void* pEventData, size_t dataSize);
+UINT32 _SM_FleetBroadcastBorrowed(SM_Fleet* self, SM_EventFunc eventFunc, void* pEventData);
+UINT32 _SM_FleetBroadcastById(SM_Fleet* self, const SM_StateMachineConst* selfConst, BYTE eventId, void* pEventData, size_t dataSize);
+void _SM_FleetEvent(SM_Fleet* self, UINT32 index, SM_EventFunc eventFunc, void* pEventData);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _FLEET_H
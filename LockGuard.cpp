@@ -1,9 +1,84 @@
 #include "LockGuard.h"
 #include "Fault.h"
-#include <mutex>
+#include <thread>
 
-// A lock is a mutex
-#define LOCK std::mutex
+#if defined(_WIN32)
+    #include <windows.h>
+    #pragma comment(lib, "Synchronization.lib")
+#elif defined(__linux__)
+    #include <linux/futex.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif
+
+// A lock handle is an LK_Mutex
+#define LOCK LK_Mutex
+
+//------------------------------------------------------------------------------
+// LK_Park
+//------------------------------------------------------------------------------
+static void LK_Park(ATOMIC32* state, UINT32 value)
+{
+    // Sleep while *state == value. Spurious wakeups are fine.
+#if defined(_WIN32)
+    WaitOnAddress((volatile VOID*)state, &value, sizeof(value), INFINITE);
+#elif defined(__linux__)
+    syscall(SYS_futex, state, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+#else
+    (void)value;
+    std::this_thread::yield();
+#endif
+}
+
+//------------------------------------------------------------------------------
+// _LK_MutexWait
+//------------------------------------------------------------------------------
+void _LK_MutexWait(LK_Mutex* mutex)
+{
+    INT32 spins = (INT32)ATOMIC_Load32(&mutex->spins);
+    INT32 limit = spins * 2 + 10;
+    INT32 count = 0;
+    BOOL locked = FALSE;
+
+    ASSERT_TRUE(mutex);
+
+    if (limit > LK_SPIN_MAX)
+        limit = LK_SPIN_MAX;
+
+    // Spin while the owner is likely to release the lock soon
+    while (!locked && count < limit)
+    {
+        count++;
+        ATOMIC_Pause();
+        locked = ATOMIC_Load32(&mutex->state) == LK_UNLOCKED &&
+            ATOMIC_CompareExchange32(&mutex->state, LK_UNLOCKED, LK_LOCKED);
+    }
+
+    // Move the spin limit toward the spins this lock needed
+    ATOMIC_Store32(&mutex->spins, (UINT32)(spins + (count - spins) / 8));
+    if (locked)
+        return;
+
+    // Park until unlocked. A woken thread takes the lock as contended,
+    // since other threads may still be parked.
+    while (ATOMIC_Exchange32(&mutex->state, LK_CONTENDED) != LK_UNLOCKED)
+        LK_Park(&mutex->state, LK_CONTENDED);
+}
+
+//------------------------------------------------------------------------------
+// _LK_MutexWake
+//------------------------------------------------------------------------------
+void _LK_MutexWake(LK_Mutex* mutex)
+{
+    ASSERT_TRUE(mutex);
+
+    // Wake one parked thread
+#if defined(_WIN32)
+    WakeByAddressSingle((PVOID)&mutex->state);
+#elif defined(__linux__)
+    syscall(SYS_futex, &mutex->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+}
 
 //------------------------------------------------------------------------------
 // LK_Create
@@ -11,6 +86,8 @@
 LOCK_HANDLE LK_Create(void)
 {
     LOCK* lock = new LOCK;
+    ATOMIC_Store32(&lock->state, LK_UNLOCKED);
+    ATOMIC_Store32(&lock->spins, 0);
     return lock;
 }
 
@@ -31,7 +108,7 @@ void LK_Lock(LOCK_HANDLE hLock)
 {
     ASSERT_TRUE(hLock);
     LOCK* lock = (LOCK*)(hLock);
-	lock->lock();
+    LK_MutexLock(lock);
 }
 
 //------------------------------------------------------------------------------
@@ -41,6 +118,5 @@ void LK_Unlock(LOCK_HANDLE hLock)
 {
     ASSERT_TRUE(hLock);
     LOCK* lock = (LOCK*)(hLock);
-    lock->unlock();
+    LK_MutexUnlock(lock);
 }
-
@@ -1,12 +1,47 @@
+// The LockGuard module provides the locks used by the library.
+//
+// LK_Mutex is a lock embedded in the object it guards; it needs no
+// LK_Create() and zero initialized memory is an unlocked LK_Mutex. An
+// uncontended lock or unlock is one atomic operation. A contended lock spins
+// first, adapting its spin limit to how long the lock is usually held, and
+// only then parks the thread in the kernel (a futex on Linux, WaitOnAddress
+// on Windows). A lock is not recursive.
+//
+// LK_CREATE() creates an LK_Mutex on the heap for code that holds a
+// LOCK_HANDLE.
+//
+// #include "LockGuard.h"
+// static LK_Mutex lock = LK_MUTEX_INIT;
+//
+// LK_MutexLock(&lock);
+// ...
+// LK_MutexUnlock(&lock);
+
 #ifndef _LOCK_GUARD_H
 #define _LOCK_GUARD_H
 
 #include "DataTypes.h"
+#include "Atomic.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// Maximum spins of a contended lock before the thread parks
+#ifndef LK_SPIN_MAX
+#define LK_SPIN_MAX     100
+#endif
+
+enum { LK_UNLOCKED, LK_LOCKED, LK_CONTENDED };
+
+typedef struct
+{
+    ATOMIC32 state;         // LK_UNLOCKED, LK_LOCKED or LK_CONTENDED (waiters parked)
+    ATOMIC32 spins;         // Average spins of recent contended locks
+} LK_Mutex;
+
+#define LK_MUTEX_INIT   { LK_UNLOCKED, 0 }
+
 typedef void* LOCK_HANDLE;
 
 #define LK_CREATE()     LK_Create()
@@ -19,8 +54,30 @@ void LK_Destroy(LOCK_HANDLE hLock);
 void LK_Lock(LOCK_HANDLE hLock);
 void LK_Unlock(LOCK_HANDLE hLock);
 
+// Private functions
+void _LK_MutexWait(LK_Mutex* mutex);
+void _LK_MutexWake(LK_Mutex* mutex);
+
+ATOMIC_INLINE BOOL LK_MutexTryLock(LK_Mutex* mutex)
+{
+    return ATOMIC_CompareExchange32(&mutex->state, LK_UNLOCKED, LK_LOCKED);
+}
+
+ATOMIC_INLINE void LK_MutexLock(LK_Mutex* mutex)
+{
+    if (!ATOMIC_CompareExchange32(&mutex->state, LK_UNLOCKED, LK_LOCKED))
+        _LK_MutexWait(mutex);
+}
+
+ATOMIC_INLINE void LK_MutexUnlock(LK_Mutex* mutex)
+{
+    // Only wake a parked thread
+    if (ATOMIC_Exchange32(&mutex->state, LK_UNLOCKED) == LK_CONTENDED)
+        _LK_MutexWake(mutex);
+}
+
 #ifdef __cplusplus
 }
 #endif
 
-#endif 
+#endif
@@ -0,0 +1,419 @@
+#include "Metrics.h"
+#include "Atomic.h"
+#include "Fault.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct
+{
+    ATOMIC64 count;
+    ATOMIC64 totalCycles;
+    ATOMIC64 maxCycles;
+    ATOMIC64 buckets[MET_BUCKETS];
+} MET_AtomicHistogram;
+
+typedef struct
+{
+    ATOMIC64 guardRejects;
+    MET_AtomicHistogram latency[MET_FUNC_MAX];
+} MET_AtomicState;
+
+struct MET_Metrics
+{
+    const SM_StateMachineConst* selfConst;
+    BYTE maxStates;
+    MET_AtomicState* states;        // [maxStates]
+    ATOMIC64* transitions;          // [from * maxStates + to]
+    ATOMIC64 chains[MET_MAX_CHAIN];
+};
+
+// Open addressed table of the state machine types with metrics, keyed by
+// the state machine constant data. Entries are never removed.
+static ATOMIC_PTR _types[MET_MAX_TYPES];
+
+static UINT32 MET_Hash(const SM_StateMachineConst* selfConst);
+static UINT32 MET_Bucket(UINT64 cycles);
+static void MET_AddHistogram(MET_AtomicHistogram* histogram, UINT64 cycles);
+static void MET_ReadHistogram(MET_AtomicHistogram* histogram, MET_Histogram* out);
+static MET_Metrics* MET_Create(const SM_StateMachineConst* selfConst);
+
+//----------------------------------------------------------------------------
+// MET_Hash
+//----------------------------------------------------------------------------
+static UINT32 MET_Hash(const SM_StateMachineConst* selfConst)
+{
+    UINT64 key = (UINT64)(size_t)selfConst;
+    return (UINT32)((key >> 4) ^ (key >> 12)) & (MET_MAX_TYPES - 1);
+}
+
+//----------------------------------------------------------------------------
+// MET_Bucket
+//----------------------------------------------------------------------------
+static UINT32 MET_Bucket(UINT64 cycles)
+{
+    UINT32 bucket = 0;
+
+    // Bucket is the bit length of the cycle count
+    while (cycles && bucket < MET_BUCKETS - 1)
+    {
+        cycles >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+//----------------------------------------------------------------------------
+// MET_AddHistogram
+//----------------------------------------------------------------------------
+static void MET_AddHistogram(MET_AtomicHistogram* histogram, UINT64 cycles)
+{
+    INT64 max = ATOMIC_Load64(&histogram->maxCycles);
+
+    ATOMIC_FetchAdd64(&histogram->count, 1);
+    ATOMIC_FetchAdd64(&histogram->totalCycles, (INT64)cycles);
+    ATOMIC_FetchAdd64(&histogram->buckets[MET_Bucket(cycles)], 1);
+
+    while ((INT64)cycles > max)
+    {
+        if (ATOMIC_CompareExchange64(&histogram->maxCycles, max, (INT64)cycles))
+            break;
+        max = ATOMIC_Load64(&histogram->maxCycles);
+    }
+}
+
+//----------------------------------------------------------------------------
+// MET_ReadHistogram
+//----------------------------------------------------------------------------
+static void MET_ReadHistogram(MET_AtomicHistogram* histogram, MET_Histogram* out)
+{
+    UINT32 i;
+
+    out->count = (UINT64)ATOMIC_Load64(&histogram->count);
+    out->totalCycles = (UINT64)ATOMIC_Load64(&histogram->totalCycles);
+    out->maxCycles = (UINT64)ATOMIC_Load64(&histogram->maxCycles);
+    for (i=0; i<MET_BUCKETS; i++)
+        out->buckets[i] = (UINT64)ATOMIC_Load64(&histogram->buckets[i]);
+}
+
+//----------------------------------------------------------------------------
+// MET_Create
+//----------------------------------------------------------------------------
+static MET_Metrics* MET_Create(const SM_StateMachineConst* selfConst)
+{
+    MET_Metrics* metrics = (MET_Metrics*)calloc(1, sizeof(MET_Metrics));
+    ASSERT_TRUE(metrics);
+
+    metrics->selfConst = selfConst;
+    metrics->maxStates = selfConst->maxStates;
+    metrics->states = (MET_AtomicState*)calloc(selfConst->maxStates, sizeof(MET_AtomicState));
+    metrics->transitions = (ATOMIC64*)calloc((size_t)selfConst->maxStates * selfConst->maxStates, sizeof(ATOMIC64));
+    ASSERT_TRUE(metrics->states);
+    ASSERT_TRUE(metrics->transitions);
+    return metrics;
+}
+
+//----------------------------------------------------------------------------
+// _MET_Get
+//----------------------------------------------------------------------------
+MET_Metrics* _MET_Get(const SM_StateMachineConst* selfConst)
+{
+    MET_Metrics* metrics = NULL;
+    MET_Metrics* created = NULL;
+    UINT32 index;
+    UINT32 probe;
+
+    ASSERT_TRUE(selfConst);
+
+    index = MET_Hash(selfConst);
+
+    for (probe=0; probe<MET_MAX_TYPES; probe++)
+    {
+        metrics = (MET_Metrics*)ATOMIC_LoadPtr(&_types[index]);
+        if (metrics == NULL)
+        {
+            // First run of this type. Publish its metrics unless another
+            // thread claims the slot first.
+            if (created == NULL)
+                created = MET_Create(selfConst);
+            if (ATOMIC_CompareExchangePtr(&_types[index], NULL, created))
+                return created;
+            metrics = (MET_Metrics*)ATOMIC_LoadPtr(&_types[index]);
+        }
+
+        if (metrics->selfConst == selfConst)
+        {
+            if (created)
+            {
+                free(created->states);
+                free((void*)created->transitions);
+                free(created);
+            }
+            return metrics;
+        }
+
+        index = (index + 1) & (MET_MAX_TYPES - 1);
+    }
+
+    // Increase MET_MAX_TYPES
+    ASSERT();
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+// _MET_Record
+//----------------------------------------------------------------------------
+void _MET_Record(MET_Metrics* metrics, BYTE state, MET_Func func, UINT64 cycles)
+{
+    ASSERT_TRUE(state < metrics->maxStates);
+    MET_AddHistogram(&metrics->states[state].latency[func], cycles);
+}
+
+//----------------------------------------------------------------------------
+// _MET_Transition
+//----------------------------------------------------------------------------
+void _MET_Transition(MET_Metrics* metrics, BYTE fromState, BYTE toState)
+{
+    ATOMIC_FetchAdd64(&metrics->transitions[fromState * metrics->maxStates + toState], 1);
+}
+
+//----------------------------------------------------------------------------
+// _MET_GuardReject
+//----------------------------------------------------------------------------
+void _MET_GuardReject(MET_Metrics* metrics, BYTE state)
+{
+    ATOMIC_FetchAdd64(&metrics->states[state].guardRejects, 1);
+}
+
+//----------------------------------------------------------------------------
+// _MET_Chain
+//----------------------------------------------------------------------------
+void _MET_Chain(MET_Metrics* metrics, UINT32 length)
+{
+    if (length >= MET_MAX_CHAIN)
+        length = MET_MAX_CHAIN - 1;
+    ATOMIC_FetchAdd64(&metrics->chains[length], 1);
+}
+
+//----------------------------------------------------------------------------
+// MET_Find
+//----------------------------------------------------------------------------
+MET_Metrics* MET_Find(const SM_StateMachineConst* selfConst)
+{
+    MET_Metrics* metrics = NULL;
+    UINT32 index = MET_Hash(selfConst);
+    UINT32 probe;
+
+    for (probe=0; probe<MET_MAX_TYPES; probe++)
+    {
+        metrics = (MET_Metrics*)ATOMIC_LoadPtr(&_types[index]);
+        if (metrics == NULL || metrics->selfConst == selfConst)
+            return metrics;
+        index = (index + 1) & (MET_MAX_TYPES - 1);
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+// MET_First
+//----------------------------------------------------------------------------
+MET_Metrics* MET_First(void)
+{
+    UINT32 index;
+
+    for (index=0; index<MET_MAX_TYPES; index++)
+    {
+        if (ATOMIC_LoadPtr(&_types[index]))
+            return (MET_Metrics*)ATOMIC_LoadPtr(&_types[index]);
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+// MET_Next
+//----------------------------------------------------------------------------
+MET_Metrics* MET_Next(MET_Metrics* metrics)
+{
+    UINT32 index;
+    BOOL found = FALSE;
+
+    ASSERT_TRUE(metrics);
+
+    for (index=0; index<MET_MAX_TYPES; index++)
+    {
+        MET_Metrics* entry = (MET_Metrics*)ATOMIC_LoadPtr(&_types[index]);
+        if (found && entry)
+            return entry;
+        if (entry == metrics)
+            found = TRUE;
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+// MET_GetName
+//----------------------------------------------------------------------------
+const CHAR* MET_GetName(MET_Metrics* metrics)
+{
+    ASSERT_TRUE(metrics);
+    return metrics->selfConst->name;
+}
+
+//----------------------------------------------------------------------------
+// MET_GetMaxStates
+//----------------------------------------------------------------------------
+BYTE MET_GetMaxStates(MET_Metrics* metrics)
+{
+    ASSERT_TRUE(metrics);
+    return metrics->maxStates;
+}
+
+//----------------------------------------------------------------------------
+// MET_GetStateStats
+//----------------------------------------------------------------------------
+void MET_GetStateStats(MET_Metrics* metrics, BYTE state, MET_StateStats* stats)
+{
+    UINT32 func;
+
+    ASSERT_TRUE(metrics);
+    ASSERT_TRUE(stats);
+    ASSERT_TRUE(state < metrics->maxStates);
+
+    for (func=0; func<MET_FUNC_MAX; func++)
+        MET_ReadHistogram(&metrics->states[state].latency[func], &stats->latency[func]);
+    stats->guardRejects = (UINT64)ATOMIC_Load64(&metrics->states[state].guardRejects);
+    stats->entries = stats->latency[MET_STATE].count;
+}
+
+//----------------------------------------------------------------------------
+// MET_GetTransitionCount
+//----------------------------------------------------------------------------
+UINT64 MET_GetTransitionCount(MET_Metrics* metrics, BYTE fromState, BYTE toState)
+{
+    ASSERT_TRUE(metrics);
+    ASSERT_TRUE(fromState < metrics->maxStates && toState < metrics->maxStates);
+    return (UINT64)ATOMIC_Load64(&metrics->transitions[fromState * metrics->maxStates + toState]);
+}
+
+//----------------------------------------------------------------------------
+// MET_GetChainCounts
+//----------------------------------------------------------------------------
+void MET_GetChainCounts(MET_Metrics* metrics, UINT64 counts[MET_MAX_CHAIN])
+{
+    UINT32 i;
+
+    ASSERT_TRUE(metrics);
+    for (i=0; i<MET_MAX_CHAIN; i++)
+        counts[i] = (UINT64)ATOMIC_Load64(&metrics->chains[i]);
+}
+
+//----------------------------------------------------------------------------
+// MET_Percentile
+//----------------------------------------------------------------------------
+UINT64 MET_Percentile(const MET_Histogram* histogram, UINT32 percent)
+{
+    UINT64 target;
+    UINT64 seen = 0;
+    UINT32 i;
+
+    ASSERT_TRUE(histogram);
+    ASSERT_TRUE(percent <= 100);
+
+    if (histogram->count == 0)
+        return 0;
+
+    // Upper bound of the bucket holding the percentile, at most the maximum
+    target = (histogram->count * percent + 99) / 100;
+    for (i=0; i<MET_BUCKETS; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen >= target && seen > 0)
+            break;
+    }
+    if (i == 0)
+        return 0;
+    if (i >= MET_BUCKETS - 1 || ((UINT64)1 << i) - 1 > histogram->maxCycles)
+        return histogram->maxCycles;
+    return ((UINT64)1 << i) - 1;
+}
+
+//----------------------------------------------------------------------------
+// MET_Reset
+//----------------------------------------------------------------------------
+void MET_Reset(void)
+{
+    MET_Metrics* metrics;
+
+    // Counters updated concurrently may survive the reset
+    for (metrics = MET_First(); metrics; metrics = MET_Next(metrics))
+    {
+        memset((void*)metrics->states, 0, metrics->maxStates * sizeof(MET_AtomicState));
+        memset((void*)metrics->transitions, 0, (size_t)metrics->maxStates * metrics->maxStates * sizeof(ATOMIC64));
+        memset((void*)metrics->chains, 0, sizeof(metrics->chains));
+    }
+    ATOMIC_Fence();
+}
+
+//----------------------------------------------------------------------------
+// MET_Export
+//----------------------------------------------------------------------------
+void MET_Export(FILE* fp)
+{
+    static const CHAR* funcNames[MET_FUNC_MAX] = { "state", "guard", "entry", "exit" };
+    MET_Metrics* metrics;
+    MET_StateStats stats;
+    UINT64 chains[MET_MAX_CHAIN];
+    UINT64 count;
+    UINT32 state, to, func, i;
+
+    ASSERT_TRUE(fp);
+
+    // One CSV record per line. The first field is the record kind.
+    fprintf(fp, "state,type,state,entries,guard_rejects\n");
+    fprintf(fp, "latency,type,state,function,count,total_cycles,mean_cycles,p50_cycles,p99_cycles,max_cycles\n");
+    fprintf(fp, "transition,type,from,to,count\n");
+    fprintf(fp, "chain,type,length,count\n");
+
+    for (metrics = MET_First(); metrics; metrics = MET_Next(metrics))
+    {
+        const CHAR* name = MET_GetName(metrics);
+
+        for (state=0; state<metrics->maxStates; state++)
+        {
+            MET_GetStateStats(metrics, (BYTE)state, &stats);
+            if (stats.entries == 0 && stats.guardRejects == 0)
+                continue;
+
+            fprintf(fp, "state,%s,%u,%llu,%llu\n", name, state,
+                (unsigned long long)stats.entries, (unsigned long long)stats.guardRejects);
+
+            for (func=0; func<MET_FUNC_MAX; func++)
+            {
+                const MET_Histogram* h = &stats.latency[func];
+                if (h->count == 0)
+                    continue;
+                fprintf(fp, "latency,%s,%u,%s,%llu,%llu,%llu,%llu,%llu,%llu\n", name, state, funcNames[func],
+                    (unsigned long long)h->count, (unsigned long long)h->totalCycles,
+                    (unsigned long long)(h->totalCycles / h->count),
+                    (unsigned long long)MET_Percentile(h, 50), (unsigned long long)MET_Percentile(h, 99),
+                    (unsigned long long)h->maxCycles);
+            }
+        }
+
+        for (state=0; state<metrics->maxStates; state++)
+        {
+            for (to=0; to<metrics->maxStates; to++)
+            {
+                count = MET_GetTransitionCount(metrics, (BYTE)state, (BYTE)to);
+                if (count)
+                    fprintf(fp, "transition,%s,%u,%u,%llu\n", name, state, to, (unsigned long long)count);
+            }
+        }
+
+        MET_GetChainCounts(metrics, chains);
+        for (i=0; i<MET_MAX_CHAIN; i++)
+        {
+            if (chains[i])
+                fprintf(fp, "chain,%s,%u,%llu\n", name, i, (unsigned long long)chains[i]);
+        }
+    }
+}
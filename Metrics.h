@@ -0,0 +1,138 @@
+// The Metrics module is an optional performance counter surface for the
+// state engines. When StateMachine.c is compiled with USE_SM_METRICS
+// defined, _SM_StateEngine and _SM_StateEngineEx record per state machine
+// type:
+//
+//   - executions per state and guard rejections per state
+//   - transitions per (from, to) state pair
+//   - internal event chain length, i.e. states executed per engine run
+//   - latency histograms of the state, guard, entry and exit functions
+//
+// Latencies are measured with the CPU cycle counter (the TSC on x86) and
+// kept in power of 2 buckets. Counters are updated atomically, so instances
+// of one type may run on any number of threads. Without USE_SM_METRICS the
+// engine hooks compile to nothing and no metrics are recorded.
+//
+// #include "Metrics.h"
+// MET_Metrics* metrics = MET_Find(&MotorConst);
+// MET_StateStats stats;
+// MET_GetStateStats(metrics, ST_START, &stats);
+// printf("p99 %llu cycles\n", MET_Percentile(&stats.latency[MET_STATE], 99));
+// MET_Export(stdout);
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include "DataTypes.h"
+#include "StateMachine.h"
+#include <stdio.h>
+
+#if defined(_MSC_VER)
+    #include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+#else
+    #include "Thread.h"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Maximum number of state machine types with metrics
+#define MET_MAX_TYPES       64
+
+// Latency histogram buckets. Bucket 0 counts 0 cycles, bucket i counts
+// [2^(i-1), 2^i) cycles and the last bucket everything above.
+#define MET_BUCKETS         32
+
+// Chain length counters. The last counter includes all longer chains.
+#define MET_MAX_CHAIN       16
+
+// Measured state map functions
+typedef enum
+{
+    MET_STATE,
+    MET_GUARD,
+    MET_ENTRY,
+    MET_EXIT,
+    MET_FUNC_MAX
+} MET_Func;
+
+typedef struct
+{
+    UINT64 count;
+    UINT64 totalCycles;
+    UINT64 maxCycles;
+    UINT64 buckets[MET_BUCKETS];
+} MET_Histogram;
+
+// Snapshot of one state. entries equals latency[MET_STATE].count.
+typedef struct
+{
+    UINT64 entries;
+    UINT64 guardRejects;
+    MET_Histogram latency[MET_FUNC_MAX];
+} MET_StateStats;
+
+typedef struct MET_Metrics MET_Metrics;
+
+// Read the cycle counter
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+    #define MET_Cycles()    ((UINT64)__rdtsc())
+#elif defined(__aarch64__)
+    static inline UINT64 MET_Cycles(void) { UINT64 v; __asm__ volatile("mrs %0, cntvct_el0" : "=r"(v)); return v; }
+#else
+    #define MET_Cycles()    TH_GetTimeNs()
+#endif
+
+// State engine hooks. MET_ENGINE_BEGIN declares the hook variables and must
+// follow the engine's own declarations. It runs before the engine's asserts,
+// so it asserts _selfConst_ itself.
+#ifdef USE_SM_METRICS
+    #define MET_ENGINE_BEGIN(_selfConst_) \
+        MET_Metrics* _metrics = (_selfConst_) ? _MET_Get(_selfConst_) : \
+            (FaultHandler(__FILE__, (unsigned short)__LINE__), (MET_Metrics*)NULL); \
+        UINT64 _metStart = 0; \
+        UINT32 _metChain = 0;
+    #define MET_CHAIN()                 (_metChain++)
+    #define MET_START()                 (_metStart = MET_Cycles())
+    #define MET_STOP(_state_, _func_)   _MET_Record(_metrics, _state_, _func_, MET_Cycles() - _metStart)
+    #define MET_TRANSITION(_from_, _to_) _MET_Transition(_metrics, _from_, _to_)
+    #define MET_GUARD_REJECT(_state_)   _MET_GuardReject(_metrics, _state_)
+    #define MET_ENGINE_END()            _MET_Chain(_metrics, _metChain)
+#else
+    #define MET_ENGINE_BEGIN(_selfConst_)
+    #define MET_CHAIN()                 ((void)0)
+    #define MET_START()                 ((void)0)
+    #define MET_STOP(_state_, _func_)   ((void)0)
+    #define MET_TRANSITION(_from_, _to_) ((void)0)
+    #define MET_GUARD_REJECT(_state_)   ((void)0)
+    #define MET_ENGINE_END()            ((void)0)
+#endif
+
+// Public functions
+MET_Metrics* MET_Find(const SM_StateMachineConst* selfConst);
+MET_Metrics* MET_First(void);
+MET_Metrics* MET_Next(MET_Metrics* metrics);
+const CHAR* MET_GetName(MET_Metrics* metrics);
+BYTE MET_GetMaxStates(MET_Metrics* metrics);
+void MET_GetStateStats(MET_Metrics* metrics, BYTE state, MET_StateStats* stats);
+UINT64 MET_GetTransitionCount(MET_Metrics* metrics, BYTE fromState, BYTE toState);
+void MET_GetChainCounts(MET_Metrics* metrics, UINT64 counts[MET_MAX_CHAIN]);
+UINT64 MET_Percentile(const MET_Histogram* histogram, UINT32 percent);
+void MET_Reset(void);
+void MET_Export(FILE* fp);
+
+// Private functions
+MET_Metrics* _MET_Get(const SM_StateMachineConst* selfConst);
+void _MET_Record(MET_Metrics* metrics, BYTE state, MET_Func func, UINT64 cycles);
+void _MET_Transition(MET_Metrics* metrics, BYTE fromState, BYTE toState);
+void _MET_GuardReject(MET_Metrics* metrics, BYTE state);
+void _MET_Chain(MET_Metrics* metrics, UINT32 length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _METRICS_H
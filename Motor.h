@@ -28,9 +28,8 @@ typedef struct
     INT speed;               // 储存电机速度的整数
 } MotorData;
 
-// 声明状态机相关的事件, 包括设置速度和停止
-EVENT_DECLARE(MTR_SetSpeed, MotorData)  // 声明一个设置电机速度的事件
-EVENT_DECLARE(MTR_Halt, NoEventData)    // 声明一个停止电机的事件，没有额外数据
+// Event IDs, state machine type and event functions, generated from Motor.sm
+#include "Motor_sm.h"
 
 // 对外提供的函数声明
 GET_DECLARE(MTR_GetSpeed, INT);         // 声明一个函数用于获取电机的速度
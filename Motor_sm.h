@@ -0,0 +1,22 @@
+// Generated by sm_gen from Motor.sm. Do not edit.
+
+#ifndef _MOTOR_SM_H
+#define _MOTOR_SM_H
+
+#include "StateMachine.h"
+
+// Motor event IDs, the rows of the transition matrix (SM_DispatchById)
+enum MotorEvents
+{
+    MTR_SET_SPEED_EVENT,
+    MTR_HALT_EVENT,
+    MTR_MAX_EVENTS
+};
+
+// Motor state machine type, for SM_DEFINE_TYPED
+SM_CONST_DECLARE(Motor)
+
+EVENT_DECLARE(MTR_SetSpeed, MotorData)
+EVENT_DECLARE(MTR_Halt, NoEventData)
+
+#endif // _MOTOR_SM_H
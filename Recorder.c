@@ -0,0 +1,412 @@
+#include "Recorder.h"
+#include "LockGuard.h"
+#include "Fault.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if WIN32
+    #include "windows.h"
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+// Maximum number of registered state machine types
+#define REC_MAX_TYPES       16
+
+// Buffered file output
+#define REC_BUFFER_SIZE     (64 * 1024)
+
+#define REC_PAD(_size_)     (((_size_) + 7) & ~(size_t)7)
+
+typedef struct
+{
+    const SM_StateMachineConst* selfConst;
+    const UINT16* dataSizes;        // One entry per event ID
+} REC_Type;
+
+// Instance to instance number map. Open addressing, power of 2 capacity.
+typedef struct
+{
+    SM_StateMachine* machine;
+    UINT32 number;
+} REC_Instance;
+
+TH_THREAD_LOCAL UINT32 _REC_Depth;
+void* volatile _REC_File;
+
+static REC_Type _types[REC_MAX_TYPES];
+static UINT32 _typeCount;
+
+static LOCK_HANDLE _hLock;
+static FILE* _fp;
+static char* _buffer;
+static REC_Instance* _instances;
+static UINT32 _instanceCapacity;
+static UINT32 _instanceCount;
+static BOOL _writeError;
+
+static const UINT16* REC_FindType(const SM_StateMachineConst* selfConst);
+static UINT32 REC_GetInstance(SM_StateMachine* self, const SM_StateMachineConst* selfConst);
+static void REC_Write(const REC_RecordHeader* header, const void* data);
+
+//----------------------------------------------------------------------------
+// REC_RegisterType
+//----------------------------------------------------------------------------
+void REC_RegisterType(const SM_StateMachineConst* selfConst, const UINT16* dataSizes)
+{
+    UINT32 i;
+
+    ASSERT_TRUE(selfConst);
+    ASSERT_TRUE(dataSizes);
+
+    for (i = 0; i < _typeCount; i++)
+    {
+        if (_types[i].selfConst == selfConst)
+        {
+            _types[i].dataSizes = dataSizes;
+            return;
+        }
+    }
+
+    ASSERT_TRUE(_typeCount < REC_MAX_TYPES);
+    _types[_typeCount].selfConst = selfConst;
+    _types[_typeCount].dataSizes = dataSizes;
+    _typeCount++;
+}
+
+//----------------------------------------------------------------------------
+// REC_FindType
+//----------------------------------------------------------------------------
+static const UINT16* REC_FindType(const SM_StateMachineConst* selfConst)
+{
+    UINT32 i;
+    for (i = 0; i < _typeCount; i++)
+    {
+        if (_types[i].selfConst == selfConst)
+            return _types[i].dataSizes;
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+// REC_Write
+//----------------------------------------------------------------------------
+static void REC_Write(const REC_RecordHeader* header, const void* data)
+{
+    static const BYTE padding[8] = { 0 };
+    size_t pad = REC_PAD(header->dataSize) - header->dataSize;
+
+    if (fwrite(header, sizeof(REC_RecordHeader), 1, _fp) != 1 ||
+        (header->dataSize && fwrite(data, header->dataSize, 1, _fp) != 1) ||
+        (pad && fwrite(padding, pad, 1, _fp) != 1))
+        _writeError = TRUE;
+}
+
+//----------------------------------------------------------------------------
+// REC_GetInstance
+//----------------------------------------------------------------------------
+static UINT32 REC_GetInstance(SM_StateMachine* self, const SM_StateMachineConst* selfConst)
+{
+    REC_RecordHeader header;
+    char names[256];
+    size_t nameLen, typeLen;
+    UINT32 slot;
+
+    // Keep the map at most half full
+    if (_instanceCount * 2 >= _instanceCapacity)
+    {
+        REC_Instance* old = _instances;
+        UINT32 oldCapacity = _instanceCapacity;
+        UINT32 i;
+
+        _instanceCapacity = oldCapacity ? oldCapacity * 2 : 1024;
+        _instances = (REC_Instance*)calloc(_instanceCapacity, sizeof(REC_Instance));
+        ASSERT_TRUE(_instances);
+
+        for (i = 0; i < oldCapacity; i++)
+        {
+            if (old[i].machine == NULL)
+                continue;
+            slot = (UINT32)(((size_t)old[i].machine >> 4) * 2654435761u) & (_instanceCapacity - 1);
+            while (_instances[slot].machine)
+                slot = (slot + 1) & (_instanceCapacity - 1);
+            _instances[slot] = old[i];
+        }
+        free(old);
+    }
+
+    slot = (UINT32)(((size_t)self >> 4) * 2654435761u) & (_instanceCapacity - 1);
+    while (_instances[slot].machine)
+    {
+        if (_instances[slot].machine == self)
+            return _instances[slot].number;
+        slot = (slot + 1) & (_instanceCapacity - 1);
+    }
+
+    _instances[slot].machine = self;
+    _instances[slot].number = _instanceCount++;
+
+    // Define the instance ahead of its first event
+    nameLen = strlen(self->name) + 1;
+    typeLen = strlen(selfConst->name) + 1;
+    ASSERT_TRUE(nameLen + typeLen <= sizeof(names));
+    memcpy(names, self->name, nameLen);
+    memcpy(names + nameLen, selfConst->name, typeLen);
+
+    memset(&header, 0, sizeof(header));
+    header.timestamp = TH_GetTimeNs();
+    header.instance = _instances[slot].number;
+    header.dataSize = (UINT16)(nameLen + typeLen);
+    header.eventId = REC_INSTANCE;
+    REC_Write(&header, names);
+
+    return _instances[slot].number;
+}
+
+//----------------------------------------------------------------------------
+// _REC_Event
+//----------------------------------------------------------------------------
+void _REC_Event(SM_StateMachine* self, const SM_StateMachineConst* selfConst, void* pEventData)
+{
+    REC_RecordHeader header;
+    const UINT16* dataSizes = REC_FindType(selfConst);
+    BYTE eventId = (BYTE)(self->eventId - 1);
+
+    // Event data of unregistered types cannot be recorded
+    ASSERT_TRUE(dataSizes || pEventData == NULL);
+    ASSERT_TRUE(eventId < selfConst->maxEvents);
+
+    header.timestamp = TH_GetTimeNs();
+    header.dataSize = (UINT16)(pEventData && dataSizes ? dataSizes[eventId] : 0);
+    header.eventId = eventId;
+    header.state = self->currentState;
+
+    LK_LOCK(_hLock);
+    if (_fp)
+    {
+        header.instance = REC_GetInstance(self, selfConst);
+        REC_Write(&header, pEventData);
+    }
+    LK_UNLOCK(_hLock);
+}
+
+//----------------------------------------------------------------------------
+// REC_Start
+//----------------------------------------------------------------------------
+BOOL REC_Start(const char* path)
+{
+    REC_FileHeader header;
+    FILE* fp = NULL;
+
+    ASSERT_TRUE(path);
+
+    // The lock lives as long as the process so a late event never sees it
+    // destroyed
+    if (_hLock == NULL)
+        _hLock = LK_CREATE();
+
+    fp = fopen(path, "wb");
+    if (fp == NULL)
+        return FALSE;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = REC_FILE_MAGIC;
+    header.version = REC_FILE_VERSION;
+    if (fwrite(&header, sizeof(header), 1, fp) != 1)
+    {
+        fclose(fp);
+        return FALSE;
+    }
+
+    LK_LOCK(_hLock);
+    ASSERT_TRUE(_fp == NULL);
+    _buffer = (char*)malloc(REC_BUFFER_SIZE);
+    if (_buffer)
+        setvbuf(fp, _buffer, _IOFBF, REC_BUFFER_SIZE);
+    _fp = fp;
+    _writeError = FALSE;
+    _instanceCount = 0;
+    if (_instances)
+        memset(_instances, 0, _instanceCapacity * sizeof(REC_Instance));
+    _REC_File = fp;
+    LK_UNLOCK(_hLock);
+
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// REC_Stop
+//----------------------------------------------------------------------------
+BOOL REC_Stop(void)
+{
+    BOOL success;
+
+    if (_hLock == NULL)
+        return FALSE;
+
+    LK_LOCK(_hLock);
+    _REC_File = NULL;
+    success = _fp && !_writeError;
+    if (_fp && fclose(_fp) != 0)
+        success = FALSE;
+    _fp = NULL;
+    free(_buffer);
+    _buffer = NULL;
+    free(_instances);
+    _instances = NULL;
+    _instanceCapacity = 0;
+    _instanceCount = 0;
+    LK_UNLOCK(_hLock);
+
+    return success;
+}
+
+//----------------------------------------------------------------------------
+// REC_Replay
+//----------------------------------------------------------------------------
+BOOL REC_Replay(const char* path, REC_ResolveFunc resolve, void* context,
+    BOOL realTime, REC_ReplayStats* stats)
+{
+    const BYTE* map = NULL;
+    size_t size = 0, offset;
+    SM_StateMachine** machines = NULL;
+    UINT32 capacity = 0;
+    UINT64 startNs, firstTimestamp = 0;
+    BOOL success = TRUE;
+#if WIN32
+    HANDLE hFile, hMapping = NULL;
+#else
+    int fd;
+    struct stat st;
+#endif
+
+    ASSERT_TRUE(path);
+    ASSERT_TRUE(resolve);
+    ASSERT_TRUE(stats);
+
+    memset(stats, 0, sizeof(REC_ReplayStats));
+
+    // Map the whole recording read only
+#if WIN32
+    hFile = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+    size = (size_t)GetFileSize(hFile, NULL);
+    if (size)
+        hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (hMapping)
+        map = (const BYTE*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(hFile);
+#else
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return FALSE;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        size = (size_t)st.st_size;
+        map = (const BYTE*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == (const BYTE*)MAP_FAILED)
+            map = NULL;
+        else
+            madvise((void*)map, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+#endif
+
+    if (map == NULL || size < sizeof(REC_FileHeader) ||
+        ((const REC_FileHeader*)map)->magic != REC_FILE_MAGIC ||
+        ((const REC_FileHeader*)map)->version != REC_FILE_VERSION)
+        success = FALSE;
+
+    startNs = TH_GetTimeNs();
+    offset = sizeof(REC_FileHeader);
+
+    while (success && offset + sizeof(REC_RecordHeader) <= size)
+    {
+        const REC_RecordHeader* header = (const REC_RecordHeader*)(map + offset);
+        const BYTE* data = map + offset + sizeof(REC_RecordHeader);
+        SM_StateMachine* machine = NULL;
+
+        // A recording cut short by a crash ends at its last whole record
+        if (offset + sizeof(REC_RecordHeader) + REC_PAD(header->dataSize) > size)
+            break;
+        offset += sizeof(REC_RecordHeader) + REC_PAD(header->dataSize);
+
+        if (stats->events + stats->skipped == 0 && header->eventId != REC_INSTANCE)
+            firstTimestamp = header->timestamp;
+
+        if (header->eventId == REC_INSTANCE)
+        {
+            const CHAR* name = (const CHAR*)data;
+            size_t nameLen = strnlen(name, header->dataSize);
+
+            if (header->instance != stats->instances || nameLen + 1 >= header->dataSize ||
+                data[header->dataSize - 1] != 0)
+            {
+                success = FALSE;
+                break;
+            }
+
+            if (header->instance >= capacity)
+            {
+                capacity = capacity ? capacity * 2 : 1024;
+                machines = (SM_StateMachine**)realloc(machines, capacity * sizeof(SM_StateMachine*));
+                ASSERT_TRUE(machines);
+            }
+            machines[header->instance] = resolve(name, name + nameLen + 1, context);
+            stats->instances++;
+            continue;
+        }
+
+        if (header->instance >= stats->instances)
+        {
+            success = FALSE;
+            break;
+        }
+
+        machine = machines[header->instance];
+        if (machine == NULL)
+        {
+            stats->skipped++;
+            continue;
+        }
+
+        // Wait for the recorded time of the event
+        if (realTime)
+        {
+            UINT64 due = startNs + (header->timestamp - firstTimestamp);
+            UINT64 now;
+            while ((now = TH_GetTimeNs()) < due)
+            {
+                if (due - now > 2000000)
+                    TH_Sleep(1);
+                else
+                    TH_Yield();
+            }
+        }
+
+        // Event data is copied as with SM_EventCopy; the mapping is read only
+        if (_SM_DispatchCopyById(machine, header->eventId, 
+                header->dataSize ? data : NULL, header->dataSize) != header->state)
+            stats->divergences++;
+        stats->events++;
+    }
+
+    stats->elapsedNs = TH_GetTimeNs() - startNs;
+
+    free(machines);
+#if WIN32
+    if (map)
+        UnmapViewOfFile(map);
+    if (hMapping)
+        CloseHandle(hMapping);
+#else
+    if (map)
+        munmap((void*)map, size);
+#endif
+    return success;
+}
@@ -0,0 +1,120 @@
+// The Recorder module captures external events to an append-only file and
+// replays them. When StateMachine.c is compiled with USE_SM_RECORD defined,
+// every external event with an event ID (see TRANSITION_MATRIX_EVENT and
+// SM_DispatchById) is written while REC_Start() is active: the target
+// instance, the event ID, the instance's state before the event and a copy
+// of the event data. Events generated by state functions are not recorded;
+// replaying the top level events generates them again.
+//
+// The event data size of each event ID is registered per state machine type
+// with REC_RegisterType(). Event IDs of a registered type without event data
+// have size 0.
+//
+// REC_Replay() maps a recording into memory and dispatches its events by ID,
+// as fast as possible or at the recorded timing. Instances are found by name
+// with a resolver callback. Before each event the instance's state is
+// compared with the recorded state; any difference is counted as a
+// divergence, so a replay shows whether a change alters the state sequence.
+// Timer expiries are recorded like any other external event; mute the timer
+// module during a replay (see TMR_Mute) so they are not delivered twice.
+// Events are dispatched on the replay thread like SM_DispatchById(), with
+// the instance's lock held in USE_SM_LOCK builds. Without USE_SM_LOCK, stop
+// active objects and detach scheduled instances before replaying to them.
+//
+// #include "Recorder.h"
+// static const UINT16 motorDataSizes[MTR_MAX_EVENTS] = { sizeof(MotorData), 0 };
+// REC_RegisterType(&MotorConst, motorDataSizes);
+// REC_Start("motor.rec");
+// ...
+// REC_Stop();
+//
+// SM_StateMachine* Resolve(const CHAR* name, const CHAR* typeName, void* context)
+// {
+//      return strcmp(name, "Motor1SM") == 0 ? &Motor1SMObj : NULL;
+// }
+// REC_ReplayStats stats;
+// REC_Replay("motor.rec", Resolve, NULL, FALSE, &stats);
+
+#ifndef _RECORDER_H
+#define _RECORDER_H
+
+#include "DataTypes.h"
+#include "StateMachine.h"
+#include "Thread.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Recording file layout: a REC_FileHeader, then records. Each record is a
+// REC_RecordHeader followed by dataSize bytes padded to 8 bytes. An instance
+// is defined by a REC_INSTANCE record, with "name\0typeName\0" as data,
+// before its first event. Native byte order.
+#define REC_FILE_MAGIC      0x43524D53  // "SMRC"
+#define REC_FILE_VERSION    1
+
+// Event ID of an instance definition record
+enum { REC_INSTANCE = 0xFF };
+
+typedef struct
+{
+    UINT32 magic;
+    UINT32 version;
+    UINT64 reserved;
+} REC_FileHeader;
+
+// 16 bytes
+typedef struct
+{
+    UINT64 timestamp;       // TH_GetTimeNs()
+    UINT32 instance;        // Instance number, in order of definition
+    UINT16 dataSize;        // Event data bytes following the header
+    BYTE eventId;           // Transition matrix event ID, or REC_INSTANCE
+    BYTE state;             // Instance state before the event
+} REC_RecordHeader;
+
+// Replay results
+typedef struct
+{
+    UINT64 events;          // Events dispatched
+    UINT64 skipped;         // Events of instances the resolver did not find
+    UINT64 divergences;     // Events whose instance state differed from the recording
+    UINT64 elapsedNs;
+    UINT32 instances;
+} REC_ReplayStats;
+
+// Returns the instance to replay a recorded instance's events to, or NULL
+// to skip them.
+typedef SM_StateMachine* (*REC_ResolveFunc)(const CHAR* name, const CHAR* typeName, void* context);
+
+// State engine hooks. Events generated between REC_NESTED_BEGIN and 
+// REC_NESTED_END on the same thread, e.g. by state functions, are not recorded.
+#ifdef USE_SM_RECORD
+    extern TH_THREAD_LOCAL UINT32 _REC_Depth;
+    extern void* volatile _REC_File;
+    #define REC_NESTED_BEGIN()      (_REC_Depth++);
+    #define REC_NESTED_END()        (_REC_Depth--)
+    #define REC_EVENT(_self_, _selfConst_, _eventData_) \
+        if (_REC_File && (_self_)->eventId && _REC_Depth == 0) \
+            _REC_Event(_self_, _selfConst_, _eventData_);
+#else
+    #define REC_NESTED_BEGIN()
+    #define REC_NESTED_END()        ((void)0)
+    #define REC_EVENT(_self_, _selfConst_, _eventData_)
+#endif
+
+// Public functions
+void REC_RegisterType(const SM_StateMachineConst* selfConst, const UINT16* dataSizes);
+BOOL REC_Start(const char* path);
+BOOL REC_Stop(void);
+BOOL REC_Replay(const char* path, REC_ResolveFunc resolve, void* context,
+    BOOL realTime, REC_ReplayStats* stats);
+
+// Private functions
+void _REC_Event(SM_StateMachine* self, const SM_StateMachineConst* selfConst, void* pEventData);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _RECORDER_H
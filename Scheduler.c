@@ -0,0 +1,491 @@
+#include "Scheduler.h"
+#include "EventQueue.h"
+#include "Atomic.h"
+#include "Semaphore.h"
+#include "Thread.h"
+#include "Fault.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Maximum events executed per instance run before the instance is requeued
+// behind other runnable instances
+#define SCH_RUN_BATCH       32
+
+// Idle worker wait before checking for stealable work again
+#define SCH_IDLE_WAIT_MS    10
+
+typedef struct
+{
+    SM_Scheduler* scheduler;
+    UINT16 index;
+    UINT32 random;
+
+    // Chase-Lev work-stealing deque. The owner pushes and pops at the 
+    // bottom, thieves steal from the top.
+    ATOMIC_PTR* deque;
+    ATOMIC64 top;
+    ATOMIC64 bottom;
+
+    // Instances made runnable by other threads
+    SM_EventQueue* inbox;
+
+    ATOMIC32 parked;
+    SEMAPHORE_HANDLE hSem;
+    THREAD_HANDLE hThread;
+
+    // Statistics written by the owner only
+    ATOMIC64 events;
+    ATOMIC64 runs;
+    ATOMIC64 steals;
+
+    // Counter values at the last SCH_ResetStats(), subtracted when read
+    ATOMIC64 baseEvents;
+    ATOMIC64 baseRuns;
+    ATOMIC64 baseSteals;
+} SCH_Worker;
+
+struct SM_Scheduler
+{
+    SCH_Worker* workers;
+    UINT16 numWorkers;
+    UINT32 capacity;
+    ATOMIC32 nextInbox;
+    ATOMIC32 parkedCount;
+    ATOMIC32 exit;
+    ATOMIC64 startNs;
+};
+
+// The worker executing on the calling thread, if any
+static TH_THREAD_LOCAL SCH_Worker* _currentWorker;
+
+static BOOL SCH_Push(SCH_Worker* worker, SM_StateMachine* machine);
+static SM_StateMachine* SCH_Pop(SCH_Worker* worker);
+static SM_StateMachine* SCH_Steal(SCH_Worker* victim);
+static BOOL SCH_PutInbox(SCH_Worker* worker, SM_StateMachine* machine);
+static SM_StateMachine* SCH_GetInbox(SCH_Worker* worker);
+static SM_StateMachine* SCH_FindWork(SCH_Worker* worker);
+static void SCH_WakeParked(SM_Scheduler* self);
+static void SCH_Run(SCH_Worker* worker, SM_StateMachine* machine);
+static void SCH_WorkerThread(void* arg);
+
+//----------------------------------------------------------------------------
+// SCH_Push
+//----------------------------------------------------------------------------
+static BOOL SCH_Push(SCH_Worker* worker, SM_StateMachine* machine)
+{
+    INT64 b = ATOMIC_Load64(&worker->bottom);
+    INT64 t = ATOMIC_Load64(&worker->top);
+
+    // Deque full?
+    if (b - t >= (INT64)worker->scheduler->capacity)
+        return FALSE;
+
+    ATOMIC_StorePtr(&worker->deque[b & (worker->scheduler->capacity - 1)], machine);
+    ATOMIC_Store64(&worker->bottom, b + 1);
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// SCH_Pop
+//----------------------------------------------------------------------------
+static SM_StateMachine* SCH_Pop(SCH_Worker* worker)
+{
+    SM_StateMachine* machine = NULL;
+    INT64 b = ATOMIC_Load64(&worker->bottom) - 1;
+    INT64 t;
+
+    // Claim the bottom entry before looking at top
+    ATOMIC_Store64(&worker->bottom, b);
+    ATOMIC_Fence();
+    t = ATOMIC_Load64(&worker->top);
+
+    if (t <= b)
+    {
+        machine = (SM_StateMachine*)ATOMIC_LoadPtr(&worker->deque[b & (worker->scheduler->capacity - 1)]);
+        if (t == b)
+        {
+            // Last entry. Race any thief for it.
+            if (!ATOMIC_CompareExchange64(&worker->top, t, t + 1))
+                machine = NULL;
+            ATOMIC_Store64(&worker->bottom, b + 1);
+        }
+    }
+    else
+    {
+        // Deque empty
+        ATOMIC_Store64(&worker->bottom, b + 1);
+    }
+
+    return machine;
+}
+
+//----------------------------------------------------------------------------
+// SCH_Steal
+//----------------------------------------------------------------------------
+static SM_StateMachine* SCH_Steal(SCH_Worker* victim)
+{
+    SM_StateMachine* machine = NULL;
+    INT64 t = ATOMIC_Load64(&victim->top);
+    INT64 b;
+
+    ATOMIC_Fence();
+    b = ATOMIC_Load64(&victim->bottom);
+
+    if (t < b)
+    {
+        machine = (SM_StateMachine*)ATOMIC_LoadPtr(&victim->deque[t & (victim->scheduler->capacity - 1)]);
+        if (!ATOMIC_CompareExchange64(&victim->top, t, t + 1))
+            machine = NULL;
+    }
+
+    return machine;
+}
+
+//----------------------------------------------------------------------------
+// SCH_PutInbox
+//----------------------------------------------------------------------------
+static BOOL SCH_PutInbox(SCH_Worker* worker, SM_StateMachine* machine)
+{
+    SM_Message msg;
+
+    msg.eventFunc = NULL;
+    msg.pEventData = machine;
+    msg.inlineSize = 0;
+    msg.ownership = SM_DATA_OWNED;
+    msg.deadline = 0;
+    if (!EQ_Put(worker->inbox, &msg))
+        return FALSE;
+
+    // Wake the worker if it is parked
+    if (ATOMIC_Exchange32(&worker->parked, FALSE))
+        SEM_SIGNAL(worker->hSem);
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// SCH_GetInbox
+//----------------------------------------------------------------------------
+static SM_StateMachine* SCH_GetInbox(SCH_Worker* worker)
+{
+    SM_Message msg;
+
+    if (!EQ_Get(worker->inbox, &msg))
+        return NULL;
+    return (SM_StateMachine*)msg.pEventData;
+}
+
+//----------------------------------------------------------------------------
+// SCH_FindWork
+//----------------------------------------------------------------------------
+static SM_StateMachine* SCH_FindWork(SCH_Worker* worker)
+{
+    SM_Scheduler* self = worker->scheduler;
+    SM_StateMachine* machine = NULL;
+    UINT16 i, victim;
+
+    // Own deque first for cache locality, then the inbox
+    machine = SCH_Pop(worker);
+    if (!machine)
+        machine = SCH_GetInbox(worker);
+
+    // Steal starting at a random victim
+    if (!machine && self->numWorkers > 1)
+    {
+        worker->random = worker->random * 1103515245 + 12345;
+        victim = (UINT16)((worker->random >> 16) % self->numWorkers);
+        for (i=0; i<self->numWorkers && !machine; i++, victim = (victim + 1) % self->numWorkers)
+        {
+            if (victim != worker->index)
+                machine = SCH_Steal(&self->workers[victim]);
+        }
+        if (machine)
+            ATOMIC_Store64(&worker->steals, ATOMIC_Load64(&worker->steals) + 1);
+    }
+
+    return machine;
+}
+
+//----------------------------------------------------------------------------
+// SCH_WakeParked
+//----------------------------------------------------------------------------
+static void SCH_WakeParked(SM_Scheduler* self)
+{
+    UINT16 i;
+
+    // Wake one parked worker so it can steal the new work
+    for (i=0; i<self->numWorkers; i++)
+    {
+        if (ATOMIC_Exchange32(&self->workers[i].parked, FALSE))
+        {
+            SEM_SIGNAL(self->workers[i].hSem);
+            break;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// SCH_Run
+//----------------------------------------------------------------------------
+static void SCH_Run(SCH_Worker* worker, SM_StateMachine* machine)
+{
+    SM_Mailbox* mailbox = machine->pMailbox;
+    SM_Message msgs[SCH_RUN_BATCH];
+    UINT32 count = 0;
+
+    // Execute a batch of queued events. Only this worker holds the 
+    // instance, so the events run to completion one at a time.
+    count = _SM_MailboxGet(mailbox, msgs, SCH_RUN_BATCH);
+    _SM_EventBatch(machine, msgs, count);
+
+    ATOMIC_Store64(&worker->events, ATOMIC_Load64(&worker->events) + count);
+    ATOMIC_Store64(&worker->runs, ATOMIC_Load64(&worker->runs) + 1);
+
+    if (count == SCH_RUN_BATCH && _SM_MailboxDepth(mailbox) > 0)
+    {
+        // Still runnable. Requeue behind the instances in the inbox.
+        if (!SCH_PutInbox(worker, machine))
+            _SCH_Ready(worker->scheduler, machine);
+        return;
+    }
+
+    // Release the instance, then catch any event posted after the last get
+    ATOMIC_Exchange32(&mailbox->scheduled, FALSE);
+    if (_SM_MailboxDepth(mailbox) > 0 && !ATOMIC_Exchange32(&mailbox->scheduled, TRUE))
+        _SCH_Ready(worker->scheduler, machine);
+}
+
+//----------------------------------------------------------------------------
+// SCH_WorkerThread
+//----------------------------------------------------------------------------
+static void SCH_WorkerThread(void* arg)
+{
+    SCH_Worker* worker = (SCH_Worker*)arg;
+    SM_Scheduler* self = worker->scheduler;
+    SM_StateMachine* machine = NULL;
+
+    _currentWorker = worker;
+
+    for (;;)
+    {
+        machine = SCH_FindWork(worker);
+        if (machine)
+        {
+            SCH_Run(worker, machine);
+            continue;
+        }
+
+        // Nothing to do. Park, then look once more for work queued meanwhile.
+        ATOMIC_Exchange32(&worker->parked, TRUE);
+        ATOMIC_FetchAdd32(&self->parkedCount, 1);
+        machine = SCH_FindWork(worker);
+        if (!machine && !ATOMIC_Load32(&self->exit))
+            SEM_WAIT(worker->hSem, SCH_IDLE_WAIT_MS);
+        ATOMIC_FetchAdd32(&self->parkedCount, (UINT32)-1);
+        ATOMIC_Exchange32(&worker->parked, FALSE);
+
+        if (machine)
+            SCH_Run(worker, machine);
+        else if (ATOMIC_Load32(&self->exit))
+            break;
+    }
+
+    _currentWorker = NULL;
+}
+
+//----------------------------------------------------------------------------
+// _SCH_Ready
+//----------------------------------------------------------------------------
+void _SCH_Ready(SM_Scheduler* self, SM_StateMachine* machine)
+{
+    SCH_Worker* worker = _currentWorker;
+    UINT16 i, start;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(machine);
+
+    // Posted from one of our workers? Keep the instance on its deque.
+    if (worker && worker->scheduler == self && SCH_Push(worker, machine))
+    {
+        if (ATOMIC_Load32(&self->parkedCount) > 0)
+            SCH_WakeParked(self);
+        return;
+    }
+
+    // Otherwise spread runnable instances across the worker inboxes
+    start = (UINT16)(ATOMIC_FetchAdd32(&self->nextInbox, 1) % self->numWorkers);
+    for (i=0; i<self->numWorkers; i++)
+    {
+        if (SCH_PutInbox(&self->workers[(start + i) % self->numWorkers], machine))
+            return;
+    }
+
+    // An instance is queued at most once, so the inboxes can't all be full
+    // unless more than maxInstances instances are attached
+    ASSERT();
+}
+
+//----------------------------------------------------------------------------
+// SCH_Create
+//----------------------------------------------------------------------------
+SM_Scheduler* SCH_Create(UINT16 numWorkers, UINT32 maxInstances)
+{
+    SM_Scheduler* self = NULL;
+    UINT32 capacity = 1;
+    UINT16 i;
+
+    ASSERT_TRUE(numWorkers > 0);
+    ASSERT_TRUE(maxInstances > 0);
+
+    // Deques and inboxes hold every instance in the worst case
+    while (capacity < maxInstances)
+        capacity <<= 1;
+
+    self = (SM_Scheduler*)calloc(1, sizeof(SM_Scheduler));
+    ASSERT_TRUE(self);
+    self->workers = (SCH_Worker*)calloc(numWorkers, sizeof(SCH_Worker));
+    ASSERT_TRUE(self->workers);
+    self->numWorkers = numWorkers;
+    self->capacity = capacity;
+    ATOMIC_Store64(&self->startNs, (INT64)TH_GetTimeNs());
+
+    for (i=0; i<numWorkers; i++)
+    {
+        SCH_Worker* worker = &self->workers[i];
+        SM_EventQueue inbox = { (EQ_Slot*)calloc(capacity, sizeof(EQ_Slot)), capacity, 0, 0, 0, 0 };
+
+        ASSERT_TRUE(inbox.slots);
+        worker->inbox = (SM_EventQueue*)malloc(sizeof(SM_EventQueue));
+        ASSERT_TRUE(worker->inbox);
+        memcpy(worker->inbox, &inbox, sizeof(SM_EventQueue));
+        EQ_Init(worker->inbox);
+
+        worker->deque = (ATOMIC_PTR*)calloc(capacity, sizeof(ATOMIC_PTR));
+        ASSERT_TRUE(worker->deque);
+        worker->scheduler = self;
+        worker->index = i;
+        worker->random = i + 1;
+        worker->hSem = SEM_CREATE();
+    }
+
+    // Start the workers once every deque exists so stealing is safe
+    for (i=0; i<numWorkers; i++)
+        self->workers[i].hThread = TH_CREATE(SCH_WorkerThread, &self->workers[i]);
+
+    return self;
+}
+
+//----------------------------------------------------------------------------
+// SCH_Destroy
+//----------------------------------------------------------------------------
+void SCH_Destroy(SM_Scheduler* self)
+{
+    UINT16 i;
+
+    ASSERT_TRUE(self);
+
+    // Workers exit once no runnable instance remains
+    ATOMIC_Store32(&self->exit, TRUE);
+    for (i=0; i<self->numWorkers; i++)
+        SEM_SIGNAL(self->workers[i].hSem);
+
+    for (i=0; i<self->numWorkers; i++)
+    {
+        SCH_Worker* worker = &self->workers[i];
+        TH_JOIN(worker->hThread);
+        SEM_DESTROY(worker->hSem);
+        free(worker->inbox->slots);
+        free(worker->inbox);
+        free((void*)worker->deque);
+    }
+
+    free(self->workers);
+    free(self);
+}
+
+//----------------------------------------------------------------------------
+// SCH_GetWorkerCount
+//----------------------------------------------------------------------------
+UINT16 SCH_GetWorkerCount(SM_Scheduler* self)
+{
+    ASSERT_TRUE(self);
+    return self->numWorkers;
+}
+
+//----------------------------------------------------------------------------
+// SCH_GetWorkerStats
+//----------------------------------------------------------------------------
+void SCH_GetWorkerStats(SM_Scheduler* self, UINT16 worker, SCH_WorkerStats* stats)
+{
+    SCH_Worker* w;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(stats);
+    ASSERT_TRUE(worker < self->numWorkers);
+
+    w = &self->workers[worker];
+    stats->events = (UINT64)(ATOMIC_Load64(&w->events) - ATOMIC_Load64(&w->baseEvents));
+    stats->runs = (UINT64)(ATOMIC_Load64(&w->runs) - ATOMIC_Load64(&w->baseRuns));
+    stats->steals = (UINT64)(ATOMIC_Load64(&w->steals) - ATOMIC_Load64(&w->baseSteals));
+    stats->elapsedNs = TH_GetTimeNs() - (UINT64)ATOMIC_Load64(&self->startNs);
+    stats->eventsPerSec = stats->elapsedNs ? 
+        (UINT64)((double)stats->events * 1e9 / (double)stats->elapsedNs) : 0;
+}
+
+//----------------------------------------------------------------------------
+// SCH_ResetStats
+//----------------------------------------------------------------------------
+void SCH_ResetStats(SM_Scheduler* self)
+{
+    UINT16 i;
+
+    ASSERT_TRUE(self);
+
+    // Counters are owned by the workers, so snapshot them as the new 
+    // baseline instead of clearing them under a running worker
+    for (i=0; i<self->numWorkers; i++)
+    {
+        SCH_Worker* w = &self->workers[i];
+        ATOMIC_Store64(&w->baseEvents, ATOMIC_Load64(&w->events));
+        ATOMIC_Store64(&w->baseRuns, ATOMIC_Load64(&w->runs));
+        ATOMIC_Store64(&w->baseSteals, ATOMIC_Load64(&w->steals));
+    }
+    ATOMIC_Store64(&self->startNs, (INT64)TH_GetTimeNs());
+}
+
+//----------------------------------------------------------------------------
+// _SM_SchedulerAttach
+//----------------------------------------------------------------------------
+void _SM_SchedulerAttach(SM_StateMachine* self, SM_Mailbox* mailbox, SM_Scheduler* scheduler)
+{
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(mailbox);
+    ASSERT_TRUE(scheduler);
+    ASSERT_TRUE(self->pMailbox == NULL);
+
+    _SM_MailboxInit(mailbox);
+    ATOMIC_Store32(&mailbox->scheduled, FALSE);
+    mailbox->pScheduler = scheduler;
+    self->pMailbox = mailbox;
+}
+
+//----------------------------------------------------------------------------
+// _SM_SchedulerDetach
+//----------------------------------------------------------------------------
+void _SM_SchedulerDetach(SM_StateMachine* self)
+{
+    SM_Mailbox* mailbox = NULL;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(self->pMailbox);
+
+    mailbox = self->pMailbox;
+    ASSERT_TRUE(mailbox->pScheduler);
+    _SM_MailboxClose(mailbox);
+
+    // Wait for the workers to execute every queued event
+    while (_SM_MailboxDepth(mailbox) > 0 || ATOMIC_Load32(&mailbox->scheduled))
+        TH_Yield();
+
+    mailbox->pScheduler = NULL;
+    self->pMailbox = NULL;
+}
@@ -0,0 +1,70 @@
+// The Scheduler module executes many state machine instances on a fixed 
+// pool of worker threads. An instance attached to a scheduler queues its 
+// external events in its mailbox (see ActiveObject.h) exactly like an 
+// active object, but has no thread of its own. Posting to an idle instance 
+// makes it runnable; a worker then drains the mailbox. An instance is 
+// executed by exactly one worker at a time, so the run-to-completion 
+// semantics of _SM_StateEngine and _SM_StateEngineEx are preserved.
+//
+// Each worker owns a work-stealing deque of runnable instances and an 
+// inbox for instances made runnable by non-worker threads. Idle workers 
+// steal from the other workers' deques.
+//
+// #include "Scheduler.h"
+// SM_DEFINE(Motor1SM, &motorObj1)
+// SM_MAILBOX_DEFINE(Motor1SM, 16)
+//
+// void main() 
+// {
+//      SM_Scheduler* sched = SCH_Create(4, 1024);
+//      SM_SchedulerAttach(Motor1SM, sched);
+//      SM_Post(Motor1SM, MTR_Halt, NULL);
+//      SM_SchedulerDetach(Motor1SM);
+//      SCH_Destroy(sched);
+// }
+
+#ifndef _SCHEDULER_H
+#define _SCHEDULER_H
+
+#include "DataTypes.h"
+#include "StateMachine.h"
+#include "ActiveObject.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct SM_Scheduler SM_Scheduler;
+
+// Per worker throughput statistics
+typedef struct
+{
+    UINT64 events;          // External events executed
+    UINT64 runs;            // Instance mailbox drains
+    UINT64 steals;          // Instances stolen from other workers
+    UINT64 elapsedNs;       // Time since start or the last SCH_ResetStats()
+    UINT64 eventsPerSec;    // events / elapsedNs
+} SCH_WorkerStats;
+
+// Public functions
+#define SM_SchedulerAttach(_smName_, _scheduler_) \
+    _SM_SchedulerAttach(&_smName_##Obj, &_smName_##Mailbox, _scheduler_)
+#define SM_SchedulerDetach(_smName_) \
+    _SM_SchedulerDetach(&_smName_##Obj)
+
+SM_Scheduler* SCH_Create(UINT16 numWorkers, UINT32 maxInstances);
+void SCH_Destroy(SM_Scheduler* self);
+UINT16 SCH_GetWorkerCount(SM_Scheduler* self);
+void SCH_GetWorkerStats(SM_Scheduler* self, UINT16 worker, SCH_WorkerStats* stats);
+void SCH_ResetStats(SM_Scheduler* self);
+
+// Private functions
+void _SM_SchedulerAttach(SM_StateMachine* self, SM_Mailbox* mailbox, SM_Scheduler* scheduler);
+void _SM_SchedulerDetach(SM_StateMachine* self);
+void _SCH_Ready(SM_Scheduler* self, SM_StateMachine* machine);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SCHEDULER_H
@@ -0,0 +1,65 @@
+#include "Semaphore.h"
+#include "Fault.h"
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+// A semaphore is a flag protected by a mutex and condition variable
+struct SEMAPHORE
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool set = false;
+};
+
+//------------------------------------------------------------------------------
+// SEM_Create
+//------------------------------------------------------------------------------
+SEMAPHORE_HANDLE SEM_Create(void)
+{
+    SEMAPHORE* sem = new SEMAPHORE;
+    return sem;
+}
+
+//------------------------------------------------------------------------------
+// SEM_Destroy
+//------------------------------------------------------------------------------
+void SEM_Destroy(SEMAPHORE_HANDLE hSem)
+{
+    ASSERT_TRUE(hSem);
+    SEMAPHORE* sem = (SEMAPHORE*)(hSem);
+    delete sem;
+}
+
+//------------------------------------------------------------------------------
+// SEM_Signal
+//------------------------------------------------------------------------------
+void SEM_Signal(SEMAPHORE_HANDLE hSem)
+{
+    ASSERT_TRUE(hSem);
+    SEMAPHORE* sem = (SEMAPHORE*)(hSem);
+    {
+        std::lock_guard<std::mutex> lock(sem->mutex);
+        sem->set = true;
+    }
+    sem->cv.notify_one();
+}
+
+//------------------------------------------------------------------------------
+// SEM_Wait
+//------------------------------------------------------------------------------
+BOOL SEM_Wait(SEMAPHORE_HANDLE hSem, UINT32 timeoutMs)
+{
+    ASSERT_TRUE(hSem);
+    SEMAPHORE* sem = (SEMAPHORE*)(hSem);
+    std::unique_lock<std::mutex> lock(sem->mutex);
+
+    if (timeoutMs == SEM_WAIT_INFINITE)
+        sem->cv.wait(lock, [sem] { return sem->set; });
+    else if (!sem->cv.wait_for(lock, std::chrono::milliseconds(timeoutMs), [sem] { return sem->set; }))
+        return FALSE;
+
+    // Auto-reset once a waiter is released
+    sem->set = false;
+    return TRUE;
+}
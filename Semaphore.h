@@ -0,0 +1,30 @@
+#ifndef _SEMAPHORE_H
+#define _SEMAPHORE_H
+
+#include "DataTypes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A binary semaphore. SEM_Signal() releases one waiting thread, or the next 
+// thread to call SEM_Wait() if no thread is currently waiting.
+typedef void* SEMAPHORE_HANDLE;
+
+#define SEM_WAIT_INFINITE    (0xFFFFFFFF)
+
+#define SEM_CREATE()         SEM_Create()
+#define SEM_DESTROY(h)       SEM_Destroy(h)
+#define SEM_SIGNAL(h)        SEM_Signal(h)
+#define SEM_WAIT(h, t)       SEM_Wait(h, t)
+
+SEMAPHORE_HANDLE SEM_Create(void);
+void SEM_Destroy(SEMAPHORE_HANDLE hSem);
+void SEM_Signal(SEMAPHORE_HANDLE hSem);
+BOOL SEM_Wait(SEMAPHORE_HANDLE hSem, UINT32 timeoutMs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif 
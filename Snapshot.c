@@ -0,0 +1,384 @@
+#include "Snapshot.h"
+#include "Fault.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if WIN32
+    #include "windows.h"
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+// Maximum number of fleets mapped at once
+#define SNP_MAX_MAPPINGS    16
+
+#define SNP_ROUND_UP(_size_)    (((_size_) + SNP_ALIGN - 1) & ~(UINT64)(SNP_ALIGN - 1))
+
+// A fleet pointed at a mapped snapshot, and the arrays it was defined with
+typedef struct
+{
+    SM_Fleet* fleet;
+    BYTE* states;
+    char* instances;
+    void* map;
+    size_t size;
+#if WIN32
+    HANDLE hMapping;
+#endif
+} SNP_Mapping;
+
+static SNP_Mapping _mappings[SNP_MAX_MAPPINGS];
+
+static void* SNP_Map(const char* path, BOOL copyOnWrite, size_t* size, SNP_Mapping* mapping);
+static void SNP_Unmap(SNP_Mapping* mapping);
+static BOOL SNP_WritePadding(FILE* fp, UINT64 from, UINT64 to);
+static BOOL SNP_Commit(FILE* fp, const char* tmpPath, const char* path, BOOL success);
+
+//----------------------------------------------------------------------------
+// SNP_Map
+//----------------------------------------------------------------------------
+static void* SNP_Map(const char* path, BOOL copyOnWrite, size_t* size, SNP_Mapping* mapping)
+{
+    void* map = NULL;
+#if WIN32
+    HANDLE hFile;
+
+    mapping->hMapping = NULL;
+    hFile = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return NULL;
+    *size = (size_t)GetFileSize(hFile, NULL);
+    if (*size >= sizeof(SNP_FileHeader))
+        mapping->hMapping = CreateFileMappingA(hFile, NULL, copyOnWrite ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, NULL);
+    if (mapping->hMapping)
+        map = MapViewOfFile(mapping->hMapping, copyOnWrite ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(hFile);
+#else
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(SNP_FileHeader))
+    {
+        *size = (size_t)st.st_size;
+        map = mmap(NULL, *size, copyOnWrite ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+            map = NULL;
+    }
+    close(fd);
+#endif
+
+    mapping->map = map;
+    mapping->size = *size;
+    if (map == NULL)
+        SNP_Unmap(mapping);
+    return map;
+}
+
+//----------------------------------------------------------------------------
+// SNP_Unmap
+//----------------------------------------------------------------------------
+static void SNP_Unmap(SNP_Mapping* mapping)
+{
+#if WIN32
+    if (mapping->map)
+        UnmapViewOfFile(mapping->map);
+    if (mapping->hMapping)
+        CloseHandle(mapping->hMapping);
+    mapping->hMapping = NULL;
+#else
+    if (mapping->map)
+        munmap(mapping->map, mapping->size);
+#endif
+    mapping->map = NULL;
+    mapping->size = 0;
+}
+
+//----------------------------------------------------------------------------
+// SNP_WritePadding
+//----------------------------------------------------------------------------
+static BOOL SNP_WritePadding(FILE* fp, UINT64 from, UINT64 to)
+{
+    static const BYTE zeros[SNP_ALIGN] = { 0 };
+
+    while (from < to)
+    {
+        size_t n = (size_t)(to - from < SNP_ALIGN ? to - from : SNP_ALIGN);
+        if (fwrite(zeros, n, 1, fp) != 1)
+            return FALSE;
+        from += n;
+    }
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// SNP_Commit
+//----------------------------------------------------------------------------
+static BOOL SNP_Commit(FILE* fp, const char* tmpPath, const char* path, BOOL success)
+{
+    // Replace the previous snapshot only with a complete one. A fleet still
+    // mapped from the previous snapshot keeps its mapping.
+    if (fclose(fp) != 0)
+        success = FALSE;
+#if WIN32
+    if (success && !MoveFileExA(tmpPath, path, MOVEFILE_REPLACE_EXISTING))
+        success = FALSE;
+#else
+    if (success && rename(tmpPath, path) != 0)
+        success = FALSE;
+#endif
+    if (!success)
+        remove(tmpPath);
+    return success;
+}
+
+//----------------------------------------------------------------------------
+// SNP_SaveFleet
+//----------------------------------------------------------------------------
+BOOL SNP_SaveFleet(const SM_Fleet* fleet, const SM_StateMachineConst* selfConst, const char* path)
+{
+    SNP_FileHeader header;
+    char tmpPath[260];
+    FILE* fp = NULL;
+    UINT64 instancesSize;
+    BOOL success = TRUE;
+
+    ASSERT_TRUE(fleet);
+    ASSERT_TRUE(selfConst);
+    ASSERT_TRUE(path);
+
+    instancesSize = (UINT64)fleet->count * fleet->instanceSize;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = SNP_FILE_MAGIC;
+    header.version = SNP_FILE_VERSION;
+    header.kind = SNP_FLEET;
+    header.count = fleet->count;
+    header.instanceSize = fleet->instanceSize;
+    header.statesOffset = SNP_ROUND_UP(sizeof(header));
+    header.instancesOffset = header.statesOffset + SNP_ROUND_UP(fleet->count);
+    header.fileSize = header.instancesOffset + instancesSize;
+    header.maxStates = selfConst->maxStates;
+    strncpy(header.typeName, selfConst->name, SNP_NAME_SIZE - 1);
+
+    if (snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path) >= (int)sizeof(tmpPath))
+        return FALSE;
+    fp = fopen(tmpPath, "wb");
+    if (fp == NULL)
+        return FALSE;
+
+    if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+        !SNP_WritePadding(fp, sizeof(header), header.statesOffset) ||
+        (fleet->count && fwrite(fleet->states, fleet->count, 1, fp) != 1) ||
+        !SNP_WritePadding(fp, header.statesOffset + fleet->count, header.instancesOffset) ||
+        (instancesSize && fwrite(fleet->instances, (size_t)instancesSize, 1, fp) != 1))
+        success = FALSE;
+
+    return SNP_Commit(fp, tmpPath, path, success);
+}
+
+//----------------------------------------------------------------------------
+// SNP_MapFleet
+//----------------------------------------------------------------------------
+BOOL SNP_MapFleet(SM_Fleet* fleet, const SM_StateMachineConst* selfConst, const char* path)
+{
+    SNP_Mapping mapping;
+    const SNP_FileHeader* header = NULL;
+    SNP_Mapping* slot = NULL;
+    size_t size = 0;
+    UINT32 i;
+
+    ASSERT_TRUE(fleet);
+    ASSERT_TRUE(selfConst);
+    ASSERT_TRUE(path);
+
+    memset(&mapping, 0, sizeof(mapping));
+    header = (const SNP_FileHeader*)SNP_Map(path, TRUE, &size, &mapping);
+    if (header == NULL)
+        return FALSE;
+
+    // Only the header is read here; the arrays are paged in on first use
+    if (header->magic != SNP_FILE_MAGIC || header->version != SNP_FILE_VERSION ||
+        header->kind != SNP_FLEET || header->count != fleet->count ||
+        header->instanceSize != fleet->instanceSize || header->maxStates != selfConst->maxStates ||
+        strncmp(header->typeName, selfConst->name, SNP_NAME_SIZE - 1) != 0 ||
+        header->fileSize != size ||
+        header->statesOffset + fleet->count > header->instancesOffset ||
+        header->instancesOffset + (UINT64)fleet->count * fleet->instanceSize > size)
+    {
+        SNP_Unmap(&mapping);
+        return FALSE;
+    }
+
+    // Replace an earlier snapshot of the same fleet
+    SNP_UnmapFleet(fleet);
+
+    for (i = 0; i < SNP_MAX_MAPPINGS && slot == NULL; i++)
+    {
+        if (_mappings[i].fleet == NULL)
+            slot = &_mappings[i];
+    }
+    ASSERT_TRUE(slot);
+
+    *slot = mapping;
+    slot->fleet = fleet;
+    slot->states = fleet->states;
+    slot->instances = fleet->instances;
+
+    fleet->states = (BYTE*)mapping.map + header->statesOffset;
+    fleet->instances = (char*)mapping.map + header->instancesOffset;
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// SNP_UnmapFleet
+//----------------------------------------------------------------------------
+void SNP_UnmapFleet(SM_Fleet* fleet)
+{
+    UINT32 i;
+
+    ASSERT_TRUE(fleet);
+
+    for (i = 0; i < SNP_MAX_MAPPINGS; i++)
+    {
+        SNP_Mapping* mapping = &_mappings[i];
+        if (mapping->fleet != fleet)
+            continue;
+
+        // Copy the current state back into the fleet's own arrays
+        memcpy(mapping->states, fleet->states, fleet->count);
+        memcpy(mapping->instances, fleet->instances, (size_t)fleet->count * fleet->instanceSize);
+        fleet->states = mapping->states;
+        fleet->instances = mapping->instances;
+
+        SNP_Unmap(mapping);
+        mapping->fleet = NULL;
+    }
+}
+
+//----------------------------------------------------------------------------
+// SNP_Save
+//----------------------------------------------------------------------------
+BOOL SNP_Save(const SNP_Instance* instances, UINT32 count, const char* path)
+{
+    SNP_FileHeader header;
+    SNP_FileEntry entry;
+    char tmpPath[260];
+    FILE* fp = NULL;
+    UINT64 offset;
+    UINT32 i;
+    BOOL success = TRUE;
+
+    ASSERT_TRUE(instances || count == 0);
+    ASSERT_TRUE(path);
+
+    memset(&header, 0, sizeof(header));
+    header.magic = SNP_FILE_MAGIC;
+    header.version = SNP_FILE_VERSION;
+    header.kind = SNP_INSTANCES;
+    header.count = count;
+
+    // Instance data follows the entry table, 8 byte aligned
+    offset = sizeof(header) + (UINT64)count * sizeof(SNP_FileEntry);
+    for (i = 0; i < count; i++)
+        offset += (instances[i].instanceSize + 7) & ~(size_t)7;
+    header.fileSize = offset;
+
+    if (snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path) >= (int)sizeof(tmpPath))
+        return FALSE;
+    fp = fopen(tmpPath, "wb");
+    if (fp == NULL)
+        return FALSE;
+
+    if (fwrite(&header, sizeof(header), 1, fp) != 1)
+        success = FALSE;
+
+    offset = sizeof(header) + (UINT64)count * sizeof(SNP_FileEntry);
+    for (i = 0; success && i < count; i++)
+    {
+        const SM_StateMachine* machine = instances[i].machine;
+
+        ASSERT_TRUE(machine);
+        memset(&entry, 0, sizeof(entry));
+        entry.offset = offset;
+        entry.size = instances[i].instanceSize;
+        entry.state = machine->currentState;
+        strncpy(entry.name, machine->name, SNP_NAME_SIZE - 1);
+        offset += (entry.size + 7) & ~(UINT64)7;
+
+        if (fwrite(&entry, sizeof(entry), 1, fp) != 1)
+            success = FALSE;
+    }
+
+    offset = sizeof(header) + (UINT64)count * sizeof(SNP_FileEntry);
+    for (i = 0; success && i < count; i++)
+    {
+        size_t size = instances[i].instanceSize;
+        UINT64 next = offset + ((size + 7) & ~(size_t)7);
+
+        if ((size && fwrite(instances[i].machine->pInstance, size, 1, fp) != 1) ||
+            !SNP_WritePadding(fp, offset + size, next))
+            success = FALSE;
+        offset = next;
+    }
+
+    return SNP_Commit(fp, tmpPath, path, success);
+}
+
+//----------------------------------------------------------------------------
+// SNP_Restore
+//----------------------------------------------------------------------------
+BOOL SNP_Restore(const SNP_Instance* instances, UINT32 count, const char* path)
+{
+    SNP_Mapping mapping;
+    const SNP_FileHeader* header = NULL;
+    const SNP_FileEntry* entries = NULL;
+    size_t size = 0;
+    UINT32 i;
+    BOOL success = TRUE;
+
+    ASSERT_TRUE(instances || count == 0);
+    ASSERT_TRUE(path);
+
+    memset(&mapping, 0, sizeof(mapping));
+    header = (const SNP_FileHeader*)SNP_Map(path, FALSE, &size, &mapping);
+    if (header == NULL)
+        return FALSE;
+
+    if (header->magic != SNP_FILE_MAGIC || header->version != SNP_FILE_VERSION ||
+        header->kind != SNP_INSTANCES || header->count != count || header->fileSize != size ||
+        sizeof(SNP_FileHeader) + (UINT64)count * sizeof(SNP_FileEntry) > size)
+        success = FALSE;
+
+    // Check every instance before changing any
+    entries = (const SNP_FileEntry*)(header + 1);
+    for (i = 0; success && i < count; i++)
+    {
+        const SM_StateMachine* machine = instances[i].machine;
+
+        ASSERT_TRUE(machine);
+        if (entries[i].size != instances[i].instanceSize ||
+            entries[i].offset + entries[i].size > size ||
+            strncmp(entries[i].name, machine->name, SNP_NAME_SIZE - 1) != 0 ||
+            (machine->selfConst && entries[i].state >= machine->selfConst->maxStates))
+            success = FALSE;
+    }
+
+    for (i = 0; success && i < count; i++)
+    {
+        SM_StateMachine* machine = instances[i].machine;
+
+        machine->currentState = entries[i].state;
+        machine->newState = entries[i].state;
+        if (entries[i].size)
+            memcpy(machine->pInstance, (const BYTE*)header + entries[i].offset, (size_t)entries[i].size);
+    }
+
+    SNP_Unmap(&mapping);
+    return success;
+}
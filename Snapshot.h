@@ -0,0 +1,109 @@
+// The Snapshot module checkpoints state machine instances to a versioned
+// file and restores them at startup, instead of replaying events to
+// rebuild state.
+//
+// SNP_SaveFleet() writes a fleet's state array and instance data array to
+// page aligned sections of the file. SNP_MapFleet() maps the file copy on
+// write and points the fleet at the mapped arrays, so restoring a fleet of
+// any size costs a header check; pages are read in as instances are touched.
+// Changes after the restore stay in memory and never reach the file.
+//
+// SNP_Save() and SNP_Restore() checkpoint individually defined instances
+// (SM_DEFINE) listed in an SNP_Instance table. Each instance's current state
+// and instance data are copied; instances are matched by table position and
+// checked by name and instance data size.
+//
+// Instance data is saved byte for byte. Pointers it holds, e.g. an armed
+// SM_Timer, are meaningless after a restart: checkpoint instances whose
+// timers are stopped, or restart their timers after a restore. A snapshot
+// is only restored into the same state machine type, state count and
+// instance data size it was saved from; otherwise the restore fails and
+// nothing is changed.
+//
+// #include "Snapshot.h"
+// SM_FLEET_DEFINE(MotorFleet, Motor, 1000000)
+//
+// if (!SNP_MapFleet(&MotorFleetObj, &MotorConst, "motors.snap"))
+//      ...cold start
+// ...
+// SNP_SaveFleet(&MotorFleetObj, &MotorConst, "motors.snap");
+//
+// static const SNP_Instance instances[] = {
+//      SNP_INSTANCE(Motor1SM, Motor),
+//      SNP_INSTANCE(CentrifugeTestSM, CentrifugeTest) };
+// SNP_Save(instances, 2, "sm.snap");
+// SNP_Restore(instances, 2, "sm.snap");
+
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include "DataTypes.h"
+#include "StateMachine.h"
+#include "Fleet.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Snapshot file layout: an SNP_FileHeader, then for a fleet the state array
+// and the instance data array, each starting on an SNP_ALIGN boundary. For
+// an instance table, count SNP_FileEntry records follow the header, then
+// each instance's data at its entry's offset. Native byte order.
+#define SNP_FILE_MAGIC      0x4E534D53  // "SMSN"
+#define SNP_FILE_VERSION    1
+#define SNP_ALIGN           4096
+#define SNP_NAME_SIZE       32
+
+typedef enum
+{
+    SNP_FLEET,
+    SNP_INSTANCES
+} SNP_Kind;
+
+typedef struct
+{
+    UINT32 magic;
+    UINT32 version;
+    UINT32 kind;                    // SNP_Kind
+    UINT32 count;                   // Instances
+    UINT64 instanceSize;            // Fleet instance data size, 0 for an instance table
+    UINT64 statesOffset;            // Fleet state array
+    UINT64 instancesOffset;         // Fleet instance data array
+    UINT64 fileSize;
+    UINT32 maxStates;               // Fleet state machine type
+    UINT32 reserved;
+    CHAR typeName[SNP_NAME_SIZE];   // Fleet state machine type name
+} SNP_FileHeader;
+
+typedef struct
+{
+    UINT64 offset;                  // Instance data
+    UINT64 size;
+    BYTE state;
+    BYTE reserved[7];
+    CHAR name[SNP_NAME_SIZE];       // SM_StateMachine name, truncated
+} SNP_FileEntry;
+
+// An instance to checkpoint and its instance data size
+typedef struct
+{
+    SM_StateMachine* machine;
+    size_t instanceSize;
+} SNP_Instance;
+
+// e.g. SNP_INSTANCE(Motor1SM, Motor)
+#define SNP_INSTANCE(_smName_, _instance_) \
+    { &_smName_##Obj, sizeof(_instance_) }
+
+// Public functions
+BOOL SNP_SaveFleet(const SM_Fleet* fleet, const SM_StateMachineConst* selfConst, const char* path);
+BOOL SNP_MapFleet(SM_Fleet* fleet, const SM_StateMachineConst* selfConst, const char* path);
+void SNP_UnmapFleet(SM_Fleet* fleet);
+BOOL SNP_Save(const SNP_Instance* instances, UINT32 count, const char* path);
+BOOL SNP_Restore(const SNP_Instance* instances, UINT32 count, const char* path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SNAPSHOT_H
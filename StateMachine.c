@@ -1,32 +1,86 @@
 #include "Fault.h"
 #include "StateMachine.h"
+#include "Thread.h"
+#include "Atomic.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "Recorder.h"
+#include <string.h>
+
+// Header in front of SM_SharedAlloc event data. Keeps the event data 
+// 8 byte aligned.
+typedef struct
+{
+    ATOMIC32 refCount;
+    UINT32 reserved;
+} SM_SharedHeader;
+
+// Run-to-completion lock of an instance (see USE_SM_LOCK)
+#ifdef USE_SM_LOCK
+    #define SM_LOCK(_self_)     LK_MutexLock(&(_self_)->lock);
+    #define SM_UNLOCK(_self_)   LK_MutexUnlock(&(_self_)->lock);
+#else
+    #define SM_LOCK(_self_)
+    #define SM_UNLOCK(_self_)
+#endif
+
+// The instance an _SM_EventBatch() call on this thread is applying events to,
+// and the state machine constant data captured from its event functions.
+// Event functions that bypass _SM_ExternalEvent() (see StateMachine.hpp)
+// must call it when self is _SM_BatchMachine.
+TH_THREAD_LOCAL SM_StateMachine* _SM_BatchMachine;
+static TH_THREAD_LOCAL const SM_StateMachineConst* _batchConst;
 
 // Generates an external event. Called once per external event 
 // to start the state machine executing
 // 根据外部事件触发状态机这个函数用于生成外部事件，并启动状态机执行。
 void _SM_ExternalEvent(SM_StateMachine* self, const SM_StateMachineConst* selfConst, BYTE newState, void* pEventData) {
+    // Batched or probed event? Only record the transition.
+    BOOL batched = (self == _SM_BatchMachine);
+    if (batched)
+        _batchConst = selfConst;
+
+    REC_EVENT(self, selfConst, pEventData)
+
     // 如果新状态是忽略事件
     if (newState == EVENT_IGNORED) {
         // 如果有事件数据，则删除它
-        if (pEventData)
-            SM_XFree(pEventData);  // 释放事件数据内存
+        _SM_FreeEventData(self, pEventData);  // 释放事件数据内存
+        self->eventId = 0;
+    }
+    else if (batched) {
+        // _SM_EventBatch() runs the state engine when the event function 
+        // returns, already holding any lock.
+        _SM_InternalEvent(self, newState, pEventData);
     }
     else {
-        // 如果需要线程安全，这里可以加锁
+        // The caller holds any lock (see _SM_Event)
 
         // 产生一个内部事件
         _SM_InternalEvent(self, newState, pEventData);
 
         // 根据状态映射表的类型，执行状态机
-        if (selfConst->stateMap)
+        if (selfConst->engine)
+            selfConst->engine(self, selfConst);  // Generated state engine
+        else if (selfConst->stateMap)
             _SM_StateEngine(self, selfConst);  // 执行基本状态引擎
         else
             _SM_StateEngineEx(self, selfConst);  // 执行扩展状态引擎
-
-        // 如果加锁了，这里可以解锁
+        self->eventId = 0;
     }
 }
 
+// Generates an external event by calling its event function, which looks up
+// the transition and runs the state engine, with any lock held
+void _SM_Event(SM_StateMachine* self, SM_EventFunc eventFunc, void* pEventData) {
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(eventFunc);
+
+    SM_LOCK(self)
+    eventFunc(self, pEventData);
+    SM_UNLOCK(self)
+}
+
 // Generates an internal event. Called from within a state 
 // function to transition to a new state这个函数用于在状态函数内部生成事件，并触发状态转换。
 // 在状态函数内部产生一个内部事件，用于状态转换
@@ -42,6 +96,9 @@ void _SM_InternalEvent(SM_StateMachine* self, BYTE newState, void* pEventData) {
 // 状态引擎，执行状态机状态
 void _SM_StateEngine(SM_StateMachine* self, const SM_StateMachineConst* selfConst) {
     void* pDataTemp = NULL;
+    MET_ENGINE_BEGIN(selfConst)
+    TRC_ENGINE_BEGIN(self)
+    REC_NESTED_BEGIN()
 
     ASSERT_TRUE(self);
     ASSERT_TRUE(selfConst);
@@ -63,19 +120,29 @@ void _SM_StateEngine(SM_StateMachine* self, const SM_StateMachineConst* selfCons
         // 重置事件生成标志
         self->eventGenerated = FALSE;
 
+        MET_CHAIN();
+        MET_TRANSITION(self->currentState, self->newState);
+        TRC_TRANSITION(self, TRC_GUARD_NONE);
+
         // 切换到新的当前状态
         self->currentState = self->newState;
 
         // 执行状态函数，传递事件数据
         ASSERT_TRUE(state != NULL);
+        MET_START();
         state(self, pDataTemp);
+        MET_STOP(self->currentState, MET_STATE);
 
         // 如果使用了事件数据，则删除它
         if (pDataTemp) {
-            SM_XFree(pDataTemp);
+            _SM_FreeEventData(self, pDataTemp);
             pDataTemp = NULL;
         }
     }
+
+    MET_ENGINE_END();
+    TRC_ENGINE_END(self);
+    REC_NESTED_END();
 }
 
 // The state engine executes the extended state machine states
@@ -85,6 +152,9 @@ void _SM_StateEngine(SM_StateMachine* self, const SM_StateMachineConst* selfCons
 void _SM_StateEngineEx(SM_StateMachine* self, const SM_StateMachineConst* selfConst) {
     BOOL guardResult = TRUE;  // 守卫条件结果，默认为真
     void* pDataTemp = NULL;   // 临时存储事件数据指针
+    MET_ENGINE_BEGIN(selfConst)
+    TRC_ENGINE_BEGIN(self)
+    REC_NESTED_BEGIN()
 
     ASSERT_TRUE(self);  // 断言状态机实例存在
     ASSERT_TRUE(selfConst);  // 断言状态机常量结构体存在
@@ -109,38 +179,340 @@ void _SM_StateEngineEx(SM_StateMachine* self, const SM_StateMachineConst* selfCo
         // 重置事件生成标志
         self->eventGenerated = FALSE;
 
+        MET_CHAIN();
+
         // 执行守卫函数
-        if (guard != NULL)
+        if (guard != NULL) {
+            MET_START();
             guardResult = guard(self, pDataTemp);  // 执行守卫条件判断函数
+            MET_STOP(self->newState, MET_GUARD);
+        }
+
+        TRC_TRANSITION(self, guard == NULL ? TRC_GUARD_NONE : 
+            guardResult == TRUE ? TRC_GUARD_PASS : TRC_GUARD_FAIL);
 
         // 如果守卫条件成功
         if (guardResult == TRUE) {
             // 转换到新状态？
             if (self->newState != self->currentState) {
                 // 如果是新状态，先执行当前状态的退出动作
-                if (exit != NULL)
+                if (exit != NULL) {
+                    MET_START();
                     exit(self);  // 执行退出函数
+                    MET_STOP(self->currentState, MET_EXIT);
+                }
 
                 // 执行新状态的进入动作
-                if (entry != NULL)
+                if (entry != NULL) {
+                    MET_START();
                     entry(self, pDataTemp);  // 执行进入函数
+                    MET_STOP(self->newState, MET_ENTRY);
+                }
 
                 // 确保退出/进入动作没有意外地调用 SM_InternalEvent
                 ASSERT_TRUE(self->eventGenerated == FALSE);
             }
 
+            MET_TRANSITION(self->currentState, self->newState);
+
             // 切换到新的当前状态
             self->currentState = self->newState;
 
             // 执行状态函数，传递事件数据
             ASSERT_TRUE(state != NULL);
+            MET_START();
             state(self, pDataTemp);
+            MET_STOP(self->currentState, MET_STATE);
+        }
+        else {
+            MET_GUARD_REJECT(self->newState);
         }
 
         // 如果使用了事件数据，则删除它
         if (pDataTemp) {
-            SM_XFree(pDataTemp);  // 释放事件数据内存
+            _SM_FreeEventData(self, pDataTemp);  // 释放事件数据内存
             pDataTemp = NULL;
         }
     }
-}
\ No newline at end of file
+
+    MET_ENGINE_END();
+    TRC_ENGINE_END(self);
+    REC_NESTED_END();
+}
+
+// Applies an array of external events to one instance. The lock is taken 
+// once and the state engine selected once for the whole array; the event 
+// functions and states execute exactly as with one SM_Event() per message.
+void _SM_EventBatch(SM_StateMachine* self, const SM_Message* msgs, UINT32 count) {
+    SM_StateMachine* prevMachine = _SM_BatchMachine;
+    const SM_StateMachineConst* prevConst = _batchConst;
+    SM_EngineFunc engine = NULL;
+    UINT32 i;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(msgs || count == 0);
+
+    // 如果需要线程安全，这里可以为整个批次加一次锁
+    SM_LOCK(self)
+
+    // Mark the instance so its event functions only record the transition
+    _SM_BatchMachine = self;
+
+    for (i = 0; i < count; i++) {
+        void* pEventData = msgs[i].pEventData;
+
+        ASSERT_TRUE(msgs[i].eventFunc);
+
+        // Event data the engine does not own
+        if (msgs[i].ownership != SM_DATA_OWNED && pEventData) {
+            self->pForeignData = pEventData;
+            self->foreignOwnership = msgs[i].ownership;
+            self->destructor = msgs[i].destructor;
+            self->destructorContext = msgs[i].destructorContext;
+        }
+
+        // Move inline event data into the instance
+        if (msgs[i].inlineSize) {
+            ASSERT_TRUE(msgs[i].inlineSize <= SM_INLINE_DATA_SIZE);
+            memcpy(self->inlineData.bytes, msgs[i].inlineData.bytes, msgs[i].inlineSize);
+            pEventData = self->inlineData.bytes;
+        }
+
+        // Look up the transition for the current state
+        msgs[i].eventFunc(self, pEventData);
+
+        // Run the state engine unless the event was ignored
+        if (self->eventGenerated) {
+            if (engine == NULL)
+                engine = _batchConst->engine ? _batchConst->engine : 
+                    _batchConst->stateMap ? _SM_StateEngine : _SM_StateEngineEx;
+            engine(self, _batchConst);
+        }
+        self->eventId = 0;
+
+        // Release event data an event function did not consume
+        if (self->pForeignData)
+            _SM_FreeEventData(self, self->pForeignData);
+    }
+
+    // Restore an enclosing batch, if a state function started this one
+    _SM_BatchMachine = prevMachine;
+    _batchConst = prevConst;
+
+    // 如果加锁了，这里可以解锁
+    SM_UNLOCK(self)
+}
+
+// Resolves the transition table of an external event function by running 
+// the event function for each state in record-only mode. The event function
+// must only perform the TRANSITION_MAP lookup. Returns the state machine 
+// constant data; transitions receives one entry per state.
+const SM_StateMachineConst* _SM_GetTransitions(SM_EventFunc eventFunc, BYTE* transitions) {
+    SM_StateMachine* prevMachine = _SM_BatchMachine;
+    const SM_StateMachineConst* prevConst = _batchConst;
+    const SM_StateMachineConst* selfConst = NULL;
+    SM_StateMachine probe = { "probe", NULL, 0, 0, 0, 0 };
+    BYTE maxStates = 1;
+    BYTE state;
+
+    ASSERT_TRUE(eventFunc);
+    ASSERT_TRUE(transitions);
+
+    _SM_BatchMachine = &probe;
+    REC_NESTED_BEGIN()
+
+    // State 0 always exists and reveals the number of states
+    for (state = 0; state < maxStates; state++) {
+        probe.currentState = state;
+        probe.eventGenerated = FALSE;
+        eventFunc(&probe, NULL);
+
+        if (selfConst == NULL) {
+            selfConst = _batchConst;
+            maxStates = selfConst->maxStates;
+        }
+        transitions[state] = probe.eventGenerated ? probe.newState : (BYTE)EVENT_IGNORED;
+    }
+
+    REC_NESTED_END();
+    _SM_BatchMachine = prevMachine;
+    _batchConst = prevConst;
+    return selfConst;
+}
+
+
+// Generates an external event by numeric event ID. The transition is read 
+// from the transition matrix of the instance's state machine type.
+void _SM_DispatchById(SM_StateMachine* self, BYTE eventId, void* pEventData) {
+    const SM_StateMachineConst* selfConst;
+
+    ASSERT_TRUE(self);
+    selfConst = self->selfConst;
+
+    // Instance must use SM_DEFINE_TYPED and its type a transition matrix
+    ASSERT_TRUE(selfConst);
+    ASSERT_TRUE(selfConst->transitionMatrix);
+    ASSERT_TRUE(eventId < selfConst->maxEvents);
+
+    SM_LOCK(self)
+    self->eventId = (BYTE)(eventId + 1);
+    _SM_ExternalEvent(self, selfConst, 
+        selfConst->transitionMatrix[eventId * selfConst->maxStates + self->currentState], pEventData);
+    SM_UNLOCK(self)
+}
+
+// Generates an external event by numeric event ID with a copy of the event
+// data, as _SM_EventCopy() does. Returns the instance's state before the 
+// event, read with any lock held.
+BYTE _SM_DispatchCopyById(SM_StateMachine* self, BYTE eventId, const void* pEventData, size_t dataSize) {
+    const SM_StateMachineConst* selfConst;
+    void* pData = NULL;
+    BYTE state;
+
+    ASSERT_TRUE(self);
+    selfConst = self->selfConst;
+
+    ASSERT_TRUE(selfConst);
+    ASSERT_TRUE(selfConst->transitionMatrix);
+    ASSERT_TRUE(eventId < selfConst->maxEvents);
+
+    // The inline copy belongs to the instance; lock before writing it
+    SM_LOCK(self)
+
+    if (pEventData && dataSize <= SM_INLINE_DATA_SIZE) {
+        memcpy(self->inlineData.bytes, pEventData, dataSize);
+        pData = self->inlineData.bytes;
+    }
+    else if (pEventData) {
+        pData = SM_XAlloc(dataSize);
+        ASSERT_TRUE(pData);
+        memcpy(pData, pEventData, dataSize);
+    }
+
+    state = self->currentState;
+    self->eventId = (BYTE)(eventId + 1);
+    _SM_ExternalEvent(self, selfConst, 
+        selfConst->transitionMatrix[eventId * selfConst->maxStates + state], pData);
+
+    SM_UNLOCK(self)
+    return state;
+}
+
+// Generates an external event with a copy of the event data. Small event 
+// data is copied into the instance instead of SM_XAlloc memory.
+void _SM_EventCopy(SM_StateMachine* self, SM_EventFunc eventFunc, const void* pEventData, size_t dataSize) {
+    void* pData = NULL;
+
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(eventFunc);
+
+    // The inline copy belongs to the instance; lock before writing it
+    SM_LOCK(self)
+
+    if (pEventData && dataSize <= SM_INLINE_DATA_SIZE) {
+        memcpy(self->inlineData.bytes, pEventData, dataSize);
+        pData = self->inlineData.bytes;
+    }
+    else if (pEventData) {
+        pData = SM_XAlloc(dataSize);
+        ASSERT_TRUE(pData);
+        memcpy(pData, pEventData, dataSize);
+    }
+
+    eventFunc(self, pData);
+
+    SM_UNLOCK(self)
+}
+
+// Deletes event data once consumed. Inline event data is not deleted and 
+// event data not owned by the engine is released according to its ownership.
+void _SM_FreeEventData(SM_StateMachine* self, void* pEventData) {
+    if (pEventData == NULL || pEventData == self->inlineData.bytes)
+        return;
+
+    if (pEventData == self->pForeignData) {
+        self->pForeignData = NULL;
+        _SM_ReleaseEventData(pEventData, (SM_DataOwnership)self->foreignOwnership, 
+            self->destructor, self->destructorContext);
+    }
+    else
+        SM_XFree(pEventData);
+}
+
+// Releases event data according to its ownership
+void _SM_ReleaseEventData(void* pEventData, SM_DataOwnership ownership, 
+    SM_DataDestructor destructor, void* context) {
+    if (pEventData == NULL)
+        return;
+
+    switch (ownership) {
+    case SM_DATA_OWNED:
+        SM_XFree(pEventData);
+        break;
+    case SM_DATA_SHARED:
+        SM_SharedRelease(pEventData);
+        break;
+    case SM_DATA_EXTERNAL:
+        if (destructor)
+            destructor(pEventData, context);
+        break;
+    default:
+        // Borrowed event data belongs to the caller
+        break;
+    }
+}
+
+// Generates an external event with event data the engine does not own
+void _SM_EventRef(SM_StateMachine* self, SM_EventFunc eventFunc, void* pEventData, 
+    SM_DataOwnership ownership, SM_DataDestructor destructor, void* context) {
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(eventFunc);
+
+    SM_LOCK(self)
+
+    if (pEventData && ownership != SM_DATA_OWNED) {
+        // An instance holds one foreign event data at a time
+        ASSERT_TRUE(self->pForeignData == NULL);
+
+        if (ownership == SM_DATA_SHARED)
+            SM_SharedAddRef(pEventData);
+
+        self->pForeignData = pEventData;
+        self->foreignOwnership = (BYTE)ownership;
+        self->destructor = destructor;
+        self->destructorContext = context;
+    }
+
+    eventFunc(self, pEventData);
+
+    // Release event data an event function did not consume
+    if (pEventData && pEventData == self->pForeignData)
+        _SM_FreeEventData(self, pEventData);
+
+    SM_UNLOCK(self)
+}
+
+// Allocates shared event data with a reference count of one
+void* SM_SharedAlloc(size_t size) {
+    SM_SharedHeader* header = (SM_SharedHeader*)SM_XAlloc(sizeof(SM_SharedHeader) + size);
+    ASSERT_TRUE(header);
+
+    ATOMIC_Store32(&header->refCount, 1);
+    return header + 1;
+}
+
+// Adds a reference to shared event data
+void SM_SharedAddRef(void* pEventData) {
+    SM_SharedHeader* header = (SM_SharedHeader*)pEventData - 1;
+    ASSERT_TRUE(pEventData);
+    ATOMIC_FetchAdd32(&header->refCount, 1);
+}
+
+// Releases a reference to shared event data. The last reference deletes it.
+void SM_SharedRelease(void* pEventData) {
+    SM_SharedHeader* header = (SM_SharedHeader*)pEventData - 1;
+    ASSERT_TRUE(pEventData);
+
+    if (ATOMIC_FetchAdd32(&header->refCount, (UINT32)-1) == 1)
+        SM_XFree(header);
+}
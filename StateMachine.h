@@ -17,6 +17,8 @@
 
 #include "DataTypes.h" // 引入自定义数据类型
 #include "Fault.h"     // 引入故障管理相关的头文件
+#include "LockGuard.h"
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -34,21 +36,78 @@ extern "C" {
     #define SM_XFree(ptr)   free(ptr)       // 使用标准库的free来释放内存
 #endif
 
+// Compile with USE_SM_LOCK to generate external events to an instance from
+// any thread. SM_Event(), SM_EventCopy(), SM_EventBorrowed(),
+// SM_EventShared(), SM_EventExternal(), SM_DispatchById() and each 
+// SM_EventBatch() call hold the instance's lock from before the event data
+// is stored and the transition is looked up until the state engine returns,
+// so events execute one at a time. Calling an event function directly 
+// bypasses the lock. A state function must not generate an external event 
+// to its own instance.
+
+// State functions print diagnostics with SM_Print. Define SM_NO_PRINT to 
+// compile the printouts out, e.g. for load tests.
+#ifdef SM_NO_PRINT
+    #define SM_Print(...)   ((void)0)
+#else
+    #include <stdio.h>
+    #define SM_Print        printf
+#endif
+
 enum { EVENT_IGNORED = 0xFE, CANNOT_HAPPEN = 0xFF };  // 定义事件处理的结果常量
 
 typedef void NoEventData;    // 空事件数据类型定义
 
+struct SM_StateMachine;
+struct SM_StateMachineConst;
+
+// A state engine generated for one state machine type (see tools/sm_gen.c)
+typedef void (*SM_EngineFunc)(struct SM_StateMachine* self, const struct SM_StateMachineConst* selfConst);
+
 // 状态机常量数据结构
-typedef struct
+typedef struct SM_StateMachineConst
 {
     const CHAR* name;                // 状态机名称
     const BYTE maxStates;            // 最大状态数
     const struct SM_StateStruct* stateMap;        // 指向常规状态映射的指针
     const struct SM_StateStructEx* stateMapEx;    // 指向扩展状态映射的指针
+    const BYTE* transitionMatrix;    // [event][state] transitions, or NULL (see BEGIN_TRANSITION_MATRIX)
+    const BYTE maxEvents;            // Number of transition matrix rows
+    const SM_EngineFunc engine;      // State engine used instead of _SM_StateEngine(Ex), or NULL
 } SM_StateMachineConst;
 
+struct SM_Mailbox;
+
+// Event data up to SM_INLINE_DATA_SIZE bytes is copied into storage inside 
+// the instance or queued message rather than SM_XAlloc memory (see 
+// SM_EventCopy). Larger event data uses SM_XAlloc as before.
+#ifndef SM_INLINE_DATA_SIZE
+#define SM_INLINE_DATA_SIZE     16
+#endif
+
+typedef union
+{
+    BYTE bytes[SM_INLINE_DATA_SIZE];
+    UINT64 align;
+    void* ptr;
+} SM_InlineData;
+
+// Event data ownership. The state engine deletes owned event data with 
+// SM_XFree once consumed. Borrowed data is never deleted. Shared data 
+// (SM_SharedAlloc) is reference counted; each consumer releases one 
+// reference. External data is released with a user destructor.
+typedef enum
+{
+    SM_DATA_OWNED,
+    SM_DATA_BORROWED,
+    SM_DATA_SHARED,
+    SM_DATA_EXTERNAL
+} SM_DataOwnership;
+
+typedef void (*SM_DataDestructor)(void* pEventData, void* context);
+
 // 状态机实例数据结构
-typedef struct 
+typedef struct SM_StateMachine
 {
     const CHAR* name;       // 实例名称
     void* pInstance;        // 指向实例数据的指针
@@ -56,6 +115,15 @@ typedef struct
     BYTE currentState;      // 当前状态
     BOOL eventGenerated;    // 表示是否生成了事件
     void* pEventData;       // 指向事件数据的指针
+    struct SM_Mailbox* pMailbox;    // Event mailbox when in active object mode, otherwise NULL
+    const SM_StateMachineConst* selfConst;  // State machine type for SM_DispatchById (see SM_DEFINE_TYPED), or NULL
+    SM_InlineData inlineData;       // Event data of the event being executed, if copied inline
+    void* pForeignData;             // Event data not owned by the engine, or NULL
+    BYTE foreignOwnership;          // SM_DataOwnership of pForeignData
+    SM_DataDestructor destructor;   // SM_DATA_EXTERNAL destructor and its context
+    void* destructorContext;
+    BYTE eventId;                   // Transition matrix event ID + 1 of the event being executed, or 0
+    LK_Mutex lock;                  // Held while executing an event, USE_SM_LOCK builds only
 } SM_StateMachine;
 
 // 定义各种状态函数、守卫函数、入口函数和出口函数的类型
@@ -64,6 +132,23 @@ typedef BOOL (*SM_GuardFunc)(SM_StateMachine* self, void* pEventData);
 typedef void (*SM_EntryFunc)(SM_StateMachine* self, void* pEventData);
 typedef void (*SM_ExitFunc)(SM_StateMachine* self);
 
+// Generic external event function signature (see EVENT_DEFINE)
+typedef void (*SM_EventFunc)(SM_StateMachine* self, void* pEventData);
+
+// A queued external event. Event data is either pEventData, released 
+// according to ownership, or inlineSize bytes copied into inlineData.
+typedef struct
+{
+    SM_EventFunc eventFunc;
+    void* pEventData;
+    UINT16 inlineSize;
+    BYTE ownership;                 // SM_DataOwnership of pEventData
+    UINT32 deadline;                // Delivery deadline, TH_GetTimeNs() ms, or 0 (see SM_MailboxPriority)
+    SM_DataDestructor destructor;   // SM_DATA_EXTERNAL destructor and its context
+    void* destructorContext;
+    SM_InlineData inlineData;
+} SM_Message;
+
 typedef struct SM_StateStruct
 {
     SM_StateFunc pStateFunc;    // 状态函数指针
@@ -77,16 +162,64 @@ typedef struct SM_StateStructEx
     SM_ExitFunc pExitFunc;      // 出口函数指针
 } SM_StateStructEx;
 
+// Checks that _eventData_ has the event function's event data type. The
+// event function is not called. The event macros below pass the event
+// function as an SM_EventFunc, which would drop the check.
+#define SM_CHECK_EVENT(_eventFunc_, _eventData_) \
+    (void)(0 ? _eventFunc_((SM_StateMachine*)0, _eventData_) : (void)0)
+
 // Public functions这些公共函数宏是用于触发状态机事件和获取状态机信息：
 /*
 SM_Event: 触发指定的状态机事件处理函数。
 SM_Get: 获取通过状态机处理的数据。
 */
+#ifdef USE_SM_LOCK
+#define SM_Event(_smName_, _eventFunc_, _eventData_) \
+    (SM_CHECK_EVENT(_eventFunc_, _eventData_), \
+    _SM_Event(&_smName_##Obj, (SM_EventFunc)_eventFunc_, _eventData_))
+#else
 #define SM_Event(_smName_, _eventFunc_, _eventData_) \
     _eventFunc_(&_smName_##Obj, _eventData_)
+#endif
 #define SM_Get(_smName_, _getFunc_) \
     _getFunc_(&_smName_##Obj)
 
+// SM_EventBatch: apply an array of SM_Message events to one instance in a 
+// single call. The result is identical to calling SM_Event() for each 
+// message in order.
+#define SM_EventBatch(_smName_, _msgs_, _count_) \
+    _SM_EventBatch(&_smName_##Obj, _msgs_, _count_)
+
+// SM_EventCopy: generate an external event with a copy of the event data 
+// pointed to by _eventData_, e.g. a local variable. Data up to 
+// SM_INLINE_DATA_SIZE bytes is copied into the instance, so no memory is 
+// allocated. The copy is valid until the state function returns.
+#define SM_EventCopy(_smName_, _eventFunc_, _eventData_) \
+    (SM_CHECK_EVENT(_eventFunc_, _eventData_), \
+    _SM_EventCopy(&_smName_##Obj, (SM_EventFunc)_eventFunc_, _eventData_, sizeof(*(_eventData_))))
+
+// SM_EventBorrowed: generate an external event with event data the state 
+// machine must not delete. The data must stay valid until the event returns.
+// SM_EventShared: generate an external event with SM_SharedAlloc event data.
+// The state machine takes its own reference, so one payload can be sent to 
+// any number of instances; the caller releases its reference afterwards.
+// SM_EventExternal: generate an external event with event data released by 
+// calling _destructor_(pEventData, _context_) once consumed.
+#define SM_EventBorrowed(_smName_, _eventFunc_, _eventData_) \
+    (SM_CHECK_EVENT(_eventFunc_, _eventData_), \
+    _SM_EventRef(&_smName_##Obj, (SM_EventFunc)_eventFunc_, _eventData_, SM_DATA_BORROWED, NULL, NULL))
+#define SM_EventShared(_smName_, _eventFunc_, _eventData_) \
+    (SM_CHECK_EVENT(_eventFunc_, _eventData_), \
+    _SM_EventRef(&_smName_##Obj, (SM_EventFunc)_eventFunc_, _eventData_, SM_DATA_SHARED, NULL, NULL))
+#define SM_EventExternal(_smName_, _eventFunc_, _eventData_, _destructor_, _context_) \
+    (SM_CHECK_EVENT(_eventFunc_, _eventData_), \
+    _SM_EventRef(&_smName_##Obj, (SM_EventFunc)_eventFunc_, _eventData_, SM_DATA_EXTERNAL, _destructor_, _context_))
+
+// SM_DispatchById: generate an external event by numeric event ID using the 
+// transition matrix. The instance must be defined with SM_DEFINE_TYPED.
+#define SM_DispatchById(_smName_, _eventId_, _eventData_) \
+    _SM_DispatchById(&_smName_##Obj, _eventId_, _eventData_)
+
 // Protected functions这些内部函数宏用于更新状态机的内部状态和获取实例指针：
 /*
 SM_InternalEvent: 当前状态机实例产生一个内部事件，改变状态。
@@ -105,6 +238,24 @@ void _SM_ExternalEvent(SM_StateMachine* self, const SM_StateMachineConst* selfCo
 void _SM_InternalEvent(SM_StateMachine* self, BYTE newState, void* pEventData);
 void _SM_StateEngine(SM_StateMachine* self, const SM_StateMachineConst* selfConst);
 void _SM_StateEngineEx(SM_StateMachine* self, const SM_StateMachineConst* selfConst);
+void _SM_Event(SM_StateMachine* self, SM_EventFunc eventFunc, void* pEventData);
+void _SM_EventBatch(SM_StateMachine* self, const SM_Message* msgs, UINT32 count);
+const SM_StateMachineConst* _SM_GetTransitions(SM_EventFunc eventFunc, BYTE* transitions);
+void _SM_DispatchById(SM_StateMachine* self, BYTE eventId, void* pEventData);
+BYTE _SM_DispatchCopyById(SM_StateMachine* self, BYTE eventId, const void* pEventData, size_t dataSize);
+void _SM_EventCopy(SM_StateMachine* self, SM_EventFunc eventFunc, const void* pEventData, size_t dataSize);
+void _SM_FreeEventData(SM_StateMachine* self, void* pEventData);
+void _SM_EventRef(SM_StateMachine* self, SM_EventFunc eventFunc, void* pEventData, 
+    SM_DataOwnership ownership, SM_DataDestructor destructor, void* context);
+void _SM_ReleaseEventData(void* pEventData, SM_DataOwnership ownership, 
+    SM_DataDestructor destructor, void* context);
+
+// Shared event data. SM_SharedAlloc returns event data with a reference 
+// count of one, owned by the caller. The data is deleted when the last 
+// reference is released.
+void* SM_SharedAlloc(size_t size);
+void SM_SharedAddRef(void* pEventData);
+void SM_SharedRelease(void* pEventData);
 
 //这些宏用于在代码中声明和定义状态机及其组件：
 /*
@@ -118,6 +269,17 @@ SM_DEFINE: 定义一个初始状态为0的状态机实例。
     SM_StateMachine _smName_##Obj = { #_smName_, _instance_, \
         0, 0, 0, 0 }; 
 
+// SM_CONST_DECLARE: export a state machine type defined with a transition 
+// matrix (see END_STATE_MAP_MATRIX), e.g. SM_CONST_DECLARE(Motor)
+// SM_DEFINE_TYPED: define an instance bound to its state machine type, so 
+// events can be dispatched by ID, e.g. SM_DEFINE_TYPED(Motor1SM, &motorObj1, Motor)
+#define SM_CONST_DECLARE(_smType_) \
+    extern const SM_StateMachineConst _smType_##Const;
+
+#define SM_DEFINE_TYPED(_smName_, _instance_, _smType_) \
+    SM_StateMachine _smName_##Obj = { #_smName_, _instance_, \
+        0, 0, 0, 0, NULL, &_smType_##Const }; 
+
 /*
 事件、状态、条件、入口和出口的声明与定义宏
 这些宏用于定义状态机的各个组成部分，如事件处理函数、状态函数、条件函数（守护），以及入口和出口函数：
@@ -177,6 +339,24 @@ BEGIN_STATE_MAP_EX 和 END_STATE_MAP_EX: 定义一个包含额外数据如守卫
         (sizeof(_smName_##StateMap)/sizeof(_smName_##StateMap[0])), \
         _smName_##StateMap, NULL };
 
+// Fails to compile unless every transition matrix row was defined once 
+// (see BEGIN_TRANSITION_MATRIX)
+#define SM_MATRIX_ROW_CHECK(_smName_) \
+    typedef char _smName_##MatrixRowCheck[(__COUNTER__ - _smName_##MatrixFirstRow == \
+        sizeof(_smName_##Matrix)/sizeof(_smName_##Matrix[0])) ? 1 : -1];
+
+// END_STATE_MAP_MATRIX: same as END_STATE_MAP, with the transition matrix 
+// defined before the state map. The state machine constant data is exported.
+#define END_STATE_MAP_MATRIX(_smName_) \
+    }; \
+    typedef char _smName_##MatrixCheck[(sizeof(_smName_##Matrix[0]) == \
+        sizeof(_smName_##StateMap)/sizeof(_smName_##StateMap[0])) ? 1 : -1]; \
+    SM_MATRIX_ROW_CHECK(_smName_) \
+    const SM_StateMachineConst _smName_##Const = { #_smName_, \
+        (sizeof(_smName_##StateMap)/sizeof(_smName_##StateMap[0])), \
+        _smName_##StateMap, NULL, _smName_##Matrix[0], \
+        (sizeof(_smName_##Matrix)/sizeof(_smName_##Matrix[0])) };
+
 #define BEGIN_STATE_MAP_EX(_smName_) \
     static const SM_StateStructEx _smName_##StateMap[] = { 
 
@@ -192,6 +372,16 @@ BEGIN_STATE_MAP_EX 和 END_STATE_MAP_EX: 定义一个包含额外数据如守卫
         (sizeof(_smName_##StateMap)/sizeof(_smName_##StateMap[0])), \
         NULL, _smName_##StateMap };
 
+#define END_STATE_MAP_EX_MATRIX(_smName_) \
+    }; \
+    typedef char _smName_##MatrixCheck[(sizeof(_smName_##Matrix[0]) == \
+        sizeof(_smName_##StateMap)/sizeof(_smName_##StateMap[0])) ? 1 : -1]; \
+    SM_MATRIX_ROW_CHECK(_smName_) \
+    const SM_StateMachineConst _smName_##Const = { #_smName_, \
+        (sizeof(_smName_##StateMap)/sizeof(_smName_##StateMap[0])), \
+        NULL, _smName_##StateMap, _smName_##Matrix[0], \
+        (sizeof(_smName_##Matrix)/sizeof(_smName_##Matrix[0])) };
+
 /*
 转换映射宏
 这类宏用于定义状态间在特定事件下的转换规则：
@@ -208,6 +398,46 @@ BEGIN_TRANSITION_MAP, TRANSITION_MAP_ENTRY, END_TRANSITION_MAP: 这些宏定义
     _SM_ExternalEvent(self, &_smName_##Const, TRANSITIONS[self->currentState], _eventData_); \
     C_ASSERT((sizeof(TRANSITIONS)/sizeof(BYTE)) == (sizeof(_smName_##StateMap)/sizeof(_smName_##StateMap[0])));
 
+/*
+Transition matrix macros. All event transition rows of a state machine are 
+collected into one [event][state] matrix, indexed by numeric event ID. The 
+matrix is defined before the state map, and the state map ends with 
+END_STATE_MAP_MATRIX or END_STATE_MAP_EX_MATRIX. Rows are indexed by event 
+ID; every event ID from 0 to the maximum must have exactly one row. An 
+omitted row would be zero filled, i.e. transition to state 0, so the state
+map end fails to compile unless the matrix has one BEGIN_TRANSITION_ROW per
+row. The rows are counted with __COUNTER__, which must not be used between
+BEGIN_TRANSITION_MATRIX and the end of the state map.
+
+BEGIN_TRANSITION_MATRIX(Motor, ST_MAX_STATES)
+    BEGIN_TRANSITION_ROW(MTR_HALT_EVENT)
+        TRANSITION_MAP_ENTRY(EVENT_IGNORED)     // ST_Idle
+        ...
+    END_TRANSITION_ROW
+END_TRANSITION_MATRIX
+
+EVENT_DEFINE(MTR_Halt, NoEventData)
+{
+    TRANSITION_MATRIX_EVENT(Motor, MTR_HALT_EVENT, pEventData)
+}
+*/
+#define BEGIN_TRANSITION_MATRIX(_smName_, _maxStates_) \
+    enum { _smName_##MatrixFirstRow = __COUNTER__ + 1 }; \
+    static const BYTE _smName_##Matrix[][_maxStates_] = { 
+
+#define BEGIN_TRANSITION_ROW(_eventId_) \
+    [(_eventId_) + 0 * __COUNTER__] = { 
+
+#define END_TRANSITION_ROW \
+    }, 
+
+#define END_TRANSITION_MATRIX \
+    }; 
+
+#define TRANSITION_MATRIX_EVENT(_smName_, _eventId_, _eventData_) \
+    self->eventId = (BYTE)((_eventId_) + 1); \
+    _SM_ExternalEvent(self, &_smName_##Const, _smName_##Matrix[_eventId_][self->currentState], _eventData_);
+
 #ifdef __cplusplus
 }
 #endif
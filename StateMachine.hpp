@@ -0,0 +1,238 @@
+// The StateMachine.hpp module is a header-only C++17 front-end to the C
+// state machine. State maps and transition tables are compile-time types, so
+// the state engine dispatches with a switch on the state index and calls each
+// state, guard, entry and exit function directly. The compiler can inline
+// them, and guard/entry/exit checks are removed for states that do not have
+// them.
+//
+// Instances are ordinary SM_StateMachine objects (SM_DEFINE) and event data
+// is created with SM_XAlloc or copied inline (SM_EventCopy) as usual. Event
+// functions keep the SM_EventFunc signature, so they work with SM_Event,
+// SM_EventBatch, SM_Post and fleets.
+// State functions use the C macros (STATE_DEFINE, GUARD_DEFINE, etc.).
+//
+// Builds with engine hooks (USE_SM_METRICS, USE_SM_TRACE or USE_SM_RECORD)
+// run sm::Event through _SM_ExternalEvent() and the generic state engine, so
+// metrics, trace and recording see the events, as with sm_gen engines.
+//
+// #include "StateMachine.hpp"
+//
+// using MotorMap = sm::StateMap<
+//     sm::State<ST_Idle>,
+//     sm::State<ST_Stop>,
+//     sm::State<ST_Start>,
+//     sm::State<ST_ChangeSpeed>>;
+//
+// // Extended states add the guard, entry and exit functions
+// // sm::State<ST_WaitForAcceleration, nullptr, nullptr, EX_WaitForAcceleration>
+//
+// EVENT_DEFINE(MTR_Halt, NoEventData)
+// {
+//     sm::Event<MotorMap,
+//         EVENT_IGNORED,      // ST_Idle
+//         CANNOT_HAPPEN,      // ST_Stop
+//         ST_STOP,            // ST_Start
+//         ST_STOP>            // ST_ChangeSpeed
+//         (self, pEventData);
+// }
+
+#ifndef _STATE_MACHINE_HPP
+#define _STATE_MACHINE_HPP
+
+#include "StateMachine.h"
+#include "Thread.h"
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+// See StateMachine.c
+extern "C" TH_THREAD_LOCAL SM_StateMachine* _SM_BatchMachine;
+
+namespace sm
+{
+
+#if defined(USE_SM_METRICS) || defined(USE_SM_TRACE) || defined(USE_SM_RECORD)
+inline constexpr bool engineHooks = true;
+#else
+inline constexpr bool engineHooks = false;
+#endif
+
+// Extracts the event data type of a state, guard or entry function
+template <typename Func>
+struct FuncData;
+
+template <typename Ret, typename Data>
+struct FuncData<Ret (*)(SM_StateMachine*, Data*)>
+{
+    using Type = Data;
+};
+
+// One state map entry. Omitted guard, entry and exit functions are nullptr.
+template <auto StateFunc, auto GuardFunc = nullptr, auto EntryFunc = nullptr, auto ExitFunc = nullptr>
+struct State
+{
+    static constexpr bool hasGuard = !std::is_same_v<decltype(GuardFunc), std::nullptr_t>;
+    static constexpr bool hasEntry = !std::is_same_v<decltype(EntryFunc), std::nullptr_t>;
+    static constexpr bool hasExit = !std::is_same_v<decltype(ExitFunc), std::nullptr_t>;
+
+    static void Execute(SM_StateMachine* self, void* pEventData)
+    {
+        StateFunc(self, static_cast<typename FuncData<decltype(StateFunc)>::Type*>(pEventData));
+    }
+
+    static BOOL Guard(SM_StateMachine* self, void* pEventData)
+    {
+        if constexpr (hasGuard)
+            return GuardFunc(self, static_cast<typename FuncData<decltype(GuardFunc)>::Type*>(pEventData));
+        else
+            return TRUE;
+    }
+
+    static void Entry(SM_StateMachine* self, void* pEventData)
+    {
+        if constexpr (hasEntry)
+            EntryFunc(self, static_cast<typename FuncData<decltype(EntryFunc)>::Type*>(pEventData));
+    }
+
+    static void Exit(SM_StateMachine* self)
+    {
+        if constexpr (hasExit)
+            ExitFunc(self);
+    }
+
+    // The equivalent C state map entry
+    static SM_StateStructEx MapEntry()
+    {
+        SM_StateStructEx entry = { reinterpret_cast<SM_StateFunc>(StateFunc), NULL, NULL, NULL };
+        if constexpr (hasGuard)
+            entry.pGuardFunc = reinterpret_cast<SM_GuardFunc>(GuardFunc);
+        if constexpr (hasEntry)
+            entry.pEntryFunc = reinterpret_cast<SM_EntryFunc>(EntryFunc);
+        if constexpr (hasExit)
+            entry.pExitFunc = reinterpret_cast<SM_ExitFunc>(ExitFunc);
+        return entry;
+    }
+};
+
+// The state map. States are listed in state enumeration order.
+template <typename... States>
+class StateMap
+{
+public:
+    static constexpr BYTE maxStates = sizeof...(States);
+    static constexpr bool hasExit = (States::hasExit || ...);
+
+    static_assert(maxStates > 0 && maxStates < EVENT_IGNORED, "Invalid number of states");
+
+    // Executes the state machine states. Same semantics as _SM_StateEngineEx.
+    static void Engine(SM_StateMachine* self)
+    {
+        ASSERT_TRUE(self);
+
+        while (self->eventGenerated)
+        {
+            ASSERT_TRUE(self->newState < maxStates);
+
+            void* pDataTemp = self->pEventData;
+            self->pEventData = NULL;
+            self->eventGenerated = FALSE;
+
+            Dispatch(self, pDataTemp, std::index_sequence_for<States...>{});
+
+            if (pDataTemp)
+                _SM_FreeEventData(self, pDataTemp);
+        }
+    }
+
+    // The equivalent C state machine constant data, used when an event is
+    // applied by _SM_ExternalEvent(), _SM_EventBatch() or resolved by 
+    // _SM_GetTransitions(). Builds with engine hooks use the generic engine.
+    static const SM_StateMachineConst* Const()
+    {
+        static const SM_StateStructEx stateMap[] = { States::MapEntry()... };
+        static const SM_StateMachineConst smConst = 
+            { "sm::StateMap", maxStates, NULL, stateMap, NULL, 0, engineHooks ? NULL : ConstEngine };
+        return &smConst;
+    }
+
+private:
+    static void ConstEngine(SM_StateMachine* self, const SM_StateMachineConst* selfConst)
+    {
+        (void)selfConst;
+        Engine(self);
+    }
+
+    template <std::size_t... Index>
+    static void Dispatch(SM_StateMachine* self, void* pEventData, std::index_sequence<Index...>)
+    {
+        ((self->newState == Index ? (Run<Index, States>(self, pEventData), true) : false) || ...);
+    }
+
+    template <std::size_t... Index>
+    static void Exit(SM_StateMachine* self, std::index_sequence<Index...>)
+    {
+        ((self->currentState == Index ? (States::Exit(self), true) : false) || ...);
+    }
+
+    template <std::size_t Index, typename S>
+    static void Run(SM_StateMachine* self, void* pEventData)
+    {
+        if constexpr (S::hasGuard)
+        {
+            if (S::Guard(self, pEventData) != TRUE)
+                return;
+        }
+
+        if constexpr (hasExit || S::hasEntry)
+        {
+            // Transitioning to a new state?
+            if (self->currentState != Index)
+            {
+                if constexpr (hasExit)
+                    Exit(self, std::index_sequence_for<States...>{});
+                S::Entry(self, pEventData);
+
+                // Ensure exit/entry actions didn't call SM_InternalEvent by accident
+                ASSERT_TRUE(self->eventGenerated == FALSE);
+            }
+        }
+
+        self->currentState = static_cast<BYTE>(Index);
+        S::Execute(self, pEventData);
+    }
+};
+
+// Generates an external event. Transitions lists the new state for each
+// current state, in state enumeration order. In USE_SM_LOCK builds the
+// SM_Event() family holds the instance's lock around the call.
+template <typename Map, BYTE... Transitions>
+inline void Event(SM_StateMachine* self, void* pEventData)
+{
+    static_assert(sizeof...(Transitions) == Map::maxStates, "One transition per state required");
+    static constexpr BYTE TRANSITIONS[] = { Transitions... };
+
+    // Let a batch or transition probe record the event, and the engine
+    // hooks see it
+    if (engineHooks || self == _SM_BatchMachine)
+    {
+        _SM_ExternalEvent(self, Map::Const(), TRANSITIONS[self->currentState], pEventData);
+        return;
+    }
+
+    BYTE newState = TRANSITIONS[self->currentState];
+    if (newState == EVENT_IGNORED)
+    {
+        if (pEventData)
+            _SM_FreeEventData(self, pEventData);
+        return;
+    }
+
+    self->pEventData = pEventData;
+    self->eventGenerated = TRUE;
+    self->newState = newState;
+    Map::Engine(self);
+}
+
+} // namespace sm
+
+#endif // _STATE_MACHINE_HPP
@@ -0,0 +1,87 @@
+#include "Thread.h"
+#include "Fault.h"
+#include <thread>
+#include <chrono>
+#include <vector>
+
+// A thread is a std::thread
+#define THREAD std::thread
+
+// Exit functions of a thread (see TH_AtExit)
+struct ThreadExit
+{
+    struct Entry
+    {
+        TH_ThreadFunc func;
+        void* arg;
+    };
+    std::vector<Entry> entries;
+
+    ~ThreadExit()
+    {
+        while (!entries.empty())
+        {
+            Entry entry = entries.back();
+            entries.pop_back();
+            entry.func(entry.arg);
+        }
+    }
+};
+
+static thread_local ThreadExit _threadExit;
+
+//------------------------------------------------------------------------------
+// TH_Create
+//------------------------------------------------------------------------------
+THREAD_HANDLE TH_Create(TH_ThreadFunc func, void* arg)
+{
+    ASSERT_TRUE(func);
+    THREAD* thread = new THREAD(func, arg);
+    return thread;
+}
+
+//------------------------------------------------------------------------------
+// TH_Join
+//------------------------------------------------------------------------------
+void TH_Join(THREAD_HANDLE hThread)
+{
+    ASSERT_TRUE(hThread);
+    THREAD* thread = (THREAD*)(hThread);
+    thread->join();
+    delete thread;
+}
+
+//------------------------------------------------------------------------------
+// TH_Yield
+//------------------------------------------------------------------------------
+void TH_Yield(void)
+{
+    std::this_thread::yield();
+}
+
+//------------------------------------------------------------------------------
+// TH_Sleep
+//------------------------------------------------------------------------------
+void TH_Sleep(UINT32 ms)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+//------------------------------------------------------------------------------
+// TH_GetTimeNs
+//------------------------------------------------------------------------------
+UINT64 TH_GetTimeNs(void)
+{
+    // Monotonic time in nanoseconds from an arbitrary epoch
+    return (UINT64)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//------------------------------------------------------------------------------
+// TH_AtExit
+//------------------------------------------------------------------------------
+void TH_AtExit(TH_ThreadFunc func, void* arg)
+{
+    ASSERT_TRUE(func);
+    _threadExit.entries.push_back({ func, arg });
+}
@@ -0,0 +1,39 @@
+#ifndef _THREAD_H
+#define _THREAD_H
+
+#include "DataTypes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void* THREAD_HANDLE;
+
+// Declare a variable with one instance per thread
+#if defined(_MSC_VER)
+    #define TH_THREAD_LOCAL __declspec(thread)
+#else
+    #define TH_THREAD_LOCAL __thread
+#endif
+
+// Thread entry function signature
+typedef void (*TH_ThreadFunc)(void* arg);
+
+#define TH_CREATE(f, a) TH_Create(f, a)
+#define TH_JOIN(h)      TH_Join(h)
+
+THREAD_HANDLE TH_Create(TH_ThreadFunc func, void* arg);
+void TH_Join(THREAD_HANDLE hThread);
+void TH_Yield(void);
+void TH_Sleep(UINT32 ms);
+UINT64 TH_GetTimeNs(void);
+
+// Calls func(arg) when the calling thread exits, after its thread function
+// returns. Functions run in reverse order of registration.
+void TH_AtExit(TH_ThreadFunc func, void* arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif 
@@ -0,0 +1,391 @@
+#include "Timer.h"
+#include "ActiveObject.h"
+#include "LockGuard.h"
+#include "Semaphore.h"
+#include "Thread.h"
+#include "Atomic.h"
+#include "Fault.h"
+
+// Timing wheel geometry. Level 0 holds timers expiring within the current
+// 256 tick window, each higher level covers 256 times the range of the
+// level below it.
+#define TMR_LEVELS          4
+#define TMR_LEVEL_BITS      8
+#define TMR_SLOTS           (1 << TMR_LEVEL_BITS)
+#define TMR_SLOT_MASK       (TMR_SLOTS - 1)
+
+// Expired timers posted per pass of the timer thread
+#define TMR_EXPIRED_MAX     64
+
+// Longest timeout in ticks. Keeps every expiry within half a rotation of
+// the top level.
+#define TMR_MAX_TICKS       0x7FFFFFFF
+
+// A timer event to post once the lock is released
+typedef struct
+{
+    SM_StateMachine* machine;
+    SM_EventFunc eventFunc;
+} TMR_Expired;
+
+// Each slot is a circular list headed by a sentinel, so an armed timer
+// always has a non-NULL next pointer
+static SM_Timer _wheel[TMR_LEVELS][TMR_SLOTS];
+
+// Current wheel tick. Written by the timer thread with _hLock held.
+static UINT64 _now;
+static UINT64 _startNs;
+static UINT32 _count;
+
+static LOCK_HANDLE _hLock;
+static SEMAPHORE_HANDLE _hSem;
+static THREAD_HANDLE _hThread;
+static ATOMIC32 _exit;
+static ATOMIC32 _mute;
+static ATOMIC64 _failed;
+
+static void TMR_Insert(SM_Timer* timer);
+static void TMR_Remove(SM_Timer* timer);
+static void TMR_Cascade(UINT16 level);
+static void TMR_Tick(void);
+static UINT32 TMR_Expire(TMR_Expired* expired, UINT32 maxExpired);
+static UINT64 TMR_GetTicks(void);
+static void TMR_TimerThread(void* arg);
+
+//----------------------------------------------------------------------------
+// TMR_Insert
+//----------------------------------------------------------------------------
+static void TMR_Insert(SM_Timer* timer)
+{
+    SM_Timer* head = NULL;
+    UINT16 level = 0;
+    UINT16 shift = TMR_LEVEL_BITS;
+
+    // The lowest level whose window contains the expiry tick. A timer is
+    // cascaded down a level when the current tick enters its slot.
+    while (level < TMR_LEVELS - 1 && (timer->expires >> shift) != (_now >> shift))
+    {
+        level++;
+        shift += TMR_LEVEL_BITS;
+    }
+    head = &_wheel[level][(timer->expires >> (shift - TMR_LEVEL_BITS)) & TMR_SLOT_MASK];
+
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+//----------------------------------------------------------------------------
+// TMR_Remove
+//----------------------------------------------------------------------------
+static void TMR_Remove(SM_Timer* timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+//----------------------------------------------------------------------------
+// TMR_Cascade
+//----------------------------------------------------------------------------
+static void TMR_Cascade(UINT16 level)
+{
+    SM_Timer* head = &_wheel[level][(_now >> (level * TMR_LEVEL_BITS)) & TMR_SLOT_MASK];
+    SM_Timer* timer = NULL;
+
+    // Redistribute the slot's timers onto the lower levels
+    while (head->next != head)
+    {
+        timer = head->next;
+        TMR_Remove(timer);
+        TMR_Insert(timer);
+    }
+}
+
+//----------------------------------------------------------------------------
+// TMR_Tick
+//----------------------------------------------------------------------------
+static void TMR_Tick(void)
+{
+    UINT16 level;
+
+    _now++;
+
+    // Entering a new window of a higher level?
+    for (level = 1; level < TMR_LEVELS; level++)
+    {
+        if ((_now & (((UINT64)1 << (level * TMR_LEVEL_BITS)) - 1)) != 0)
+            break;
+    }
+    while (--level > 0)
+        TMR_Cascade(level);
+}
+
+//----------------------------------------------------------------------------
+// TMR_Expire
+//----------------------------------------------------------------------------
+static UINT32 TMR_Expire(TMR_Expired* expired, UINT32 maxExpired)
+{
+    SM_Timer* head = &_wheel[0][_now & TMR_SLOT_MASK];
+    SM_Timer* timer = NULL;
+    UINT32 count = 0;
+
+    // Expire the timers in the current level 0 slot, up to maxExpired. A 
+    // timer armed meanwhile expires after the current tick, so the slot only
+    // holds timers due now.
+    while (count < maxExpired && head->next != head)
+    {
+        timer = head->next;
+        TMR_Remove(timer);
+
+        if (timer->periodTicks)
+        {
+            timer->expires = _now + timer->periodTicks;
+            TMR_Insert(timer);
+        }
+        else
+        {
+            _count--;
+        }
+
+        expired[count].machine = timer->machine;
+        expired[count].eventFunc = timer->eventFunc;
+        count++;
+    }
+    return count;
+}
+
+//----------------------------------------------------------------------------
+// TMR_GetTicks
+//----------------------------------------------------------------------------
+static UINT64 TMR_GetTicks(void)
+{
+    return (TH_GetTimeNs() - _startNs) / ((UINT64)TMR_TICK_MS * 1000000);
+}
+
+//----------------------------------------------------------------------------
+// TMR_TimerThread
+//----------------------------------------------------------------------------
+static void TMR_TimerThread(void* arg)
+{
+    TMR_Expired expired[TMR_EXPIRED_MAX];
+    UINT64 ticks;
+    UINT32 count, expiredCount, i;
+
+    (void)arg;
+
+    while (!ATOMIC_Load32(&_exit))
+    {
+        ticks = TMR_GetTicks();
+        expiredCount = 0;
+
+        LK_LOCK(_hLock);
+        if (_count == 0)
+        {
+            // Nothing armed, jump straight to the current tick
+            _now = ticks;
+        }
+        else
+        {
+            // Leftovers of the current tick first, then advance
+            expiredCount = TMR_Expire(expired, TMR_EXPIRED_MAX);
+            while (expiredCount < TMR_EXPIRED_MAX && _now < ticks)
+            {
+                TMR_Tick();
+                expiredCount += TMR_Expire(&expired[expiredCount], TMR_EXPIRED_MAX - expiredCount);
+            }
+        }
+        count = _count;
+        LK_UNLOCK(_hLock);
+
+        // Post without the lock. A post to a full SM_OVERFLOW_BLOCK mailbox
+        // waits for its consumer, which may be arming or stopping a timer.
+        // A post to a full mailbox of any other policy fails and is counted.
+        for (i = 0; i < expiredCount; i++)
+        {
+            if (!ATOMIC_Load32(&_mute) && !_SM_TryPost(expired[i].machine, expired[i].eventFunc))
+                ATOMIC_FetchAdd64(&_failed, 1);
+        }
+
+        // More timers may have expired meanwhile
+        if (expiredCount == TMR_EXPIRED_MAX)
+            continue;
+
+        // Sleep one tick while timers are armed, otherwise until one is
+        SEM_WAIT(_hSem, count ? TMR_TICK_MS : SEM_WAIT_INFINITE);
+    }
+}
+
+//----------------------------------------------------------------------------
+// TMR_Init
+//----------------------------------------------------------------------------
+void TMR_Init(void)
+{
+    UINT16 level, slot;
+
+    ASSERT_TRUE(_hThread == NULL);
+
+    for (level=0; level<TMR_LEVELS; level++)
+    {
+        for (slot=0; slot<TMR_SLOTS; slot++)
+        {
+            _wheel[level][slot].next = &_wheel[level][slot];
+            _wheel[level][slot].prev = &_wheel[level][slot];
+        }
+    }
+
+    _startNs = TH_GetTimeNs();
+    _now = 0;
+    _count = 0;
+    ATOMIC_Store32(&_exit, FALSE);
+
+    _hLock = LK_CREATE();
+    _hSem = SEM_CREATE();
+    _hThread = TH_CREATE(TMR_TimerThread, NULL);
+}
+
+//----------------------------------------------------------------------------
+// TMR_Term
+//----------------------------------------------------------------------------
+void TMR_Term(void)
+{
+    UINT16 level, slot;
+
+    ASSERT_TRUE(_hThread);
+
+    ATOMIC_Store32(&_exit, TRUE);
+    SEM_SIGNAL(_hSem);
+    TH_JOIN(_hThread);
+
+    // Disarm any timer still in the wheel
+    for (level=0; level<TMR_LEVELS; level++)
+    {
+        for (slot=0; slot<TMR_SLOTS; slot++)
+        {
+            while (_wheel[level][slot].next != &_wheel[level][slot])
+                TMR_Remove(_wheel[level][slot].next);
+        }
+    }
+    _count = 0;
+
+    SEM_DESTROY(_hSem);
+    LK_DESTROY(_hLock);
+    _hThread = NULL;
+    _hSem = NULL;
+    _hLock = NULL;
+}
+
+//----------------------------------------------------------------------------
+// TMR_Start
+//----------------------------------------------------------------------------
+void TMR_Start(SM_Timer* timer, SM_StateMachine* machine, SM_EventFunc eventFunc, UINT32 timeoutMs, UINT32 periodMs)
+{
+    UINT32 timeoutTicks = (UINT32)(((UINT64)timeoutMs + TMR_TICK_MS - 1) / TMR_TICK_MS);
+    UINT32 periodTicks = (UINT32)(((UINT64)periodMs + TMR_TICK_MS - 1) / TMR_TICK_MS);
+    BOOL wake = FALSE;
+
+    ASSERT_TRUE(timer);
+    ASSERT_TRUE(machine);
+    ASSERT_TRUE(eventFunc);
+    ASSERT_TRUE(_hLock);
+
+    // Expiries are posted to the instance's mailbox. An instance called 
+    // synchronously, or a fleet instance, has none.
+    ASSERT_TRUE(machine->pMailbox);
+
+    // Expire no earlier than the next tick
+    if (timeoutTicks == 0)
+        timeoutTicks = 1;
+    if (timeoutTicks > TMR_MAX_TICKS)
+        timeoutTicks = TMR_MAX_TICKS;
+    if (periodTicks > TMR_MAX_TICKS)
+        periodTicks = TMR_MAX_TICKS;
+
+    LK_LOCK(_hLock);
+
+    // Arming an armed timer restarts it
+    if (timer->next)
+        TMR_Remove(timer);
+    else
+        wake = (_count++ == 0);
+
+    // An idle timer thread has not advanced the wheel since it went to sleep
+    if (wake)
+        _now = TMR_GetTicks();
+
+    timer->machine = machine;
+    timer->eventFunc = eventFunc;
+    timer->periodTicks = periodTicks;
+    timer->expires = _now + timeoutTicks;
+    TMR_Insert(timer);
+
+    LK_UNLOCK(_hLock);
+
+    // Timer thread sleeps until the first timer is armed
+    if (wake)
+        SEM_SIGNAL(_hSem);
+}
+
+//----------------------------------------------------------------------------
+// TMR_Stop
+//----------------------------------------------------------------------------
+void TMR_Stop(SM_Timer* timer)
+{
+    ASSERT_TRUE(timer);
+    ASSERT_TRUE(_hLock);
+
+    LK_LOCK(_hLock);
+    if (timer->next)
+    {
+        TMR_Remove(timer);
+        _count--;
+    }
+    LK_UNLOCK(_hLock);
+}
+
+//----------------------------------------------------------------------------
+// TMR_IsActive
+//----------------------------------------------------------------------------
+BOOL TMR_IsActive(const SM_Timer* timer)
+{
+    BOOL active;
+
+    ASSERT_TRUE(timer);
+    ASSERT_TRUE(_hLock);
+
+    LK_LOCK(_hLock);
+    active = (timer->next != NULL);
+    LK_UNLOCK(_hLock);
+    return active;
+}
+
+//----------------------------------------------------------------------------
+// TMR_GetFailed
+//----------------------------------------------------------------------------
+UINT64 TMR_GetFailed(void)
+{
+    return (UINT64)ATOMIC_Load64(&_failed);
+}
+
+//----------------------------------------------------------------------------
+// TMR_Mute
+//----------------------------------------------------------------------------
+void TMR_Mute(BOOL mute)
+{
+    ATOMIC_Store32(&_mute, mute);
+}
+
+//----------------------------------------------------------------------------
+// TMR_GetCount
+//----------------------------------------------------------------------------
+UINT32 TMR_GetCount(void)
+{
+    UINT32 count;
+
+    LK_LOCK(_hLock);
+    count = _count;
+    LK_UNLOCK(_hLock);
+    return count;
+}
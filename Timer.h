@@ -0,0 +1,86 @@
+// The Timer module delivers timeout and periodic poll events to state
+// machine instances. Timers live in a hierarchical timing wheel serviced by
+// a single thread, so arming and cancelling a timer is O(1) regardless of
+// the number of armed timers.
+//
+// A timer is an SM_Timer object embedded in the instance data; the timer
+// module never allocates. On expiry the timer event is posted to the
+// instance's mailbox, so the instance must be an active object or attached to
+// a Scheduler (see ActiveObject.h); TMR_Start() asserts otherwise. Arm a
+// timer from an entry action or state function and stop it from the exit
+// action. An expiry posted just before the timer is stopped may still be
+// delivered, so the timer event must be ignored or harmless in the following
+// states. Once SM_ActiveStop() or SM_SchedulerDetach() returns, no expiry is
+// posted to the instance; an expiry of a timer left armed is dropped.
+// Expiries are posted outside the timer lock, so a post waiting on a full
+// SM_OVERFLOW_BLOCK mailbox never holds up a consumer arming or stopping a
+// timer. An expiry the mailbox rejects is lost and counted by
+// TMR_GetFailed(); even a full SM_OVERFLOW_FAULT mailbox does not fault the
+// timer thread.
+//
+// #include "Timer.h"
+// typedef struct { SM_Timer pollTimer; } Centrifuge;
+//
+// STATE_DEFINE(Acceleration, NoEventData)
+// {
+//      Centrifuge* pInstance = SM_GetInstance(Centrifuge);
+//      SM_TimerPeriodic(&pInstance->pollTimer, CFG_Poll, 10);
+// }
+//
+// void main()
+// {
+//      TMR_Init();
+//      ...
+//      TMR_Term();
+// }
+
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include "DataTypes.h"
+#include "StateMachine.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Timing wheel resolution in milliseconds
+#define TMR_TICK_MS     1
+
+// Timer storage. Zero initialize before first use.
+typedef struct SM_Timer
+{
+    struct SM_Timer* next;      // Timing wheel slot list, NULL when not armed
+    struct SM_Timer* prev;
+    UINT64 expires;             // Expiry tick
+    UINT32 periodTicks;         // Period of a periodic timer, otherwise 0
+    SM_StateMachine* machine;
+    SM_EventFunc eventFunc;
+} SM_Timer;
+
+// Arm a one-shot or periodic timer for the current instance (self). Arming
+// an armed timer restarts it.
+#define SM_TimerStart(_timer_, _eventFunc_, _timeoutMs_) \
+    TMR_Start(_timer_, self, (SM_EventFunc)_eventFunc_, _timeoutMs_, 0)
+#define SM_TimerPeriodic(_timer_, _eventFunc_, _periodMs_) \
+    TMR_Start(_timer_, self, (SM_EventFunc)_eventFunc_, _periodMs_, _periodMs_)
+#define SM_TimerStop(_timer_) \
+    TMR_Stop(_timer_)
+
+void TMR_Init(void);
+void TMR_Term(void);
+void TMR_Start(SM_Timer* timer, SM_StateMachine* machine, SM_EventFunc eventFunc, UINT32 timeoutMs, UINT32 periodMs);
+void TMR_Stop(SM_Timer* timer);
+BOOL TMR_IsActive(const SM_Timer* timer);
+UINT32 TMR_GetCount(void);
+UINT64 TMR_GetFailed(void);
+
+// While muted, timers run but expired timers post no event. Used to replay
+// a recording that already holds the timer events (see Recorder.h).
+void TMR_Mute(BOOL mute);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _TIMER_H
@@ -0,0 +1,185 @@
+#include "Trace.h"
+#include "Thread.h"
+#include "Atomic.h"
+#include "Fault.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct TRC_Ring
+{
+    struct TRC_Ring* next;
+    UINT32 thread;
+    ATOMIC64 head;                  // Records written, only the owner writes
+    TRC_Record records[TRC_RING_SIZE];
+} TRC_Ring;
+
+// All rings ever created. Rings outlive their threads so a dump still
+// shows what an exited thread did.
+static ATOMIC_PTR _rings;
+static ATOMIC32 _ringCount;
+
+// The ring of the calling thread, created by its first record
+static TH_THREAD_LOCAL TRC_Ring* _ring;
+
+static TRC_Ring* TRC_CreateRing(void);
+static UINT32 TRC_GetRecords(TRC_Ring* ring, UINT64* first);
+
+//----------------------------------------------------------------------------
+// TRC_CreateRing
+//----------------------------------------------------------------------------
+static TRC_Ring* TRC_CreateRing(void)
+{
+    TRC_Ring* ring = (TRC_Ring*)calloc(1, sizeof(TRC_Ring));
+    TRC_Ring* head = NULL;
+
+    C_ASSERT((TRC_RING_SIZE & (TRC_RING_SIZE - 1)) == 0);
+    ASSERT_TRUE(ring);
+
+    ring->thread = ATOMIC_FetchAdd32(&_ringCount, 1);
+
+    // Push onto the ring list
+    do
+    {
+        head = (TRC_Ring*)ATOMIC_LoadPtr(&_rings);
+        ring->next = head;
+    } while (!ATOMIC_CompareExchangePtr(&_rings, head, ring));
+
+    _ring = ring;
+    return ring;
+}
+
+//----------------------------------------------------------------------------
+// TRC_GetRecords
+//----------------------------------------------------------------------------
+static UINT32 TRC_GetRecords(TRC_Ring* ring, UINT64* first)
+{
+    UINT64 head = (UINT64)ATOMIC_Load64(&ring->head);
+    UINT32 count = head < TRC_RING_SIZE ? (UINT32)head : TRC_RING_SIZE;
+
+    // Oldest record still in the ring
+    *first = head - count;
+    return count;
+}
+
+//----------------------------------------------------------------------------
+// _TRC_Record
+//----------------------------------------------------------------------------
+void _TRC_Record(SM_StateMachine* machine, BYTE oldState, BYTE newState, BYTE eventId, BYTE guard)
+{
+    TRC_Ring* ring = _ring;
+    TRC_Record* record = NULL;
+    INT64 head;
+
+    if (ring == NULL)
+        ring = TRC_CreateRing();
+
+    head = ring->head;
+    record = &ring->records[head & (TRC_RING_SIZE - 1)];
+    record->timestamp = TH_GetTimeNs();
+    record->machine = (UINT64)(size_t)machine;
+    record->name = (UINT64)(size_t)machine->name;
+    record->oldState = oldState;
+    record->newState = newState;
+    record->eventId = eventId;
+    record->guard = guard;
+    record->thread = ring->thread;
+
+    // Publish the record to TRC_Dump()
+    ATOMIC_Store64(&ring->head, head + 1);
+}
+
+//----------------------------------------------------------------------------
+// TRC_GetThreadCount
+//----------------------------------------------------------------------------
+UINT32 TRC_GetThreadCount(void)
+{
+    return ATOMIC_Load32(&_ringCount);
+}
+
+//----------------------------------------------------------------------------
+// TRC_Dump
+//----------------------------------------------------------------------------
+BOOL TRC_Dump(FILE* fp)
+{
+    TRC_FileHeader header;
+    TRC_FileName* names = NULL;
+    TRC_Ring* ring = NULL;
+    UINT32 nameCapacity = 0;
+    UINT32 count, i, n;
+    UINT64 first;
+    BOOL success = TRUE;
+
+    ASSERT_TRUE(fp);
+
+    memset(&header, 0, sizeof(header));
+    header.magic = TRC_FILE_MAGIC;
+    header.version = TRC_FILE_VERSION;
+    header.recordSize = sizeof(TRC_Record);
+
+    // Collect the distinct instance names. The name strings are static,
+    // unlike the instances themselves.
+    for (ring = (TRC_Ring*)ATOMIC_LoadPtr(&_rings); ring; ring = ring->next)
+    {
+        count = TRC_GetRecords(ring, &first);
+        header.recordCount += count;
+
+        for (i=0; i<count; i++)
+        {
+            const TRC_Record* record = &ring->records[(first + i) & (TRC_RING_SIZE - 1)];
+
+            for (n=0; n<header.nameCount; n++)
+            {
+                if (names[n].name == record->name)
+                    break;
+            }
+            if (n < header.nameCount || record->name == 0)
+                continue;
+
+            if (header.nameCount == nameCapacity)
+            {
+                nameCapacity = nameCapacity ? nameCapacity * 2 : 16;
+                names = (TRC_FileName*)realloc(names, nameCapacity * sizeof(TRC_FileName));
+                ASSERT_TRUE(names);
+            }
+            memset(&names[n], 0, sizeof(TRC_FileName));
+            names[n].name = record->name;
+            strncpy(names[n].text, (const CHAR*)(size_t)record->name, TRC_NAME_SIZE - 1);
+            header.nameCount++;
+        }
+    }
+
+    if (fwrite(&header, sizeof(header), 1, fp) != 1)
+        success = FALSE;
+    if (success && header.nameCount && fwrite(names, sizeof(TRC_FileName), header.nameCount, fp) != header.nameCount)
+        success = FALSE;
+
+    // Write each ring oldest record first. The record count in the header
+    // is not exceeded if a ring advanced since it was counted.
+    n = header.recordCount;
+    for (ring = (TRC_Ring*)ATOMIC_LoadPtr(&_rings); success && ring && n; ring = ring->next)
+    {
+        count = TRC_GetRecords(ring, &first);
+        for (i=0; i<count && n; i++, n--)
+        {
+            if (fwrite(&ring->records[(first + i) & (TRC_RING_SIZE - 1)], sizeof(TRC_Record), 1, fp) != 1)
+            {
+                success = FALSE;
+                break;
+            }
+        }
+    }
+
+    // Pad a short dump so the file matches its header
+    while (success && n)
+    {
+        TRC_Record empty;
+        memset(&empty, 0, sizeof(empty));
+        empty.eventId = TRC_EVENT_NONE;
+        if (fwrite(&empty, sizeof(TRC_Record), 1, fp) != 1)
+            success = FALSE;
+        n--;
+    }
+
+    free(names);
+    return success;
+}
@@ -0,0 +1,109 @@
+// The Trace module is a flight recorder for the state engines. When
+// StateMachine.c is compiled with USE_SM_TRACE defined, _SM_StateEngine and
+// _SM_StateEngineEx write one fixed size binary record per transition into
+// a ring buffer owned by the executing thread. Writing a record takes no
+// lock and performs no atomic read-modify-write, so tracing can stay
+// enabled in production. Each ring keeps the last TRC_RING_SIZE records.
+//
+// TRC_Dump() writes every thread's ring to a file. The tools/trace_decode
+// program merges the rings into one timeline. Records written while
+// TRC_Dump() runs may be torn; stop the state machines for an exact dump.
+//
+// #include "Trace.h"
+// FILE* fp = fopen("sm.trace", "wb");
+// TRC_Dump(fp);
+// fclose(fp);
+//
+// $ trace_decode sm.trace
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include "DataTypes.h"
+#include "StateMachine.h"
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Records per thread ring. Must be a power of 2.
+#ifndef TRC_RING_SIZE
+#define TRC_RING_SIZE       4096
+#endif
+
+// Event IDs of records not caused by a transition matrix event
+enum { TRC_EVENT_INTERNAL = 0xFE, TRC_EVENT_NONE = 0xFF };
+
+// Guard outcome of a record
+typedef enum
+{
+    TRC_GUARD_NONE,     // Target state has no guard
+    TRC_GUARD_PASS,
+    TRC_GUARD_FAIL      // Transition rejected, state unchanged
+} TRC_Guard;
+
+// One transition. 32 bytes.
+typedef struct
+{
+    UINT64 timestamp;       // TH_GetTimeNs()
+    UINT64 machine;         // SM_StateMachine address
+    UINT64 name;            // SM_StateMachine name address, see TRC_FileName
+    BYTE oldState;
+    BYTE newState;
+    BYTE eventId;           // Transition matrix event ID, TRC_EVENT_INTERNAL or TRC_EVENT_NONE
+    BYTE guard;             // TRC_Guard
+    UINT32 thread;          // Ring number of the recording thread
+} TRC_Record;
+
+// Dump file layout: a TRC_FileHeader, nameCount TRC_FileName entries, then
+// recordCount TRC_Record entries in ring order. Native byte order.
+#define TRC_FILE_MAGIC      0x52544D53  // "SMTR"
+#define TRC_FILE_VERSION    1
+#define TRC_NAME_SIZE       24
+
+typedef struct
+{
+    UINT32 magic;
+    UINT32 version;
+    UINT32 recordSize;
+    UINT32 nameCount;
+    UINT32 recordCount;
+    UINT32 reserved;
+} TRC_FileHeader;
+
+typedef struct
+{
+    UINT64 name;                    // TRC_Record::name
+    CHAR text[TRC_NAME_SIZE];       // Instance name, truncated
+} TRC_FileName;
+
+// State engine hooks. TRC_ENGINE_BEGIN declares the hook variables and must
+// follow the engine's own declarations. It runs before the engine's asserts,
+// so it asserts _self_ itself.
+#ifdef USE_SM_TRACE
+    #define TRC_ENGINE_BEGIN(_self_) \
+        BYTE _trcEvent = (BYTE)(!(_self_) ? (FaultHandler(__FILE__, (unsigned short)__LINE__), TRC_EVENT_NONE) : \
+            (_self_)->eventId ? (_self_)->eventId - 1 : TRC_EVENT_NONE);
+    #define TRC_TRANSITION(_self_, _guard_) \
+        (_TRC_Record(_self_, (_self_)->currentState, (_self_)->newState, _trcEvent, (BYTE)(_guard_)), \
+        _trcEvent = TRC_EVENT_INTERNAL)
+    #define TRC_ENGINE_END(_self_)      ((_self_)->eventId = 0)
+#else
+    #define TRC_ENGINE_BEGIN(_self_)
+    #define TRC_TRANSITION(_self_, _guard_) ((void)0)
+    #define TRC_ENGINE_END(_self_)      ((void)0)
+#endif
+
+// Public functions
+BOOL TRC_Dump(FILE* fp);
+UINT32 TRC_GetThreadCount(void);
+
+// Private functions
+void _TRC_Record(SM_StateMachine* machine, BYTE oldState, BYTE newState, BYTE eventId, BYTE guard);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _TRACE_H
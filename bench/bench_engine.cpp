@@ -0,0 +1,160 @@
+// Compares the C state engine (_SM_StateEngineEx) against the C++17 
+// StateMachine.hpp front-end on the same extended state machine.
+//
+// make -C bench bench_engine
+
+#include "StateMachine.hpp"
+#include "Thread.h"
+#include "fb_allocator.h"
+#include <stdio.h>
+
+#define BENCH_EVENTS    10000000
+#define BENCH_RUNS      5
+
+typedef struct
+{
+    UINT32 count;
+    UINT32 transitions;
+} Bench;
+
+static Bench benchCObj;
+static Bench benchCppObj;
+SM_DEFINE(BenchC, &benchCObj)
+SM_DEFINE(BenchCpp, &benchCppObj)
+
+enum States
+{
+    ST_ALPHA,
+    ST_BETA,
+    ST_GAMMA,
+    ST_DELTA,
+    ST_MAX_STATES
+};
+
+STATE_DECLARE(Alpha, NoEventData)
+STATE_DECLARE(Beta, NoEventData)
+ENTRY_DECLARE(Beta, NoEventData)
+STATE_DECLARE(Gamma, NoEventData)
+EXIT_DECLARE(Gamma)
+STATE_DECLARE(Delta, NoEventData)
+GUARD_DECLARE(Delta, NoEventData)
+
+BEGIN_STATE_MAP_EX(Bench)
+    STATE_MAP_ENTRY_EX(ST_Alpha)
+    STATE_MAP_ENTRY_ALL_EX(ST_Beta, 0, EN_Beta, 0)
+    STATE_MAP_ENTRY_ALL_EX(ST_Gamma, 0, 0, EX_Gamma)
+    STATE_MAP_ENTRY_ALL_EX(ST_Delta, GD_Delta, 0, 0)
+END_STATE_MAP_EX(Bench)
+
+using BenchMap = sm::StateMap<
+    sm::State<ST_Alpha>,
+    sm::State<ST_Beta, nullptr, EN_Beta>,
+    sm::State<ST_Gamma, nullptr, nullptr, EX_Gamma>,
+    sm::State<ST_Delta, GD_Delta>>;
+
+// C macro event
+EVENT_DEFINE(BCH_Next, NoEventData)
+{
+    BEGIN_TRANSITION_MAP                    // - Current State -
+        TRANSITION_MAP_ENTRY(ST_BETA)       // ST_Alpha
+        TRANSITION_MAP_ENTRY(ST_GAMMA)      // ST_Beta
+        TRANSITION_MAP_ENTRY(ST_DELTA)      // ST_Gamma
+        TRANSITION_MAP_ENTRY(ST_ALPHA)      // ST_Delta
+    END_TRANSITION_MAP(Bench, pEventData)
+}
+
+// C++ front-end event
+EVENT_DEFINE(BCH_NextFast, NoEventData)
+{
+    sm::Event<BenchMap,
+        ST_BETA,        // ST_Alpha
+        ST_GAMMA,       // ST_Beta
+        ST_DELTA,       // ST_Gamma
+        ST_ALPHA>       // ST_Delta
+        (self, pEventData);
+}
+
+STATE_DEFINE(Alpha, NoEventData)
+{
+    Bench* pInstance = SM_GetInstance(Bench);
+    pInstance->count++;
+}
+
+STATE_DEFINE(Beta, NoEventData)
+{
+    Bench* pInstance = SM_GetInstance(Bench);
+    pInstance->count++;
+}
+
+ENTRY_DEFINE(Beta, NoEventData)
+{
+    Bench* pInstance = SM_GetInstance(Bench);
+    pInstance->transitions++;
+}
+
+STATE_DEFINE(Gamma, NoEventData)
+{
+    Bench* pInstance = SM_GetInstance(Bench);
+    pInstance->count++;
+}
+
+EXIT_DEFINE(Gamma)
+{
+    Bench* pInstance = SM_GetInstance(Bench);
+    pInstance->transitions++;
+}
+
+STATE_DEFINE(Delta, NoEventData)
+{
+    Bench* pInstance = SM_GetInstance(Bench);
+    pInstance->count++;
+}
+
+GUARD_DEFINE(Delta, NoEventData)
+{
+    Bench* pInstance = SM_GetInstance(Bench);
+    return (pInstance->count & 1) == 1;
+}
+
+//----------------------------------------------------------------------------
+// Run
+//----------------------------------------------------------------------------
+static double Run(SM_StateMachine* sm, SM_EventFunc eventFunc)
+{
+    double best = 0;
+
+    // Best of several runs to filter out scheduling noise
+    for (int run = 0; run < BENCH_RUNS; run++)
+    {
+        UINT64 start = TH_GetTimeNs();
+        for (UINT32 i = 0; i < BENCH_EVENTS; i++)
+            eventFunc(sm, NULL);
+        double ns = (double)(TH_GetTimeNs() - start) / BENCH_EVENTS;
+        if (run == 0 || ns < best)
+            best = ns;
+    }
+    return best;
+}
+
+//----------------------------------------------------------------------------
+// main
+//----------------------------------------------------------------------------
+int main(void)
+{
+    ALLOC_Init();
+
+    double nsC = Run(&BenchCObj, (SM_EventFunc)BCH_Next);
+    double nsCpp = Run(&BenchCppObj, (SM_EventFunc)BCH_NextFast);
+
+    // Both engines must reach the same result
+    ASSERT_TRUE(benchCObj.count == benchCppObj.count);
+    ASSERT_TRUE(benchCObj.transitions == benchCppObj.transitions);
+    ASSERT_TRUE(BenchCObj.currentState == BenchCppObj.currentState);
+
+    printf("_SM_StateEngineEx   %6.2f ns/event\n", nsC);
+    printf("sm::StateMap        %6.2f ns/event\n", nsCpp);
+    printf("speedup             %6.2fx\n", nsC / nsCpp);
+
+    ALLOC_Term();
+    return 0;
+}
@@ -0,0 +1,549 @@
+// Microbenchmarks for the state engines and the allocators. Results are
+// written to stdout as one JSON document so runs can be compared across
+// versions.
+//
+// make -C bench bench_micro
+// bench/bench_micro [max threads] > results.json
+// bench/bench_micro stress      allocator stress checks only
+
+#include "StateMachine.h"
+#include "Thread.h"
+#include "Atomic.h"
+#include "fb_allocator.h"
+#include "x_allocator.h"
+#include "sm_allocator.h"
+#include "Fleet.h"
+#include "Snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_EVENTS        5000000
+#define BENCH_ALLOCS        2000000
+#define BENCH_RUNS          5
+
+// Contended fixed block allocator. Each thread holds at most
+// BENCH_HELD_BLOCKS blocks at once.
+#define BENCH_HELD_BLOCKS   8
+#define BENCH_MAX_THREADS   64
+ALLOC_DEFINE(benchAllocator, 64, BENCH_HELD_BLOCKS * BENCH_MAX_THREADS)
+
+// The same load spread over separate allocators, thread i using allocator
+// i % BENCH_SPLIT_ALLOCATORS
+#define BENCH_SPLIT_ALLOCATORS  4
+ALLOC_DEFINE(benchSplit0, 64, BENCH_HELD_BLOCKS * BENCH_MAX_THREADS)
+ALLOC_DEFINE(benchSplit1, 64, BENCH_HELD_BLOCKS * BENCH_MAX_THREADS)
+ALLOC_DEFINE(benchSplit2, 64, BENCH_HELD_BLOCKS * BENCH_MAX_THREADS)
+ALLOC_DEFINE(benchSplit3, 64, BENCH_HELD_BLOCKS * BENCH_MAX_THREADS)
+static ALLOC_HANDLE* const _splitAllocators[BENCH_SPLIT_ALLOCATORS] = 
+    { &benchSplit0, &benchSplit1, &benchSplit2, &benchSplit3 };
+
+// Free-list stress check: BENCH_STRESS_THREADS threads share one small pool,
+// so pops, pushes and pool carving race constantly. Each block has an owner
+// word set on allocation and cleared on free.
+#define BENCH_STRESS_THREADS    8
+#define BENCH_STRESS_BLOCKS     64
+#define BENCH_STRESS_HELD       16
+#define BENCH_STRESS_ROUNDS     200000
+ALLOC_DEFINE(benchStress, 64, BENCH_STRESS_BLOCKS)
+static ATOMIC32 _stressOwner[BENCH_STRESS_BLOCKS];
+
+// Per-thread cache limit check: idle threads that each used SMALLOC once
+// must leave the pool's blocks to other threads
+#define BENCH_IDLE_THREADS      32
+
+// x_allocator with and without the per-thread cache, one allocator each
+ALLOC_DEFINE(benchDirect, 64 + XALLOC_BLOCK_META_DATA_SIZE, 1024)
+ALLOC_DEFINE(benchCached, 64 + XALLOC_BLOCK_META_DATA_SIZE, 1024)
+static ALLOC_Allocator* _directAllocators[] = { &benchDirectObj };
+static ALLOC_Allocator* _cachedAllocators[] = { &benchCachedObj };
+static XAllocData _direct = { _directAllocators, 1, FALSE };
+static XAllocData _cached = { _cachedAllocators, 1, TRUE };
+
+typedef struct
+{
+    UINT32 count;
+} Bench;
+
+// Fleet checkpointed and restored by the snapshot benchmark
+#define BENCH_FLEET_SIZE    1000000
+#define BENCH_SNAPSHOT      "bench_snapshot.tmp"
+
+static Bench basicObj;
+static Bench exObj;
+static Bench chainObj;
+SM_DEFINE(BasicSM, &basicObj)
+SM_DEFINE(ExSM, &exObj)
+SM_DEFINE(ChainSM, &chainObj)
+SM_FLEET_DEFINE(BenchFleet, Bench, BENCH_FLEET_SIZE)
+
+static BOOL _first = TRUE;
+
+//----------------------------------------------------------------------------
+// Basic state machine: two states toggled by one event
+//----------------------------------------------------------------------------
+enum BasicStates { ST_B_ONE, ST_B_TWO, ST_B_MAX_STATES };
+
+STATE_DECLARE(BasicOne, NoEventData)
+STATE_DECLARE(BasicTwo, NoEventData)
+
+BEGIN_STATE_MAP(Basic)
+    STATE_MAP_ENTRY(ST_BasicOne)
+    STATE_MAP_ENTRY(ST_BasicTwo)
+END_STATE_MAP(Basic)
+
+EVENT_DEFINE(BasicToggle, NoEventData)
+{
+    BEGIN_TRANSITION_MAP                    // - Current State -
+        TRANSITION_MAP_ENTRY(ST_B_TWO)      // ST_B_ONE
+        TRANSITION_MAP_ENTRY(ST_B_ONE)      // ST_B_TWO
+    END_TRANSITION_MAP(Basic, pEventData)
+}
+
+STATE_DEFINE(BasicOne, NoEventData) { ((Bench*)self->pInstance)->count++; }
+STATE_DEFINE(BasicTwo, NoEventData) { ((Bench*)self->pInstance)->count++; }
+
+//----------------------------------------------------------------------------
+// Extended state machine: the same toggle with a guard, entry and exit
+//----------------------------------------------------------------------------
+enum ExStates { ST_E_ONE, ST_E_TWO, ST_E_MAX_STATES };
+
+STATE_DECLARE(ExOne, NoEventData)
+STATE_DECLARE(ExTwo, NoEventData)
+GUARD_DECLARE(ExTwo, NoEventData)
+ENTRY_DECLARE(ExTwo, NoEventData)
+EXIT_DECLARE(ExOne)
+
+BEGIN_STATE_MAP_EX(Ex)
+    STATE_MAP_ENTRY_ALL_EX(ST_ExOne, 0, 0, EX_ExOne)
+    STATE_MAP_ENTRY_ALL_EX(ST_ExTwo, GD_ExTwo, EN_ExTwo, 0)
+END_STATE_MAP_EX(Ex)
+
+EVENT_DEFINE(ExToggle, NoEventData)
+{
+    BEGIN_TRANSITION_MAP                    // - Current State -
+        TRANSITION_MAP_ENTRY(ST_E_TWO)      // ST_E_ONE
+        TRANSITION_MAP_ENTRY(ST_E_ONE)      // ST_E_TWO
+    END_TRANSITION_MAP(Ex, pEventData)
+}
+
+STATE_DEFINE(ExOne, NoEventData) { ((Bench*)self->pInstance)->count++; }
+STATE_DEFINE(ExTwo, NoEventData) { ((Bench*)self->pInstance)->count++; }
+GUARD_DEFINE(ExTwo, NoEventData) { return TRUE; }
+ENTRY_DEFINE(ExTwo, NoEventData) { ((Bench*)self->pInstance)->count++; }
+EXIT_DEFINE(ExOne) { ((Bench*)self->pInstance)->count++; }
+
+//----------------------------------------------------------------------------
+// Internal event chain: Start -> Completed -> Idle, as CentrifugeTest's
+// Completed state returning to Idle with SM_InternalEvent
+//----------------------------------------------------------------------------
+enum ChainStates { ST_C_IDLE, ST_C_START, ST_C_COMPLETED, ST_C_MAX_STATES };
+
+STATE_DECLARE(ChainIdle, NoEventData)
+ENTRY_DECLARE(ChainIdle, NoEventData)
+STATE_DECLARE(ChainStart, NoEventData)
+STATE_DECLARE(ChainCompleted, NoEventData)
+
+BEGIN_STATE_MAP_EX(Chain)
+    STATE_MAP_ENTRY_ALL_EX(ST_ChainIdle, 0, EN_ChainIdle, 0)
+    STATE_MAP_ENTRY_EX(ST_ChainStart)
+    STATE_MAP_ENTRY_EX(ST_ChainCompleted)
+END_STATE_MAP_EX(Chain)
+
+EVENT_DEFINE(ChainRun, NoEventData)
+{
+    BEGIN_TRANSITION_MAP                    // - Current State -
+        TRANSITION_MAP_ENTRY(ST_C_START)    // ST_C_IDLE
+        TRANSITION_MAP_ENTRY(CANNOT_HAPPEN) // ST_C_START
+        TRANSITION_MAP_ENTRY(CANNOT_HAPPEN) // ST_C_COMPLETED
+    END_TRANSITION_MAP(Chain, pEventData)
+}
+
+STATE_DEFINE(ChainIdle, NoEventData) { ((Bench*)self->pInstance)->count++; }
+ENTRY_DEFINE(ChainIdle, NoEventData) { ((Bench*)self->pInstance)->count++; }
+STATE_DEFINE(ChainStart, NoEventData) { SM_InternalEvent(ST_C_COMPLETED, NULL); }
+STATE_DEFINE(ChainCompleted, NoEventData) { SM_InternalEvent(ST_C_IDLE, NULL); }
+
+//----------------------------------------------------------------------------
+// Output
+//----------------------------------------------------------------------------
+static void Result(const char* name, const char* unit, double value, UINT32 threads)
+{
+    printf("%s    {\"name\": \"%s\", \"unit\": \"%s\", \"value\": %.3f, \"threads\": %u}",
+        _first ? "" : ",\n", name, unit, value, threads);
+    _first = FALSE;
+}
+
+//----------------------------------------------------------------------------
+// BenchEvent
+//----------------------------------------------------------------------------
+static double BenchEvent(SM_StateMachine* sm, SM_EventFunc eventFunc)
+{
+    double best = 0;
+    UINT32 run, i;
+
+    // Best of several runs to filter out scheduling noise
+    for (run = 0; run < BENCH_RUNS; run++)
+    {
+        UINT64 start = TH_GetTimeNs();
+        for (i = 0; i < BENCH_EVENTS; i++)
+            eventFunc(sm, NULL);
+        double ns = (double)(TH_GetTimeNs() - start) / BENCH_EVENTS;
+        if (run == 0 || ns < best)
+            best = ns;
+    }
+    return best;
+}
+
+//----------------------------------------------------------------------------
+// BenchSmalloc
+//----------------------------------------------------------------------------
+static double BenchSmalloc(size_t size)
+{
+    double best = 0;
+    UINT32 run, i;
+
+    for (run = 0; run < BENCH_RUNS; run++)
+    {
+        UINT64 start = TH_GetTimeNs();
+        for (i = 0; i < BENCH_ALLOCS; i++)
+            SMALLOC_Free(SMALLOC_Alloc(size));
+        double ns = (double)(TH_GetTimeNs() - start) / BENCH_ALLOCS;
+        if (run == 0 || ns < best)
+            best = ns;
+    }
+    return best;
+}
+
+//----------------------------------------------------------------------------
+// BenchXalloc
+//----------------------------------------------------------------------------
+static double BenchXalloc(XAllocData* data)
+{
+    void* held[BENCH_HELD_BLOCKS];
+    double best = 0;
+    UINT32 run, i, j;
+
+    for (run = 0; run < BENCH_RUNS; run++)
+    {
+        UINT64 start = TH_GetTimeNs();
+        for (i = 0; i < BENCH_ALLOCS / BENCH_HELD_BLOCKS; i++)
+        {
+            for (j = 0; j < BENCH_HELD_BLOCKS; j++)
+                held[j] = XALLOC_Alloc(data, 64);
+            for (j = 0; j < BENCH_HELD_BLOCKS; j++)
+                XALLOC_Free(held[j]);
+        }
+        double ns = (double)(TH_GetTimeNs() - start) / BENCH_ALLOCS;
+        if (run == 0 || ns < best)
+            best = ns;
+    }
+    return best;
+}
+
+//----------------------------------------------------------------------------
+// BenchRealloc
+//----------------------------------------------------------------------------
+static double BenchRealloc(void)
+{
+    double best = 0;
+    UINT32 run, i;
+
+    // Grow from the 16 byte to the 128 byte class and shrink back
+    for (run = 0; run < BENCH_RUNS; run++)
+    {
+        void* p = SMALLOC_Alloc(16);
+        UINT64 start = TH_GetTimeNs();
+        for (i = 0; i < BENCH_ALLOCS; i++)
+            p = SMALLOC_Realloc(p, (i & 1) ? 16 : 100);
+        double ns = (double)(TH_GetTimeNs() - start) / BENCH_ALLOCS;
+        SMALLOC_Free(p);
+        if (run == 0 || ns < best)
+            best = ns;
+    }
+    return best;
+}
+
+//----------------------------------------------------------------------------
+// Fixed block allocator contention
+//----------------------------------------------------------------------------
+static ATOMIC32 _ready;
+static ATOMIC32 _go;
+
+static void ContentionThread(void* arg)
+{
+    ALLOC_HANDLE allocator = arg;
+    void* held[BENCH_HELD_BLOCKS];
+    UINT32 i, j;
+
+    ATOMIC_FetchAdd32(&_ready, 1);
+    while (!ATOMIC_Load32(&_go))
+        ATOMIC_Pause();
+
+    for (i = 0; i < BENCH_ALLOCS / BENCH_HELD_BLOCKS; i++)
+    {
+        for (j = 0; j < BENCH_HELD_BLOCKS; j++)
+            held[j] = ALLOC_Alloc(allocator, 64);
+        for (j = 0; j < BENCH_HELD_BLOCKS; j++)
+            ALLOC_Free(allocator, held[j]);
+    }
+}
+
+static double BenchContention(UINT32 threads, BOOL split)
+{
+    THREAD_HANDLE handles[BENCH_MAX_THREADS];
+    UINT64 start;
+    UINT32 i;
+
+    ATOMIC_Store32(&_ready, 0);
+    ATOMIC_Store32(&_go, FALSE);
+    for (i = 0; i < threads; i++)
+        handles[i] = TH_CREATE(ContentionThread, split ? 
+            *_splitAllocators[i % BENCH_SPLIT_ALLOCATORS] : benchAllocator);
+    while (ATOMIC_Load32(&_ready) != threads)
+        TH_Yield();
+
+    start = TH_GetTimeNs();
+    ATOMIC_Store32(&_go, TRUE);
+    for (i = 0; i < threads; i++)
+        TH_JOIN(handles[i]);
+
+    // Wall time per alloc/free pair per thread
+    return (double)(TH_GetTimeNs() - start) / ((UINT64)(BENCH_ALLOCS / BENCH_HELD_BLOCKS) * BENCH_HELD_BLOCKS);
+}
+
+//----------------------------------------------------------------------------
+// Free-list stress check
+//----------------------------------------------------------------------------
+static ATOMIC32* StressOwner(void* block)
+{
+    size_t offset = (size_t)((char*)block - benchStressObj.pPool);
+
+    // The block must be one of the pool's blocks
+    ASSERT_TRUE((char*)block >= benchStressObj.pPool);
+    ASSERT_TRUE(offset % benchStressObj.blockSize == 0);
+    ASSERT_TRUE(offset / benchStressObj.blockSize < BENCH_STRESS_BLOCKS);
+    return &_stressOwner[offset / benchStressObj.blockSize];
+}
+
+static void StressThread(void* arg)
+{
+    UINT32 id = (UINT32)(size_t)arg;
+    void* held[BENCH_STRESS_HELD];
+    UINT32 round, count, i;
+
+    ATOMIC_FetchAdd32(&_ready, 1);
+    while (!ATOMIC_Load32(&_go))
+        ATOMIC_Pause();
+
+    for (round = 0; round < BENCH_STRESS_ROUNDS; round++)
+    {
+        // Alternate single and batch calls. The threads together want 
+        // more blocks than the pool has, so allocations also fail.
+        if (round & 1)
+            count = ALLOC_AllocBatch(benchStress, held, BENCH_STRESS_HELD);
+        else
+        {
+            for (count = 0; count < BENCH_STRESS_HELD; count++)
+            {
+                held[count] = ALLOC_Alloc(benchStress, 64);
+                if (held[count] == NULL)
+                    break;
+            }
+        }
+
+        // No block is handed out twice
+        for (i = 0; i < count; i++)
+        {
+            ASSERT_TRUE(ATOMIC_Exchange32(StressOwner(held[i]), id) == 0);
+            memset(held[i], (int)id, 64);
+        }
+        ASSERT_TRUE(ATOMIC_Load32(&benchStressObj.poolIndex) <= benchStressObj.maxBlocks);
+
+        for (i = 0; i < count; i++)
+        {
+            ASSERT_TRUE(((BYTE*)held[i])[63] == (BYTE)id);
+            ASSERT_TRUE(ATOMIC_Exchange32(StressOwner(held[i]), 0) == id);
+        }
+
+        if (round & 1)
+            ALLOC_FreeBatch(benchStress, held, count);
+        else
+        {
+            for (i = 0; i < count; i++)
+                ALLOC_Free(benchStress, held[i]);
+        }
+    }
+}
+
+static double BenchStress(void)
+{
+    THREAD_HANDLE handles[BENCH_STRESS_THREADS];
+    ALLOC_Stats stats;
+    UINT64 start;
+    UINT32 i;
+
+    ATOMIC_Store32(&_ready, 0);
+    ATOMIC_Store32(&_go, FALSE);
+    for (i = 0; i < BENCH_STRESS_THREADS; i++)
+        handles[i] = TH_CREATE(StressThread, (void*)(size_t)(i + 1));
+    while (ATOMIC_Load32(&_ready) != BENCH_STRESS_THREADS)
+        TH_Yield();
+
+    start = TH_GetTimeNs();
+    ATOMIC_Store32(&_go, TRUE);
+    for (i = 0; i < BENCH_STRESS_THREADS; i++)
+        TH_JOIN(handles[i]);
+
+    // Every block is back on the free-list
+    ALLOC_GetStats(benchStress, &stats);
+    ASSERT_TRUE(stats.blocksInUse == 0);
+    ASSERT_TRUE(stats.maxBlocksInUse <= stats.blocksCarved);
+    ASSERT_TRUE(stats.blocksCarved <= BENCH_STRESS_BLOCKS);
+
+    // Wall time per round per thread
+    return (double)(TH_GetTimeNs() - start) / BENCH_STRESS_ROUNDS;
+}
+
+//----------------------------------------------------------------------------
+// Per-thread cache limit check
+//----------------------------------------------------------------------------
+static void IdleThread(void* arg)
+{
+    (void)arg;
+    SMALLOC_Free(SMALLOC_Alloc(8));
+
+    // Stay alive, so the thread's cache is not returned at exit
+    ATOMIC_FetchAdd32(&_ready, 1);
+    while (!ATOMIC_Load32(&_go))
+        TH_Yield();
+}
+
+static double BenchIdleCaches(void)
+{
+    THREAD_HANDLE handles[BENCH_IDLE_THREADS];
+    void* blocks[256];
+    ALLOC_Stats stats;
+    UINT32 count = 0, i;
+
+    ATOMIC_Store32(&_ready, 0);
+    ATOMIC_Store32(&_go, FALSE);
+    for (i = 0; i < BENCH_IDLE_THREADS; i++)
+        handles[i] = TH_CREATE(IdleThread, NULL);
+    while (ATOMIC_Load32(&_ready) != BENCH_IDLE_THREADS)
+        TH_Yield();
+
+    // The 8 byte class is the first SMALLOC allocator
+    SMALLOC_GetStats(&stats, 1);
+    ASSERT_TRUE(stats.maxBlocks <= sizeof(blocks) / sizeof(blocks[0]));
+    while (count < stats.maxBlocks && (blocks[count] = SMALLOC_Alloc(8)) != NULL)
+        count++;
+
+    // At most 1/XALLOC_CACHE_LIMIT of the pool sits in other threads' caches
+    ASSERT_TRUE(count >= stats.maxBlocks - stats.maxBlocks / XALLOC_CACHE_LIMIT);
+
+    for (i = 0; i < count; i++)
+        SMALLOC_Free(blocks[i]);
+    ATOMIC_Store32(&_go, TRUE);
+    for (i = 0; i < BENCH_IDLE_THREADS; i++)
+        TH_JOIN(handles[i]);
+
+    // Blocks the calling thread could allocate
+    return (double)count;
+}
+
+//----------------------------------------------------------------------------
+// Fleet snapshot: save, then restore by mapping and read every state
+//----------------------------------------------------------------------------
+static void BenchSnapshot(void)
+{
+    UINT64 start, mapNs;
+    UINT32 i, sum = 0;
+    BOOL success;
+
+    for (i = 0; i < BENCH_FLEET_SIZE; i++)
+    {
+        BenchFleetObj.states[i] = (BYTE)(i & 1);
+        ((Bench*)SM_FleetGetInstance(BenchFleet, i))->count = i;
+    }
+
+    start = TH_GetTimeNs();
+    success = SNP_SaveFleet(&BenchFleetObj, &BasicConst, BENCH_SNAPSHOT);
+    Result("fleet_snapshot_save_1m", "ms", (double)(TH_GetTimeNs() - start) / 1e6, 1);
+    ASSERT_TRUE(success);
+
+    start = TH_GetTimeNs();
+    success = SNP_MapFleet(&BenchFleetObj, &BasicConst, BENCH_SNAPSHOT);
+    mapNs = TH_GetTimeNs() - start;
+    ASSERT_TRUE(success);
+    Result("fleet_snapshot_map_1m", "ms", (double)mapNs / 1e6, 1);
+
+    for (i = 0; i < BENCH_FLEET_SIZE; i++)
+        sum += BenchFleetObj.states[i];
+    Result("fleet_snapshot_map_read_states_1m", "ms", (double)(TH_GetTimeNs() - start) / 1e6, 1);
+    ASSERT_TRUE(sum == BENCH_FLEET_SIZE / 2);
+
+    SNP_UnmapFleet(&BenchFleetObj);
+    remove(BENCH_SNAPSHOT);
+}
+
+//----------------------------------------------------------------------------
+// main
+//----------------------------------------------------------------------------
+int main(int argc, char* argv[])
+{
+    static const size_t sizes[] = { 8, 32, 64, 128, 256 };
+    UINT32 maxThreads = argc > 1 ? (UINT32)atoi(argv[1]) : 8;
+    UINT32 threads, i;
+    ALLOC_Stats stats;
+    char name[64];
+
+    if (maxThreads < 1 || maxThreads > BENCH_MAX_THREADS)
+        maxThreads = 8;
+
+    ALLOC_Init();
+
+    printf("{\n  \"benchmark\": \"bench_micro\",\n  \"results\": [\n");
+
+    if (argc > 1 && strcmp(argv[1], "stress") == 0)
+    {
+        Result("fb_alloc_free_stress", "ns/round", BenchStress(), BENCH_STRESS_THREADS);
+        Result("xalloc_idle_cache_blocks", "blocks", BenchIdleCaches(), BENCH_IDLE_THREADS);
+        printf("\n  ]\n}\n");
+        ALLOC_Term();
+        return 0;
+    }
+
+    Result("event_basic", "ns/event", BenchEvent(&BasicSMObj, (SM_EventFunc)BasicToggle), 1);
+    Result("event_ex", "ns/event", BenchEvent(&ExSMObj, (SM_EventFunc)ExToggle), 1);
+    Result("event_internal_chain", "ns/event", BenchEvent(&ChainSMObj, (SM_EventFunc)ChainRun), 1);
+
+    // Each size is a class of its own; 256 is the largest class
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        snprintf(name, sizeof(name), "smalloc_alloc_free_%u", (unsigned)sizes[i]);
+        Result(name, "ns/alloc", BenchSmalloc(sizes[i]), 1);
+    }
+    Result("xalloc_realloc", "ns/alloc", BenchRealloc(), 1);
+    Result("xalloc_alloc_free", "ns/alloc", BenchXalloc(&_direct), 1);
+    Result("xalloc_cached_alloc_free", "ns/alloc", BenchXalloc(&_cached), 1);
+
+    // Every block went back; the cached allocator's blocks may sit in the
+    // thread's magazine
+    ALLOC_GetStats(benchDirect, &stats);
+    ASSERT_TRUE(stats.blocksInUse == 0 && stats.failures == 0);
+    ALLOC_GetStats(benchCached, &stats);
+    ASSERT_TRUE(stats.failures == 0);
+
+    for (threads = 1; threads <= maxThreads; threads *= 2)
+        Result("fb_alloc_free_contended", "ns/alloc", BenchContention(threads, FALSE), threads);
+    for (threads = 1; threads <= maxThreads; threads *= 2)
+        Result("fb_alloc_free_split4", "ns/alloc", BenchContention(threads, TRUE), threads);
+
+    BenchSnapshot();
+
+    printf("\n  ]\n}\n");
+
+    ALLOC_Term();
+    return 0;
+}
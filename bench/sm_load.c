@@ -0,0 +1,751 @@
+// Soak and load generator. Creates fleets of Motor and CentrifugeTest
+// instances on a Scheduler, drives them from producer threads with a
+// weighted mix of SetSpeed, Halt, Start, Cancel and Poll events, and
+// reports sustained events/sec, post-to-dispatch latency percentiles,
+// mailbox and allocator high-water marks and FaultHandler hits as JSON.
+// Progress is printed to stderr once per second.
+//
+// make -C bench sm_load
+// bench/sm_load --motors 10000 --centrifuges 1000 --producers 4 --workers 4
+//     --seconds 60 --rate 0 --queue 64 --mix 30,10,20,5,35
+//
+// --rate is events/sec per producer, 0 for as fast as possible. --mix is
+// the relative weight of SetSpeed,Halt,Start,Cancel,Poll. CentrifugeTest
+// instances also receive their own CFG_Poll timer events, which are not
+// counted.
+//
+// --record writes the Motor events to a Recorder file (build with
+// CFLAGS="-O2 -DUSE_SM_RECORD"). --replay replays a recording on one thread
+// into fleets of the same size and reports throughput and divergences;
+// --realtime 1 keeps the recorded timing. Centrifuge polls are replayed
+// from the recording with the timers muted.
+//
+// bench/sm_load --motors 10000 --seconds 10 --record motor.rec
+// bench/sm_load --motors 10000 --replay motor.rec
+//
+// --coalesce 1 coalesces the Poll events queued to each centrifuge (see
+// SM_MailboxCoalesce): a timer poll is dropped while one is queued and a
+// producer poll replaces the queued one. Coalesced events are reported as
+// events_coalesced and are not dispatched.
+//
+// --priority 1 gives each centrifuge a priority mailbox (see
+// SM_MailboxPriority): Cancel events are SM_PRIORITY_HIGH with a 1 ms
+// deadline and Poll events SM_PRIORITY_LOW. cancel_latency_ns reports the
+// post-to-dispatch latency of the Cancel events either way.
+//
+// By default producers back off from a full mailbox. --overflow fail,
+// newest, oldest or block instead posts regardless and lets each mailbox
+// handle the overload with that SM_MailboxOverflow policy; block waits up
+// to --timeout ms. The overflow counters of all mailboxes are reported, 
+// with the timer expiries the mailboxes rejected.
+
+#include "Motor.h"
+#include "CentrifugeTest.h"
+#include "Scheduler.h"
+#include "Timer.h"
+#include "Recorder.h"
+#include "Thread.h"
+#include "Atomic.h"
+#include "sm_allocator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Latency histogram: 8 linear sub-buckets per power of 2 nanoseconds
+#define LOAD_SUB_BITS       3
+#define LOAD_SUB_BUCKETS    (1 << LOAD_SUB_BITS)
+#define LOAD_BUCKETS        (64 * LOAD_SUB_BUCKETS)
+
+#define LOAD_MAX_THREADS    64
+#define LOAD_NAME_SIZE      24
+#define LOAD_MAX_ALLOCATORS 32
+
+enum LoadEvents
+{
+    LOAD_SET_SPEED,
+    LOAD_HALT,
+    LOAD_START,
+    LOAD_CANCEL,
+    LOAD_POLL,
+    LOAD_MAX_EVENTS
+};
+
+// Producers back off from a full mailbox instead of an overflow policy
+#define LOAD_BACKOFF        0
+
+static const char* _overflowNames[] = { "backoff", "fail", "fault", "newest", "oldest", "block" };
+
+// Posted event data, copied inline into the mailbox slot. MotorData comes
+// first so the copy can be passed on as MTR_SetSpeed event data.
+typedef struct
+{
+    MotorData motor;
+    UINT64 postNs;
+} LoadData;
+
+// Dispatch latency histogram of one worker thread
+typedef struct LoadHistogram
+{
+    struct LoadHistogram* next;
+    ATOMIC64 count;                 // Written by the owner only
+    UINT64 maxNs;
+    UINT64 buckets[LOAD_BUCKETS];
+} LoadHistogram;
+
+typedef struct
+{
+    UINT32 motors;
+    UINT32 centrifuges;
+    UINT32 producers;
+    UINT32 workers;
+    UINT32 seconds;
+    UINT32 rate;
+    UINT32 queue;
+    UINT32 mix[LOAD_MAX_EVENTS];
+    const char* record;
+    const char* replay;
+    UINT32 realTime;
+    UINT32 coalesce;
+    UINT32 priority;
+    UINT32 overflow;                // LOAD_BACKOFF or 1 + SM_OverflowPolicy
+    UINT32 timeout;
+} LoadConfig;
+
+typedef struct
+{
+    UINT32 count;
+    SM_StateMachine* machines;
+    SM_Mailbox* mailboxes;
+    EQ_Slot* slots;
+    void* instances;
+    char* names;
+} LoadFleet;
+
+typedef struct
+{
+    UINT32 index;
+    UINT32 random;
+    UINT64 posted;
+    UINT64 rejected;
+    UINT64 full;
+} LoadProducer;
+
+static LoadConfig _config = { 1000, 1000, 2, 2, 5, 0, 64, { 30, 10, 20, 5, 35 },
+    NULL, NULL, 0, 0, 0, LOAD_BACKOFF, 1 };
+static LoadFleet _motors;
+static LoadFleet _centrifuges;
+static ATOMIC32 _stop;
+
+static ATOMIC_PTR _histograms;
+static TH_THREAD_LOCAL LoadHistogram* _histogram;
+
+static ATOMIC64 _cancelCount;
+static ATOMIC64 _cancelTotalNs;
+static ATOMIC64 _cancelMaxNs;
+
+static ATOMIC32 _faults;
+static const char* _faultFile;
+static unsigned short _faultLine;
+
+//----------------------------------------------------------------------------
+// Latency histogram
+//----------------------------------------------------------------------------
+static UINT32 BucketIndex(UINT64 ns)
+{
+    UINT32 msb = 0;
+
+    if (ns < LOAD_SUB_BUCKETS)
+        return (UINT32)ns;
+    while ((ns >> msb) > 1)
+        msb++;
+    return (msb - LOAD_SUB_BITS + 1) * LOAD_SUB_BUCKETS +
+        (UINT32)((ns >> (msb - LOAD_SUB_BITS)) & (LOAD_SUB_BUCKETS - 1));
+}
+
+static UINT64 BucketUpper(UINT32 index)
+{
+    UINT32 msb = index / LOAD_SUB_BUCKETS + LOAD_SUB_BITS - 1;
+    UINT64 sub = index % LOAD_SUB_BUCKETS;
+
+    if (index < LOAD_SUB_BUCKETS)
+        return index;
+    return ((LOAD_SUB_BUCKETS + sub + 1) << (msb - LOAD_SUB_BITS)) - 1;
+}
+
+static void RecordLatency(UINT64 postNs)
+{
+    LoadHistogram* h = _histogram;
+    LoadHistogram* head = NULL;
+    UINT64 ns = TH_GetTimeNs() - postNs;
+
+    if (h == NULL)
+    {
+        h = (LoadHistogram*)calloc(1, sizeof(LoadHistogram));
+        ASSERT_TRUE(h);
+        do
+        {
+            head = (LoadHistogram*)ATOMIC_LoadPtr(&_histograms);
+            h->next = head;
+        } while (!ATOMIC_CompareExchangePtr(&_histograms, head, h));
+        _histogram = h;
+    }
+
+    h->buckets[BucketIndex(ns)]++;
+    if (ns > h->maxNs)
+        h->maxNs = ns;
+    ATOMIC_Store64(&h->count, ATOMIC_Load64(&h->count) + 1);
+}
+
+static void RecordCancelLatency(UINT64 postNs)
+{
+    INT64 ns = (INT64)(TH_GetTimeNs() - postNs);
+    INT64 maxNs = ATOMIC_Load64(&_cancelMaxNs);
+
+    ATOMIC_FetchAdd64(&_cancelCount, 1);
+    ATOMIC_FetchAdd64(&_cancelTotalNs, ns);
+    while (ns > maxNs && !ATOMIC_CompareExchange64(&_cancelMaxNs, maxNs, ns))
+        maxNs = ATOMIC_Load64(&_cancelMaxNs);
+}
+
+static UINT64 GetEventCount(void)
+{
+    LoadHistogram* h;
+    UINT64 count = 0;
+
+    for (h = (LoadHistogram*)ATOMIC_LoadPtr(&_histograms); h; h = h->next)
+        count += (UINT64)ATOMIC_Load64(&h->count);
+    return count;
+}
+
+//----------------------------------------------------------------------------
+// Load events. Record the dispatch latency, then forward to the real event.
+//----------------------------------------------------------------------------
+static void LOAD_SetSpeed(SM_StateMachine* self, LoadData* pEventData)
+{
+    RecordLatency(pEventData->postNs);
+    MTR_SetSpeed(self, &pEventData->motor);
+}
+
+static void LOAD_Halt(SM_StateMachine* self, LoadData* pEventData)
+{
+    RecordLatency(pEventData->postNs);
+    MTR_Halt(self, NULL);
+}
+
+static void LOAD_Start(SM_StateMachine* self, LoadData* pEventData)
+{
+    RecordLatency(pEventData->postNs);
+    CFG_Start(self, NULL);
+}
+
+static void LOAD_Cancel(SM_StateMachine* self, LoadData* pEventData)
+{
+    RecordLatency(pEventData->postNs);
+    RecordCancelLatency(pEventData->postNs);
+    CFG_Cancel(self, NULL);
+}
+
+static void LOAD_Poll(SM_StateMachine* self, LoadData* pEventData)
+{
+    RecordLatency(pEventData->postNs);
+    CFG_Poll(self, NULL);
+}
+
+static const SM_EventFunc _loadEvents[LOAD_MAX_EVENTS] = {
+    (SM_EventFunc)LOAD_SetSpeed,
+    (SM_EventFunc)LOAD_Halt,
+    (SM_EventFunc)LOAD_Start,
+    (SM_EventFunc)LOAD_Cancel,
+    (SM_EventFunc)LOAD_Poll
+};
+
+//----------------------------------------------------------------------------
+// Faults
+//----------------------------------------------------------------------------
+static int CountFault(const char* file, unsigned short line)
+{
+    ATOMIC_FetchAdd32(&_faults, 1);
+    _faultFile = file;
+    _faultLine = line;
+
+    // Keep running; a full mailbox releases the event and returns FALSE
+    return 1;
+}
+
+//----------------------------------------------------------------------------
+// Fleets
+//----------------------------------------------------------------------------
+static void CreateFleet(LoadFleet* fleet, UINT32 count, size_t instanceSize,
+    const char* name, const SM_StateMachineConst* selfConst, SM_Scheduler* scheduler)
+{
+    UINT32 i;
+
+    fleet->count = count;
+    fleet->machines = (SM_StateMachine*)calloc(count ? count : 1, sizeof(SM_StateMachine));
+    fleet->mailboxes = (SM_Mailbox*)calloc(count ? count : 1, sizeof(SM_Mailbox));
+    fleet->slots = (EQ_Slot*)calloc((size_t)(count ? count : 1) * _config.queue, sizeof(EQ_Slot));
+    fleet->instances = calloc(count ? count : 1, instanceSize);
+    fleet->names = (char*)calloc(count ? count : 1, LOAD_NAME_SIZE);
+    ASSERT_TRUE(fleet->machines && fleet->mailboxes && fleet->slots && fleet->instances && fleet->names);
+
+    for (i = 0; i < count; i++)
+    {
+        SM_Mailbox mailbox = { { fleet->slots + (size_t)i * _config.queue, _config.queue, 0, 0, 0, 0 },
+            0, 0, NULL, NULL, NULL, 0 };
+
+        memcpy(&fleet->mailboxes[i], &mailbox, sizeof(SM_Mailbox));
+
+        // Unique names identify the instances of a recording
+        snprintf(fleet->names + (size_t)i * LOAD_NAME_SIZE, LOAD_NAME_SIZE, "%s%u", name, i);
+        fleet->machines[i].name = fleet->names + (size_t)i * LOAD_NAME_SIZE;
+        fleet->machines[i].pInstance = (char*)fleet->instances + i * instanceSize;
+        fleet->machines[i].selfConst = selfConst;
+
+        if (_config.coalesce && selfConst == &CentrifugeTestConst)
+        {
+            _SM_MailboxCoalesce(&fleet->mailboxes[i], (SM_EventFunc)CFG_Poll, SM_COALESCE_DROP, NULL);
+            _SM_MailboxCoalesce(&fleet->mailboxes[i], (SM_EventFunc)LOAD_Poll, SM_COALESCE_LATEST, NULL);
+        }
+        if (_config.priority && selfConst == &CentrifugeTestConst)
+        {
+            fleet->mailboxes[i].pPriority = SM_PriorityCreate(_config.queue);
+            _SM_MailboxPriority(&fleet->mailboxes[i], (SM_EventFunc)LOAD_Cancel, SM_PRIORITY_HIGH, 1);
+            _SM_MailboxPriority(&fleet->mailboxes[i], (SM_EventFunc)CFG_Cancel, SM_PRIORITY_HIGH, 1);
+            _SM_MailboxPriority(&fleet->mailboxes[i], (SM_EventFunc)LOAD_Poll, SM_PRIORITY_LOW, 0);
+            _SM_MailboxPriority(&fleet->mailboxes[i], (SM_EventFunc)CFG_Poll, SM_PRIORITY_LOW, 0);
+        }
+        if (_config.overflow != LOAD_BACKOFF)
+        {
+            _SM_MailboxOverflow(&fleet->mailboxes[i], (SM_OverflowPolicy)(_config.overflow - 1),
+                _config.timeout);
+        }
+
+        // Replayed fleets are driven directly
+        if (scheduler)
+            _SM_SchedulerAttach(&fleet->machines[i], &fleet->mailboxes[i], scheduler);
+    }
+}
+
+static void DestroyFleet(LoadFleet* fleet)
+{
+    UINT32 i;
+
+    // Waits for each mailbox to drain
+    for (i = 0; i < fleet->count; i++)
+    {
+        if (fleet->machines[i].pMailbox)
+            _SM_SchedulerDetach(&fleet->machines[i]);
+        SM_PriorityDestroy(fleet->mailboxes[i].pPriority);
+    }
+
+    free(fleet->machines);
+    free(fleet->mailboxes);
+    free(fleet->slots);
+    free(fleet->instances);
+    free(fleet->names);
+}
+
+static SM_StateMachine* ResolveInstance(const CHAR* name, const CHAR* typeName, void* context)
+{
+    UINT32 index;
+
+    (void)typeName;
+    (void)context;
+    if (sscanf(name, "Motor%u", &index) == 1 && index < _motors.count)
+        return &_motors.machines[index];
+    if (sscanf(name, "CentrifugeTest%u", &index) == 1 && index < _centrifuges.count)
+        return &_centrifuges.machines[index];
+    return NULL;
+}
+
+static UINT32 GetMailboxHighWater(LoadFleet* fleet)
+{
+    UINT32 i, highWater = 0;
+
+    for (i = 0; i < fleet->count; i++)
+    {
+        UINT32 hw = EQ_HighWater(&fleet->mailboxes[i].queue);
+        if (hw > highWater)
+            highWater = hw;
+    }
+    return highWater;
+}
+
+// Depth of the mailbox queue a load event is posted to
+static UINT32 GetQueueDepth(SM_Mailbox* mailbox, UINT32 event)
+{
+    SM_PriorityLanes* lanes = mailbox->pPriority;
+
+    if (lanes && event == LOAD_CANCEL)
+        return EQ_Depth(&lanes->high);
+    if (lanes && event == LOAD_POLL)
+        return EQ_Depth(&lanes->low);
+    return EQ_Depth(&mailbox->queue);
+}
+
+static UINT64 GetCoalesced(LoadFleet* fleet)
+{
+    UINT64 coalesced = 0;
+    UINT32 i;
+
+    for (i = 0; i < fleet->count; i++)
+        coalesced += ATOMIC_Load32(&fleet->mailboxes[i].coalesced);
+    return coalesced;
+}
+
+static void GetOverflowStats(LoadFleet* fleet, SM_OverflowStats* total)
+{
+    SM_OverflowStats stats;
+    UINT32 i;
+
+    for (i = 0; i < fleet->count; i++)
+    {
+        _SM_MailboxGetStats(&fleet->mailboxes[i], &stats);
+        total->rejected += stats.rejected;
+        total->droppedNewest += stats.droppedNewest;
+        total->droppedOldest += stats.droppedOldest;
+        total->blocked += stats.blocked;
+        total->blockedNs += stats.blockedNs;
+    }
+}
+
+//----------------------------------------------------------------------------
+// Producers
+//----------------------------------------------------------------------------
+static UINT32 NextRandom(LoadProducer* producer)
+{
+    // xorshift32
+    UINT32 x = producer->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    producer->random = x;
+    return x;
+}
+
+static void ProducerThread(void* arg)
+{
+    LoadProducer* producer = (LoadProducer*)arg;
+    UINT32 totalWeight = 0;
+    UINT64 interval = _config.rate ? 1000000000ULL / _config.rate : 0;
+    UINT64 deadline = TH_GetTimeNs();
+    LoadData data;
+    UINT32 i;
+
+    for (i = 0; i < LOAD_MAX_EVENTS; i++)
+        totalWeight += _config.mix[i];
+
+    while (!ATOMIC_Load32(&_stop))
+    {
+        UINT32 pick = NextRandom(producer) % totalWeight;
+        UINT32 event = 0;
+        LoadFleet* fleet;
+        SM_StateMachine* machine;
+
+        while (pick >= _config.mix[event])
+            pick -= _config.mix[event++];
+
+        fleet = event <= LOAD_HALT ? &_motors : &_centrifuges;
+        if (fleet->count == 0)
+            continue;
+        machine = &fleet->machines[NextRandom(producer) % fleet->count];
+
+        // Back off from a full mailbox rather than overflow it
+        if (_config.overflow == LOAD_BACKOFF && GetQueueDepth(machine->pMailbox, event) >= _config.queue)
+        {
+            producer->full++;
+            TH_Yield();
+            continue;
+        }
+
+        if (interval)
+        {
+            UINT64 now;
+            deadline += interval;
+            while ((now = TH_GetTimeNs()) < deadline)
+            {
+                if (deadline - now > 2000000)
+                    TH_Sleep(1);
+                else
+                    TH_Yield();
+            }
+        }
+
+        data.motor.speed = (INT)(NextRandom(producer) % 1000) + 1;
+        data.postNs = TH_GetTimeNs();
+        if (_SM_PostCopy(machine, _loadEvents[event], &data, sizeof(data)))
+            producer->posted++;
+        else
+            producer->rejected++;
+    }
+}
+
+//----------------------------------------------------------------------------
+// Options
+//----------------------------------------------------------------------------
+static BOOL ParseOptions(int argc, char* argv[])
+{
+    int i;
+
+    for (i = 1; i + 1 < argc; i += 2)
+    {
+        UINT32 value = (UINT32)strtoul(argv[i + 1], NULL, 10);
+
+        if (strcmp(argv[i], "--motors") == 0) _config.motors = value;
+        else if (strcmp(argv[i], "--centrifuges") == 0) _config.centrifuges = value;
+        else if (strcmp(argv[i], "--producers") == 0) _config.producers = value;
+        else if (strcmp(argv[i], "--workers") == 0) _config.workers = value;
+        else if (strcmp(argv[i], "--seconds") == 0) _config.seconds = value;
+        else if (strcmp(argv[i], "--rate") == 0) _config.rate = value;
+        else if (strcmp(argv[i], "--queue") == 0) _config.queue = value;
+        else if (strcmp(argv[i], "--record") == 0) _config.record = argv[i + 1];
+        else if (strcmp(argv[i], "--replay") == 0) _config.replay = argv[i + 1];
+        else if (strcmp(argv[i], "--realtime") == 0) _config.realTime = value;
+        else if (strcmp(argv[i], "--coalesce") == 0) _config.coalesce = value;
+        else if (strcmp(argv[i], "--priority") == 0) _config.priority = value;
+        else if (strcmp(argv[i], "--timeout") == 0) _config.timeout = value;
+        else if (strcmp(argv[i], "--overflow") == 0)
+        {
+            for (_config.overflow = 0; _config.overflow < sizeof(_overflowNames) / sizeof(_overflowNames[0]) &&
+                strcmp(argv[i + 1], _overflowNames[_config.overflow]) != 0; _config.overflow++)
+                ;
+            if (_config.overflow == sizeof(_overflowNames) / sizeof(_overflowNames[0]))
+                return FALSE;
+        }
+        else if (strcmp(argv[i], "--mix") == 0)
+        {
+            if (sscanf(argv[i + 1], "%u,%u,%u,%u,%u", &_config.mix[0], &_config.mix[1],
+                &_config.mix[2], &_config.mix[3], &_config.mix[4]) != LOAD_MAX_EVENTS)
+                return FALSE;
+        }
+        else
+            return FALSE;
+    }
+    if (i != argc)
+        return FALSE;
+
+    // Mailbox capacity must be a power of 2
+    if (_config.queue == 0 || (_config.queue & (_config.queue - 1)) != 0)
+        return FALSE;
+    if (_config.producers == 0 || _config.producers > LOAD_MAX_THREADS ||
+        _config.workers == 0 || _config.workers > LOAD_MAX_THREADS)
+        return FALSE;
+    if (_config.mix[0] + _config.mix[1] + _config.mix[2] + _config.mix[3] + _config.mix[4] == 0)
+        return FALSE;
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// Replay
+//----------------------------------------------------------------------------
+static int Replay(void)
+{
+    REC_ReplayStats stats;
+    BOOL success;
+
+    CreateFleet(&_motors, _config.motors, sizeof(Motor), "Motor", &MotorConst, NULL);
+    CreateFleet(&_centrifuges, _config.centrifuges, sizeof(CentrifugeTest), "CentrifugeTest",
+        &CentrifugeTestConst, NULL);
+
+    // Armed timers post nothing; the recording holds the CFG_Poll events
+    TMR_Init();
+    TMR_Mute(TRUE);
+    success = REC_Replay(_config.replay, ResolveInstance, NULL, _config.realTime != 0, &stats);
+
+    printf("{\n  \"tool\": \"sm_load\",\n  \"replay\": \"%s\",\n  \"success\": %s,\n",
+        _config.replay, success ? "true" : "false");
+    printf("  \"instances\": %u,\n  \"events\": %llu,\n  \"skipped\": %llu,\n  \"divergences\": %llu,\n",
+        stats.instances, (unsigned long long)stats.events, (unsigned long long)stats.skipped,
+        (unsigned long long)stats.divergences);
+    printf("  \"elapsed_sec\": %.3f,\n  \"events_per_sec\": %.0f,\n  \"faults\": %u\n}\n",
+        stats.elapsedNs / 1e9, stats.elapsedNs ? stats.events / (stats.elapsedNs / 1e9) : 0.0,
+        ATOMIC_Load32(&_faults));
+
+    DestroyFleet(&_motors);
+    DestroyFleet(&_centrifuges);
+    TMR_Term();
+    return success && stats.divergences == 0 && ATOMIC_Load32(&_faults) == 0 ? 0 : 2;
+}
+
+//----------------------------------------------------------------------------
+// main
+//----------------------------------------------------------------------------
+int main(int argc, char* argv[])
+{
+    static const UINT16 motorDataSizes[MTR_MAX_EVENTS] = { sizeof(MotorData), 0 };
+    LoadProducer producers[LOAD_MAX_THREADS];
+    THREAD_HANDLE handles[LOAD_MAX_THREADS];
+    UINT64 buckets[LOAD_BUCKETS];
+    UINT64 posted = 0, rejected = 0, full = 0, tests = 0, events, maxNs = 0, seen;
+    SM_OverflowStats overflow;
+    UINT64 startNs, elapsedNs, lastEvents = 0;
+    UINT32 i, second, percentile;
+    static const UINT32 percentiles[] = { 500, 990, 999 };
+    static const char* percentileNames[] = { "p50", "p99", "p999" };
+    ALLOC_Stats allocators[LOAD_MAX_ALLOCATORS];
+    UINT32 allocatorCount;
+    LoadHistogram* h;
+    SM_Scheduler* scheduler;
+
+    C_ASSERT(sizeof(LoadData) <= SM_INLINE_DATA_SIZE);
+
+    if (!ParseOptions(argc, argv))
+    {
+        fprintf(stderr, "usage: %s [--motors n] [--centrifuges n] [--producers n] [--workers n]\n"
+            "    [--seconds n] [--rate events/sec] [--queue pow2] [--mix setspeed,halt,start,cancel,poll]\n"
+            "    [--record file] [--replay file [--realtime 1]] [--coalesce 1] [--priority 1]\n"
+            "    [--overflow backoff|fail|fault|newest|oldest|block [--timeout ms]]\n", argv[0]);
+        return 1;
+    }
+
+    FaultSetHook(CountFault);
+    ALLOC_Init();
+
+    if (_config.replay)
+    {
+        int result = Replay();
+        ALLOC_Term();
+        return result;
+    }
+
+    TMR_Init();
+
+    REC_RegisterType(&MotorConst, motorDataSizes);
+    if (_config.record && !REC_Start(_config.record))
+    {
+        fprintf(stderr, "cannot create %s\n", _config.record);
+        return 1;
+    }
+#ifndef USE_SM_RECORD
+    if (_config.record)
+        fprintf(stderr, "recording needs CFLAGS=\"-O2 -DUSE_SM_RECORD\"\n");
+#endif
+
+    scheduler = SCH_Create((UINT16)_config.workers, _config.motors + _config.centrifuges);
+    CreateFleet(&_motors, _config.motors, sizeof(Motor), "Motor", &MotorConst, scheduler);
+    CreateFleet(&_centrifuges, _config.centrifuges, sizeof(CentrifugeTest), "CentrifugeTest",
+        &CentrifugeTestConst, scheduler);
+
+    startNs = TH_GetTimeNs();
+    for (i = 0; i < _config.producers; i++)
+    {
+        memset(&producers[i], 0, sizeof(LoadProducer));
+        producers[i].index = i;
+        producers[i].random = 2463534242u + i * 7919;
+        handles[i] = TH_CREATE(ProducerThread, &producers[i]);
+    }
+
+    for (second = 1; second <= _config.seconds; second++)
+    {
+        TH_Sleep(1000);
+        events = GetEventCount();
+        fprintf(stderr, "%4us %12llu events/s  faults %u\n", second,
+            (unsigned long long)(events - lastEvents), ATOMIC_Load32(&_faults));
+        lastEvents = events;
+    }
+
+    ATOMIC_Store32(&_stop, TRUE);
+    for (i = 0; i < _config.producers; i++)
+    {
+        TH_JOIN(handles[i]);
+        posted += producers[i].posted;
+        rejected += producers[i].rejected;
+        full += producers[i].full;
+    }
+    elapsedNs = TH_GetTimeNs() - startNs;
+
+    // Return every centrifuge to idle so its poll timer stops, then drain
+    for (i = 0; i < _centrifuges.count; i++)
+    {
+        // Leave room so no overflow policy drops the Cancel
+        while (_SM_MailboxDepth(&_centrifuges.mailboxes[i]) > _config.queue / 2)
+            TH_Yield();
+        while (!_SM_Post(&_centrifuges.machines[i], (SM_EventFunc)CFG_Cancel, NULL))
+            TH_Yield();
+    }
+    for (i = 0; i < _centrifuges.count; i++)
+        tests += ATOMIC_Load32(&((CentrifugeTest*)_centrifuges.instances)[i].testCount);
+
+    printf("{\n  \"tool\": \"sm_load\",\n");
+    printf("  \"config\": {\"motors\": %u, \"centrifuges\": %u, \"producers\": %u, \"workers\": %u, "
+        "\"seconds\": %u, \"rate\": %u, \"queue\": %u, \"mix\": [%u, %u, %u, %u, %u], \"coalesce\": %u, \"priority\": %u, "
+        "\"overflow\": \"%s\", \"timeout\": %u},\n",
+        _config.motors, _config.centrifuges, _config.producers, _config.workers, _config.seconds,
+        _config.rate, _config.queue, _config.mix[0], _config.mix[1], _config.mix[2], _config.mix[3], _config.mix[4],
+        _config.coalesce, _config.priority, _overflowNames[_config.overflow], _config.timeout);
+    printf("  \"mailbox_high_water\": {\"motor\": %u, \"centrifuge\": %u},\n",
+        GetMailboxHighWater(&_motors), GetMailboxHighWater(&_centrifuges));
+    printf("  \"events_coalesced\": %llu,\n", (unsigned long long)GetCoalesced(&_centrifuges));
+    memset(&overflow, 0, sizeof(overflow));
+    GetOverflowStats(&_motors, &overflow);
+    GetOverflowStats(&_centrifuges, &overflow);
+    printf("  \"overflow\": {\"rejected\": %llu, \"dropped_newest\": %llu, \"dropped_oldest\": %llu, "
+        "\"blocked\": %llu, \"blocked_ms\": %llu, \"timer_failed\": %llu},\n",
+        (unsigned long long)overflow.rejected, (unsigned long long)overflow.droppedNewest,
+        (unsigned long long)overflow.droppedOldest, (unsigned long long)overflow.blocked,
+        (unsigned long long)(overflow.blockedNs / 1000000), (unsigned long long)TMR_GetFailed());
+
+    DestroyFleet(&_motors);
+    DestroyFleet(&_centrifuges);
+    SCH_Destroy(scheduler);
+    TMR_Term();
+    if (_config.record && !REC_Stop())
+        fprintf(stderr, "error writing %s\n", _config.record);
+
+    // Merge the worker histograms
+    memset(buckets, 0, sizeof(buckets));
+    events = 0;
+    for (h = (LoadHistogram*)ATOMIC_LoadPtr(&_histograms); h; h = h->next)
+    {
+        for (i = 0; i < LOAD_BUCKETS; i++)
+            buckets[i] += h->buckets[i];
+        events += (UINT64)ATOMIC_Load64(&h->count);
+        if (h->maxNs > maxNs)
+            maxNs = h->maxNs;
+    }
+
+    printf("  \"elapsed_sec\": %.3f,\n", elapsedNs / 1e9);
+    printf("  \"events_posted\": %llu,\n  \"events_dispatched\": %llu,\n  \"events_per_sec\": %.0f,\n",
+        (unsigned long long)posted, (unsigned long long)events, events / (elapsedNs / 1e9));
+    printf("  \"posts_rejected\": %llu,\n  \"posts_skipped_full\": %llu,\n  \"tests_finished\": %llu,\n",
+        (unsigned long long)rejected, (unsigned long long)full, (unsigned long long)tests);
+
+    printf("  \"dispatch_latency_ns\": {");
+    for (percentile = 0; percentile < sizeof(percentiles) / sizeof(percentiles[0]); percentile++)
+    {
+        UINT64 target = (events * percentiles[percentile] + 999) / 1000;
+        seen = 0;
+        for (i = 0; i < LOAD_BUCKETS - 1 && (seen += buckets[i]) < target; i++)
+            ;
+        printf("\"%s\": %llu, ", percentileNames[percentile],
+            (unsigned long long)(BucketUpper(i) < maxNs ? BucketUpper(i) : maxNs));
+    }
+    printf("\"max\": %llu},\n", (unsigned long long)maxNs);
+    printf("  \"cancel_latency_ns\": {\"mean\": %llu, \"max\": %llu},\n",
+        (unsigned long long)(ATOMIC_Load64(&_cancelCount) ? 
+            ATOMIC_Load64(&_cancelTotalNs) / ATOMIC_Load64(&_cancelCount) : 0),
+        (unsigned long long)ATOMIC_Load64(&_cancelMaxNs));
+
+    printf("  \"allocators\": [");
+    allocatorCount = SMALLOC_GetStats(allocators, LOAD_MAX_ALLOCATORS);
+    for (i = 0; i < allocatorCount; i++)
+    {
+        printf("%s{\"name\": \"%s\", \"block_size\": %u, \"max_blocks\": %u, \"blocks_in_use\": %llu, "
+            "\"max_blocks_in_use\": %llu, \"blocks_carved\": %llu, \"utilization_pct\": %u, \"allocations\": %llu, "
+            "\"failures\": %llu}", 
+            i ? ", " : "", allocators[i].name, (unsigned)allocators[i].blockSize, allocators[i].maxBlocks, 
+            (unsigned long long)allocators[i].blocksInUse, (unsigned long long)allocators[i].maxBlocksInUse,
+            (unsigned long long)allocators[i].blocksCarved,
+            allocators[i].utilization, (unsigned long long)allocators[i].allocations, 
+            (unsigned long long)allocators[i].failures);
+    }
+    printf("],\n");
+
+    printf("  \"faults\": %u", ATOMIC_Load32(&_faults));
+    if (_faultFile)
+        printf(",\n  \"last_fault\": \"%s:%u\"", _faultFile, _faultLine);
+    printf("\n}\n");
+
+    ALLOC_Term();
+    return ATOMIC_Load32(&_faults) ? 2 : 0;
+}
@@ -1,23 +1,18 @@
 #include "fb_allocator.h"
 #include "DataTypes.h"
 #include "Fault.h"
+#include "Thread.h"
 #include <string.h>
 
-// Define USE_LOCK to use the default lock implementation
-#define USE_LOCKS
-#ifdef USE_LOCKS
-    #include "LockGuard.h"
-    static LOCK_HANDLE _hLock;
-#else
-    #pragma message("WARNING: Define software lock.")
-    typedef int LOCK_HANDLE;
-    static LOCK_HANDLE _hLock;
-
-    #define LK_CREATE()     (1)
-    #define LK_DESTROY(h)  
-    #define LK_LOCK(h)    
-    #define LK_UNLOCK(h)  
-#endif
+// Free-list head. The lower 32 bits are the index + 1 of the top block, 0 
+// when the free-list is empty; each free block stores the lower 32 bits of
+// the head below it. The upper 32 bits are a tag incremented on every 
+// change, so a pop that read a head since popped and pushed back fails its 
+// compare-exchange (ABA).
+#define ALLOC_HEAD(_tag_, _link_) \
+    ((INT64)(((UINT64)(_tag_) << 32) | (UINT32)(_link_)))
+#define ALLOC_HEAD_TAG(_head_)      ((UINT32)((UINT64)(_head_) >> 32))
+#define ALLOC_HEAD_LINK(_head_)     ((UINT32)(_head_))
 
 // Get a pointer to the client's area within a memory block
 #define GET_CLIENT_PTR(_block_ptr_) \
@@ -27,57 +22,86 @@
 #define GET_BLOCK_PTR(_client_ptr_) \
     (_client_ptr_ ? ((void*)((char*)_client_ptr_)) : NULL)
 
+// The calling thread's ALLOC_Allocator::stats shard + 1, 0 until first use
+static TH_THREAD_LOCAL UINT32 _statShard;
+static ATOMIC32 _statThreads;
+
 static void* ALLOC_NewBlock(ALLOC_Allocator* alloc);
-static void ALLOC_Push(ALLOC_Allocator* alloc, void* pBlock);
+static ALLOC_StatShard* ALLOC_GetShard(ALLOC_Allocator* alloc);
+static UINT32 ALLOC_Link(ALLOC_Allocator* alloc, const void* pBlock);
+static void ALLOC_Push(ALLOC_Allocator* alloc, void* pFirst, void* pLast);
 static void* ALLOC_Pop(ALLOC_Allocator* alloc);
+static void ALLOC_Taken(ALLOC_Allocator* alloc, UINT32 count);
 
 //----------------------------------------------------------------------------
 // ALLOC_NewBlock
 //----------------------------------------------------------------------------
 static void* ALLOC_NewBlock(ALLOC_Allocator* self)
 {
-    ALLOC_Block* pBlock = NULL;
-
-    LK_LOCK(_hLock);
+    UINT32 index;
 
-    // If we have not exceeded the pool maximum
-    if (self->poolIndex < self->maxBlocks)
+    do
     {
-        // Get pointer to a new fixed memory block within the pool
-        pBlock = (void*)(self->pPool + (self->poolIndex++ * self->blockSize));
-    }
+        // If we have exceeded the pool maximum. The caller sees NULL, like malloc().
+        index = ATOMIC_Load32(&self->poolIndex);
+        if (index >= self->maxBlocks)
+            return NULL;
+    } while (!ATOMIC_CompareExchange32(&self->poolIndex, index, index + 1));
+
+    // Get pointer to a new fixed memory block within the pool
+    return (void*)(self->pPool + (index * self->blockSize));
+} 
 
-    LK_UNLOCK(_hLock);
+//----------------------------------------------------------------------------
+// ALLOC_GetShard
+//----------------------------------------------------------------------------
+static ALLOC_StatShard* ALLOC_GetShard(ALLOC_Allocator* self)
+{
+    UINT32 shard = _statShard;
 
-    if (!pBlock)
+    if (shard == 0)
     {
-        // Out of fixed block memory
-        ASSERT();
+        // Spread threads over the shards in turn
+        shard = ATOMIC_FetchAdd32(&_statThreads, 1) % ALLOC_STAT_SHARDS + 1;
+        _statShard = shard;
     }
-
-    return pBlock;
-} 
+    return &self->stats[shard - 1];
+}
 
 //----------------------------------------------------------------------------
-// ALLOC_Push
+// ALLOC_Link
 //----------------------------------------------------------------------------
-static void ALLOC_Push(ALLOC_Allocator* self, void* pBlock)
+static UINT32 ALLOC_Link(ALLOC_Allocator* self, const void* pBlock)
 {
-    if (!pBlock)
-        return;
+    UINT32 index = (UINT32)(((const char*)pBlock - self->pPool) / self->blockSize);
 
-    // Get a pointer to the client's location within the block
-    ALLOC_Block* pClient = (ALLOC_Block*)GET_CLIENT_PTR(pBlock);
+    // Block from this allocator's pool?
+    ASSERT_TRUE(index < self->maxBlocks);
+    return index + 1;
+}
 
-    LK_LOCK(_hLock);
+//----------------------------------------------------------------------------
+// ALLOC_Push
+//----------------------------------------------------------------------------
+static void ALLOC_Push(ALLOC_Allocator* self, void* pFirst, void* pLast)
+{
+    UINT32 first, link;
+    INT64 head;
 
-    // Point client block's next pointer to head
-    pClient->pNext = self->pHead;
+    if (!pFirst)
+        return;
 
-    // The client block is now the new head
-    self->pHead = pClient;
+    first = ALLOC_Link(self, pFirst);
 
-    LK_UNLOCK(_hLock); 
+    do
+    {
+        // Point the last block's link to the head, then make the first 
+        // block the head
+        head = ATOMIC_Load64(&self->head);
+        link = ALLOC_HEAD_LINK(head);
+        memcpy(pLast, &link, sizeof(link));
+    } while (!ATOMIC_CompareExchange64(&self->head, head, 
+        ALLOC_HEAD(ALLOC_HEAD_TAG(head) + 1, first)));
 }
 
 //----------------------------------------------------------------------------
@@ -85,30 +109,52 @@ static void ALLOC_Push(ALLOC_Allocator* self, void* pBlock)
 //----------------------------------------------------------------------------
 static void* ALLOC_Pop(ALLOC_Allocator* self)
 {
-    ALLOC_Block* pBlock = NULL;
-
-    LK_LOCK(_hLock);
+    const char* pBlock = NULL;
+    UINT32 next;
+    INT64 head;
 
-    // Is the free-list empty?
-    if (self->pHead)
+    do
     {
-        // Remove the head block
-        pBlock = self->pHead;
+        // Is the free-list empty?
+        head = ATOMIC_Load64(&self->head);
+        if (ALLOC_HEAD_LINK(head) == 0)
+            return NULL;
+
+        // Read the link of the head block. Another thread may pop and reuse 
+        // the block meanwhile; the pool stays mapped, and the tag then fails
+        // the compare-exchange.
+        pBlock = self->pPool + (ALLOC_HEAD_LINK(head) - 1) * self->blockSize;
+        memcpy(&next, pBlock, sizeof(next));
+    } while (!ATOMIC_CompareExchange64(&self->head, head, 
+        ALLOC_HEAD(ALLOC_HEAD_TAG(head) + 1, next)));
+
+    return GET_BLOCK_PTR((void*)pBlock);
+} 
 
-        // Set the head to the next block
-        self->pHead = self->pHead->pNext;
-    }
+//----------------------------------------------------------------------------
+// ALLOC_Taken
+//----------------------------------------------------------------------------
+static void ALLOC_Taken(ALLOC_Allocator* self, UINT32 count)
+{
+    UINT32 inUse = ATOMIC_FetchAdd32(&self->inUse, count) + count;
+    UINT32 peak;
 
-    LK_UNLOCK(_hLock); 
-    return GET_BLOCK_PTR(pBlock);
-} 
+    // Raise the high-water mark; a thread that raised it higher meanwhile 
+    // ends the loop
+    do
+    {
+        peak = ATOMIC_Load32(&self->peak);
+        if (peak >= inUse)
+            return;
+    } while (!ATOMIC_CompareExchange32(&self->peak, peak, inUse));
+}
 
 //----------------------------------------------------------------------------
 // ALLOC_Init
 //----------------------------------------------------------------------------
 void ALLOC_Init()
 {
-    _hLock = LK_CREATE();
+    // Allocators are lock-free; nothing to create
 } 
 
 //----------------------------------------------------------------------------
@@ -116,7 +162,6 @@ void ALLOC_Init()
 //----------------------------------------------------------------------------
 void ALLOC_Term()
 {
-    LK_DESTROY(_hLock);
 }
 
 //----------------------------------------------------------------------------
@@ -145,16 +190,14 @@ void* ALLOC_Alloc(ALLOC_HANDLE hAlloc, size_t size)
         pBlock = ALLOC_NewBlock(self);
     }
 
+    // Keep track of usage statistics
     if (pBlock)
     {
-        // Keep track of usage statistics
-        self->allocations++;
-        self->blocksInUse++;
-        if (self->blocksInUse > self->maxBlocksInUse)
-        {
-            self->maxBlocksInUse = self->blocksInUse;
-        }
+        ALLOC_Taken(self, 1);
+        ATOMIC_FetchAdd64(&ALLOC_GetShard(self)->allocations, 1);
     }
+    else
+        ATOMIC_FetchAdd64(&ALLOC_GetShard(self)->failures, 1);
 
     return GET_CLIENT_PTR(pBlock);
 } 
@@ -202,13 +245,112 @@ void ALLOC_Free(ALLOC_HANDLE hAlloc, void* pBlock)
     // Get a pointer to the block
     pBlock = GET_BLOCK_PTR(pBlock);
 
+    // Uncount the block before another thread can take it, so inUse never 
+    // counts a block twice
+    ATOMIC_FetchAdd32(&self->inUse, (UINT32)-1);
+
     // Push the block onto a stack (i.e. the free-list)
-    ALLOC_Push(self, pBlock);
+    ALLOC_Push(self, pBlock, pBlock);
 
     // Keep track of usage statistics
-    self->deallocations++;
-    self->blocksInUse--;
+    ATOMIC_FetchAdd64(&ALLOC_GetShard(self)->deallocations, 1);
 } 
 
+//----------------------------------------------------------------------------
+// ALLOC_AllocBatch
+//----------------------------------------------------------------------------
+UINT32 ALLOC_AllocBatch(ALLOC_HANDLE hAlloc, void** blocks, UINT32 count)
+{
+    ALLOC_Allocator* self = NULL;
+    UINT32 allocated = 0;
+    void* pBlock = NULL;
 
+    ASSERT_TRUE(hAlloc);
+    ASSERT_TRUE(blocks || count == 0);
 
+    self = (ALLOC_Allocator*)hAlloc;
+
+    // Free-list blocks first, then new blocks from the pool
+    while (allocated < count && (pBlock = ALLOC_Pop(self)) != NULL)
+        blocks[allocated++] = GET_CLIENT_PTR(pBlock);
+    while (allocated < count && (pBlock = ALLOC_NewBlock(self)) != NULL)
+        blocks[allocated++] = GET_CLIENT_PTR(pBlock);
+
+    // Keep track of usage statistics
+    if (allocated)
+    {
+        ALLOC_Taken(self, allocated);
+        ATOMIC_FetchAdd64(&ALLOC_GetShard(self)->allocations, allocated);
+    }
+    else if (count)
+        ATOMIC_FetchAdd64(&ALLOC_GetShard(self)->failures, 1);
+
+    return allocated;
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_FreeBatch
+//----------------------------------------------------------------------------
+void ALLOC_FreeBatch(ALLOC_HANDLE hAlloc, void** blocks, UINT32 count)
+{
+    ALLOC_Allocator* self = NULL;
+    UINT32 i, link;
+
+    if (count == 0)
+        return;
+
+    ASSERT_TRUE(hAlloc);
+    ASSERT_TRUE(blocks);
+
+    self = (ALLOC_Allocator*)hAlloc;
+
+    // Chain the blocks, then push the chain onto the free-list at once
+    for (i = 0; i + 1 < count; i++)
+    {
+        link = ALLOC_Link(self, GET_BLOCK_PTR(blocks[i + 1]));
+        memcpy(GET_BLOCK_PTR(blocks[i]), &link, sizeof(link));
+    }
+    ATOMIC_FetchAdd32(&self->inUse, (UINT32)0 - count);     // See ALLOC_Free
+    ALLOC_Push(self, GET_BLOCK_PTR(blocks[0]), GET_BLOCK_PTR(blocks[count - 1]));
+
+    // Keep track of usage statistics
+    ATOMIC_FetchAdd64(&ALLOC_GetShard(self)->deallocations, count);
+}
+
+//----------------------------------------------------------------------------
+// ALLOC_GetStats
+//----------------------------------------------------------------------------
+void ALLOC_GetStats(ALLOC_HANDLE hAlloc, ALLOC_Stats* stats)
+{
+    ALLOC_Allocator* self = NULL;
+    UINT32 i;
+
+    ASSERT_TRUE(hAlloc);
+    ASSERT_TRUE(stats);
+
+    self = (ALLOC_Allocator*)hAlloc;
+
+    memset(stats, 0, sizeof(ALLOC_Stats));
+    stats->name = self->name;
+    stats->blockSize = self->blockSize;
+    stats->maxBlocks = self->maxBlocks;
+
+    // Merge the shards. Deallocations are read before allocations, so a 
+    // block freed meanwhile is never counted as freed but not allocated.
+    for (i = 0; i < ALLOC_STAT_SHARDS; i++)
+        stats->deallocations += (UINT64)ATOMIC_Load64(&self->stats[i].deallocations);
+    for (i = 0; i < ALLOC_STAT_SHARDS; i++)
+    {
+        stats->allocations += (UINT64)ATOMIC_Load64(&self->stats[i].allocations);
+        stats->failures += (UINT64)ATOMIC_Load64(&self->stats[i].failures);
+    }
+    stats->blocksInUse = stats->allocations - stats->deallocations;
+
+    // A block is carved when the free-list looked empty. Another thread may
+    // have freed a block meanwhile, so more blocks may be carved than were
+    // ever in use at once.
+    stats->maxBlocksInUse = ATOMIC_Load32(&self->peak);
+    stats->blocksCarved = ATOMIC_Load32(&self->poolIndex);
+    stats->utilization = self->maxBlocks ? 
+        (UINT32)(stats->maxBlocksInUse * 100 / self->maxBlocks) : 0;
+}
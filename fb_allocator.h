@@ -5,7 +5,24 @@
 //
 // Create an allocator instance using the ALLOC_DEFINE macro. Call 
 // ALLOC_Init() one time at startup. ALLOC_Alloc() allocates a fixed 
-// memory block. ALLOC_Free() frees the block. 
+// memory block. ALLOC_Free() frees the block. ALLOC_Alloc() returns NULL 
+// once all blocks are in use and counts the failure.
+//
+// Allocators are thread-safe without locks. Each allocator keeps its own 
+// free-list, a lock-free stack, and carves unused pool blocks with an 
+// atomic index, so threads using different allocators never contend.
+// ALLOC_AllocBatch() and ALLOC_FreeBatch() move several blocks at once; 
+// a batch free is a single push.
+//
+// Each allocator counts allocations, deallocations and failures in 64-bit
+// counters sharded by thread, so threads update different cache lines.
+// ALLOC_GetStats() merges the shards into an ALLOC_Stats snapshot. Peak use
+// is a high-water mark of the blocks allocated and not freed, raised on
+// every allocation. A block is counted once taken and uncounted before it
+// is freed, so the peak never exceeds the true peak; a pool whose peak
+// stays below maxBlocks is oversized. The number of pool blocks ever carved
+// is reported separately. Concurrent allocations and batch refills can
+// carve blocks that were never all out at once, so it may exceed the peak.
 //
 // #include "fb_allocator.h"
 // ALLOC_DEFINE(myAllocator, 32, 5)
@@ -23,6 +40,7 @@
 
 #include <stdlib.h>
 #include "DataTypes.h"
+#include "Atomic.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -30,10 +48,30 @@ extern "C" {
 
 typedef void* ALLOC_HANDLE;
 
-typedef struct 
+// Usage counter shards per allocator. Threads are spread over the shards.
+#ifndef ALLOC_STAT_SHARDS
+#define ALLOC_STAT_SHARDS   4
+#endif
+
+// Cache line size the usage counter shards are aligned on
+#define ALLOC_CACHE_LINE    64
+
+#ifdef _MSC_VER
+    #define ALLOC_CACHE_ALIGN   __declspec(align(ALLOC_CACHE_LINE))
+    #define ALLOC_UNUSED
+#else
+    #define ALLOC_CACHE_ALIGN   __attribute__((aligned(ALLOC_CACHE_LINE)))
+    #define ALLOC_UNUSED        __attribute__((unused))
+#endif
+
+// Usage counters updated by a share of the threads, one per cache line
+typedef struct
 {
-    void* pNext;
-} ALLOC_Block;
+    ATOMIC64 allocations;
+    ATOMIC64 deallocations;
+    ATOMIC64 failures;
+    char pad[ALLOC_CACHE_LINE - 3 * sizeof(ATOMIC64)];
+} ALLOC_StatShard;
 
 // Use ALLOC_DEFINE to declare an ALLOC_Allocator object
 typedef struct
@@ -43,14 +81,30 @@ typedef struct
     const size_t objectSize;
     const size_t blockSize;
     const UINT32 maxBlocks;
-    ALLOC_Block* pHead;
-    UINT16 poolIndex;
-    UINT16 blocksInUse;
-    UINT16 maxBlocksInUse;
-    UINT16 allocations;
-    UINT16 deallocations;
+    ATOMIC64 head;              // Free-list head, a tagged block index
+    ATOMIC32 poolIndex;         // Blocks carved from the pool
+    ATOMIC32 inUse;             // Blocks allocated and not freed
+    ATOMIC32 peak;              // Highest inUse
+    ATOMIC32 cacheSlot;         // Per-thread cache slot + 1, or 0 (see x_allocator.c)
+    ATOMIC32 cached;            // Free blocks in per-thread caches (see x_allocator.c)
+    ALLOC_CACHE_ALIGN ALLOC_StatShard stats[ALLOC_STAT_SHARDS];
 } ALLOC_Allocator;
 
+// A snapshot of an allocator's usage (see ALLOC_GetStats)
+typedef struct
+{
+    const char* name;
+    size_t blockSize;
+    UINT32 maxBlocks;
+    UINT64 blocksInUse;         // Blocks allocated and not freed
+    UINT64 maxBlocksInUse;      // Peak blocks in use
+    UINT64 blocksCarved;        // Pool blocks ever carved, at least the peak
+    UINT64 allocations;
+    UINT64 deallocations;
+    UINT64 failures;            // Allocations failed with the pool exhausted
+    UINT32 utilization;         // Peak blocks in use, percent of maxBlocks
+} ALLOC_Stats;
+
 // Align fixed blocks on X-byte boundary based on CPU architecture.
 // Set value to 1, 2, 4 or 8.
 #define ALLOC_MEM_ALIGN   (1)
@@ -69,6 +123,8 @@ typedef struct
 
 // Defines block memory, allocator instance and a handle. On the example below, 
 // the ALLOC_Allocator instance is myAllocatorObj and the handle is myAllocator.
+// The handle may go unused, e.g. when only the instance is passed to an 
+// x_allocator.
 // _name_ - the allocator name
 // _size_ - fixed memory block size in bytes
 // _objects_ - number of fixed memory blocks 
@@ -76,14 +132,17 @@ typedef struct
 #define ALLOC_DEFINE(_name_, _size_, _objects_) \
     static char _name_##Memory[ALLOC_BLOCK_SIZE(_size_) * (_objects_)] = { 0 }; \
     static ALLOC_Allocator _name_##Obj = { #_name_, _name_##Memory, _size_, \
-        ALLOC_BLOCK_SIZE(_size_), _objects_, NULL, 0, 0, 0, 0, 0 }; \
-    static ALLOC_HANDLE _name_ = &_name_##Obj;
+        ALLOC_BLOCK_SIZE(_size_), _objects_, 0, 0, 0, 0, 0, 0, { { 0 } } }; \
+    static ALLOC_UNUSED ALLOC_HANDLE _name_ = &_name_##Obj;
 
 void ALLOC_Init(void);
 void ALLOC_Term(void);
 void* ALLOC_Alloc(ALLOC_HANDLE hAlloc, size_t size);
 void* ALLOC_Calloc(ALLOC_HANDLE hAlloc, size_t num, size_t size);
 void ALLOC_Free(ALLOC_HANDLE hAlloc, void* pBlock);
+UINT32 ALLOC_AllocBatch(ALLOC_HANDLE hAlloc, void** blocks, UINT32 count);
+void ALLOC_FreeBatch(ALLOC_HANDLE hAlloc, void** blocks, UINT32 count);
+void ALLOC_GetStats(ALLOC_HANDLE hAlloc, ALLOC_Stats* stats);
 
 #ifdef __cplusplus
 }
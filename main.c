@@ -2,6 +2,10 @@
 #include "StateMachine.h"          // 引入状态机管理头文件
 #include "Motor.h"                 // 引入电机控制头文件
 #include "CentrifugeTest.h"        // 引入离心测试头文件
+#include "ActiveObject.h"          // Active object mode (mailbox and dispatcher thread)
+#include "Timer.h"                 // Timeout and poll events
+#include "Metrics.h"               // State engine performance counters
+#include "Trace.h"                 // State engine transition trace
 
 /*
 *主要功能：
@@ -17,16 +21,22 @@
 // 定义电机对象
 static Motor motorObj1;          // 创建第一个电机对象
 static Motor motorObj2;          // 创建第二个电机对象
+static Motor motorObj3;          // Active object motor
 
 // 定义两个公共电机状态机实例
 SM_DEFINE(Motor1SM, &motorObj1)  // 定义电机1的状态机
-SM_DEFINE(Motor2SM, &motorObj2)  // 定义电机2的状态机
+SM_DEFINE_TYPED(Motor2SM, &motorObj2, Motor)  // Motor 2 also accepts events by ID
+SM_DEFINE(Motor3SM, &motorObj3)  // Motor 3 runs in active object mode
+SM_MAILBOX_DEFINE(Motor3SM, 8)
+SM_MAILBOX_DEFINE(CentrifugeTestSM, 8)  // Centrifuge test receives timer poll events
 
 int main(void)
 {
     ALLOC_Init();                // 初始化自定义内存分配器
 
     MotorData* data;            // 声明一个指向MotorData结构的指针
+    MotorData motorData;        // Event data copied inline by SM_EventCopy/SM_PostCopy
+    UINT32 testCount;           // Centrifuge tests finished before CFG_Start
 
     // 创建事件数据
     data = SM_XAlloc(sizeof(MotorData)); // 从状态机分配内存
@@ -36,9 +46,8 @@ int main(void)
     SM_Event(Motor1SM, MTR_SetSpeed, data); // 发送设置速度的事件
 
     // 调用MTR_SetSpeed事件函数以更改电机速度
-    data = SM_XAlloc(sizeof(MotorData)); // 再次从状态机分配内存
-    data->speed = 200;           // 更新电机速度为200
-    SM_Event(Motor1SM, MTR_SetSpeed, data); // 发送设置新速度的事件
+    motorData.speed = 200;       // 更新电机速度为200
+    SM_EventCopy(Motor1SM, MTR_SetSpeed, &motorData); // Small event data is copied, nothing allocated
 
     // 从Motor1SM获取当前速度
     INT currentSpeed = SM_Get(Motor1SM, MTR_GetSpeed); // 获取当前速度
@@ -50,13 +59,38 @@ int main(void)
     data = SM_XAlloc(sizeof(MotorData)); // 为电机2分配内存
     data->speed = 300;            // 设置电机2的速度为300
     SM_Event(Motor2SM, MTR_SetSpeed, data); // 发送设置电机2速度的事件
-    SM_Event(Motor2SM, MTR_Halt, NULL); // 发送停止电机2的事件
+    SM_DispatchById(Motor2SM, MTR_HALT_EVENT, NULL); // Halt by event ID
+
+    // Motor3SM active object example. Events execute on the dispatcher thread.
+    SM_ActiveStart(Motor3SM);
+    motorData.speed = 400;
+    SM_PostCopy(Motor3SM, MTR_SetSpeed, &motorData);
+    SM_Post(Motor3SM, MTR_Halt, NULL);
+    SM_ActiveStop(Motor3SM);
 
     // 离心测试状态机的示例
-    SM_Event(CentrifugeTestSM, CFG_Cancel, NULL); // 发送取消配置的事件
-    SM_Event(CentrifugeTestSM, CFG_Start, NULL); // 发送启动配置的事件
-    while (CFG_IsPollActive()) // 当配置轮询仍然处于活动状态时
-        SM_Event(CentrifugeTestSM, CFG_Poll, NULL); // 发送轮询事件
+    TMR_Init();                  // Timer thread generates the CFG_Poll events
+    SM_ActiveStart(CentrifugeTestSM);
+    SM_Post(CentrifugeTestSM, CFG_Cancel, NULL); // 发送取消配置的事件
+    testCount = CFG_GetTestCount();
+    SM_Post(CentrifugeTestSM, CFG_Start, NULL); // 发送启动配置的事件
+    while (CFG_GetTestCount() == testCount) // Wait for the test to finish
+        TH_Sleep(10);
+    SM_ActiveStop(CentrifugeTestSM);
+    TMR_Term();
+
+#ifdef USE_SM_METRICS
+    MET_Export(stdout);          // Per state counters and latency histograms
+#endif
+
+#ifdef USE_SM_TRACE
+    FILE* traceFile = fopen("sm.trace", "wb");  // Decode with tools/trace_decode
+    if (traceFile)
+    {
+        TRC_Dump(traceFile);
+        fclose(traceFile);
+    }
+#endif
 
     ALLOC_Term();              // 终止自定义内存分配器
 
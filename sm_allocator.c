@@ -1,36 +1,55 @@
 // 包含特定的头文件，这些是内存分配器的相关定义和操作函数
-// SMALLOC allocates either a 32 or 128 byte block depending 
-// on the requested size. 
+// SMALLOC allocates a block from the smallest of a dozen size classes, 
+// 8 to 256 bytes, that holds the requested size. Classes are finer for the 
+// small sizes most event data uses, to limit wasted bytes per block.
 
 #include "sm_allocator.h"
 #include "x_allocator.h"
 
-// Maximum number of blocks for each size
-// 定义两种内存块的最大数量
-#define MAX_32_BLOCKS   10
-#define MAX_128_BLOCKS	5
+// Maximum number of blocks for each size. Pools of 16 blocks or more are
+// cached per thread by x_allocator.
+#define MAX_SMALL_BLOCKS    64      // 8 to 64 bytes
+#define MAX_MEDIUM_BLOCKS   32      // 80 to 128 bytes
+#define MAX_LARGE_BLOCKS    16      // 192 and 256 bytes
 
 // Define size of each block including meta data overhead
-// 定义每种内存块的大小，包括元数据的开销
-#define BLOCK_32_SIZE     32 + XALLOC_BLOCK_META_DATA_SIZE
-#define BLOCK_128_SIZE    128 + XALLOC_BLOCK_META_DATA_SIZE
+#define BLOCK_SIZE(_size_)  ((_size_) + XALLOC_BLOCK_META_DATA_SIZE)
 
 // Define individual fb_allocators
-// 定义两种不同大小的内存分配器对象
-ALLOC_DEFINE(smDataAllocator32, BLOCK_32_SIZE, MAX_32_BLOCKS)
-ALLOC_DEFINE(smDataAllocator128, BLOCK_128_SIZE, MAX_128_BLOCKS)
+ALLOC_DEFINE(smDataAllocator8, BLOCK_SIZE(8), MAX_SMALL_BLOCKS)
+ALLOC_DEFINE(smDataAllocator16, BLOCK_SIZE(16), MAX_SMALL_BLOCKS)
+ALLOC_DEFINE(smDataAllocator24, BLOCK_SIZE(24), MAX_SMALL_BLOCKS)
+ALLOC_DEFINE(smDataAllocator32, BLOCK_SIZE(32), MAX_SMALL_BLOCKS)
+ALLOC_DEFINE(smDataAllocator40, BLOCK_SIZE(40), MAX_SMALL_BLOCKS)
+ALLOC_DEFINE(smDataAllocator48, BLOCK_SIZE(48), MAX_SMALL_BLOCKS)
+ALLOC_DEFINE(smDataAllocator64, BLOCK_SIZE(64), MAX_SMALL_BLOCKS)
+ALLOC_DEFINE(smDataAllocator80, BLOCK_SIZE(80), MAX_MEDIUM_BLOCKS)
+ALLOC_DEFINE(smDataAllocator96, BLOCK_SIZE(96), MAX_MEDIUM_BLOCKS)
+ALLOC_DEFINE(smDataAllocator128, BLOCK_SIZE(128), MAX_MEDIUM_BLOCKS)
+ALLOC_DEFINE(smDataAllocator192, BLOCK_SIZE(192), MAX_LARGE_BLOCKS)
+ALLOC_DEFINE(smDataAllocator256, BLOCK_SIZE(256), MAX_LARGE_BLOCKS)
 
 /// 内存分配器数组，先由小到大排列
 static ALLOC_Allocator* allocators[] = {
+    &smDataAllocator8Obj,
+    &smDataAllocator16Obj,
+    &smDataAllocator24Obj,
     &smDataAllocator32Obj,
-    &smDataAllocator128Obj
+    &smDataAllocator40Obj,
+    &smDataAllocator48Obj,
+    &smDataAllocator64Obj,
+    &smDataAllocator80Obj,
+    &smDataAllocator96Obj,
+    &smDataAllocator128Obj,
+    &smDataAllocator192Obj,
+    &smDataAllocator256Obj
 };
 
 // 计算内存分配器的数量
 #define MAX_ALLOCATORS   (sizeof(allocators) / sizeof(allocators[0]))
 
 // 构建一个XAllocData结构体，存储分配器数组和其数量，用于管理所有的内存分配器
-static XAllocData self = { allocators, MAX_ALLOCATORS };
+static XAllocData self = { allocators, MAX_ALLOCATORS, TRUE };
 
 //----------------------------------------------------------------------------
 // SMALLOC_Alloc
@@ -70,4 +89,14 @@ void* SMALLOC_Calloc(size_t num, size_t size)
 {
     // 调用 XALLOC_Calloc来分配特定数量和大小的内存块，并初始化为零
     return XALLOC_Calloc(&self, num, size);
-}
\ No newline at end of file
+}
+
+//----------------------------------------------------------------------------
+// SMALLOC_GetStats
+//----------------------------------------------------------------------------
+unsigned int SMALLOC_GetStats(ALLOC_Stats* stats, unsigned int maxStats)
+{
+    if (maxStats > MAX_ALLOCATORS)
+        maxStats = MAX_ALLOCATORS;
+    return XALLOC_GetStats(&self, stats, (UINT16)maxStats);
+}
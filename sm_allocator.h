@@ -20,6 +20,7 @@ SMALLOC_Calloc(size_t num, size_t size)
 #define _SM_ALLOCATOR_H
 
 #include <stddef.h>  // 包含标准定义，如 size_t
+#include "fb_allocator.h"
 
 // 当使用 C++ 时，确保这些函数以 C 语言的形式被声明
 #ifdef __cplusplus
@@ -38,6 +39,10 @@ void* SMALLOC_Realloc(void *ptr, size_t new_size);
 // 分配一个数组，每个元素的大小为 size，并初始化为 0
 void* SMALLOC_Calloc(size_t num, size_t size);
 
+// Allocator diagnostics: a usage snapshot of up to maxStats size classes
+// behind SMALLOC, smallest block first. Returns the snapshots written.
+unsigned int SMALLOC_GetStats(ALLOC_Stats* stats, unsigned int maxStats);
+
 // 如果使用 C++，这会结束 extern "C" 块
 #ifdef __cplusplus
 }
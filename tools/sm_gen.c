@@ -0,0 +1,522 @@
+// State machine generator. Reads a declarative machine description and
+// writes the tables otherwise written by hand with STATE_DECLARE,
+// BEGIN_TRANSITION_MATRIX and BEGIN_STATE_MAP(_EX), the event functions,
+// and a state engine that calls the state, guard, entry and exit functions
+// through switch statements instead of the state map's function pointers.
+//
+// gcc -O2 sm_gen.c -o sm_gen
+// sm_gen Motor.sm Motor
+//
+// writes Motor_sm.h, the event IDs and event declarations for the public
+// header, and Motor_sm.inc, included once by Motor.c ahead of its state
+// function definitions.
+//
+// Description format, one declaration per line, # starts a comment:
+//
+//   machine Motor                  state machine type name
+//   events MTR                     event ID prefix, e.g. MTR_SET_SPEED_EVENT
+//   state Idle NoEventData         state, its event data type and optional
+//   state Start MotorData guard entry exit     guard, entry and exit actions
+//   event MTR_SetSpeed MotorData   external event function and event data type
+//       Idle -> Start              transition of the preceding event
+//       Stop -> CANNOT_HAPPEN
+//       * -> Failed                every state not listed for the event
+//
+// States appear in the state enum in declaration order; the first state is
+// the initial state. A state not listed for an event ignores it
+// (EVENT_IGNORED).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define GEN_MAX_STATES      253         // Below EVENT_IGNORED and CANNOT_HAPPEN
+#define GEN_MAX_EVENTS      255
+#define GEN_MAX_NAME        64
+#define GEN_MAX_TOKENS      8
+
+#define GEN_IGNORED         0xFE
+#define GEN_CANNOT_HAPPEN   0xFF
+
+enum { GEN_GUARD = 1, GEN_ENTRY = 2, GEN_EXIT = 4 };
+
+typedef struct
+{
+    char name[GEN_MAX_NAME];
+    char data[GEN_MAX_NAME];
+    char id[GEN_MAX_NAME + 4];          // ST_ enum name
+    int actions;
+} GenState;
+
+typedef struct
+{
+    char func[GEN_MAX_NAME];
+    char data[GEN_MAX_NAME];
+    char id[GEN_MAX_NAME + 16];         // Event ID enum name
+    int line;
+} GenEvent;
+
+typedef struct
+{
+    int event;
+    char from[GEN_MAX_NAME];
+    char to[GEN_MAX_NAME];
+    int line;
+} GenTransition;
+
+static const char* _path;
+static const char* _file;              // _path without directories
+static char _machine[GEN_MAX_NAME];
+static char _prefix[GEN_MAX_NAME];
+static GenState _states[GEN_MAX_STATES];
+static int _stateCount;
+static GenEvent _events[GEN_MAX_EVENTS];
+static int _eventCount;
+static GenTransition* _transitions;
+static int _transitionCount;
+static unsigned char _matrix[GEN_MAX_EVENTS][GEN_MAX_STATES];
+static int _actions;                    // Union of all state actions
+
+static void Fail(int line, const char* message, const char* name)
+{
+    fprintf(stderr, "%s:%d: %s%s%s\n", _path, line, message, name ? " " : "", name ? name : "");
+    exit(1);
+}
+
+// CamelCase to UPPER_SNAKE, e.g. WaitForAcceleration to WAIT_FOR_ACCELERATION
+static void UpperSnake(char* out, const char* in)
+{
+    size_t i, n = 0;
+
+    for (i = 0; in[i]; i++)
+    {
+        if (i > 0 && isupper((unsigned char)in[i]) && in[i - 1] != '_' &&
+            (islower((unsigned char)in[i - 1]) || isdigit((unsigned char)in[i - 1]) ||
+            (in[i + 1] && islower((unsigned char)in[i + 1]))))
+            out[n++] = '_';
+        out[n++] = (char)toupper((unsigned char)in[i]);
+    }
+    out[n] = 0;
+}
+
+static const char* BaseName(const char* path)
+{
+    const char* p = strrchr(path, '/');
+    const char* q = strrchr(path, '\\');
+    if (q > p)
+        p = q;
+    return p ? p + 1 : path;
+}
+
+static int FindState(const char* name)
+{
+    int i;
+    for (i = 0; i < _stateCount; i++)
+    {
+        if (strcmp(_states[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+static void CopyName(char* out, const char* in, int line)
+{
+    size_t i;
+
+    if (strlen(in) >= GEN_MAX_NAME)
+        Fail(line, "name too long:", in);
+    for (i = 0; in[i]; i++)
+    {
+        if (!isalnum((unsigned char)in[i]) && in[i] != '_')
+            Fail(line, "not an identifier:", in);
+    }
+    strcpy(out, in);
+}
+
+static void Parse(FILE* fp)
+{
+    char text[1024];
+    char* tokens[GEN_MAX_TOKENS];
+    int line = 0, count, i, capacity = 0;
+
+    while (fgets(text, sizeof(text), fp))
+    {
+        char* p = strchr(text, '#');
+        line++;
+        if (p)
+            *p = 0;
+
+        count = 0;
+        for (p = strtok(text, " \t\r\n"); p && count < GEN_MAX_TOKENS; p = strtok(NULL, " \t\r\n"))
+            tokens[count++] = p;
+        if (count == 0)
+            continue;
+
+        if (strcmp(tokens[0], "machine") == 0 && count == 2)
+            CopyName(_machine, tokens[1], line);
+        else if (strcmp(tokens[0], "events") == 0 && count == 2)
+            CopyName(_prefix, tokens[1], line);
+        else if (strcmp(tokens[0], "state") == 0 && count >= 3)
+        {
+            GenState* state = &_states[_stateCount];
+
+            if (_stateCount == GEN_MAX_STATES)
+                Fail(line, "too many states", NULL);
+            CopyName(state->name, tokens[1], line);
+            CopyName(state->data, tokens[2], line);
+            if (FindState(state->name) >= 0)
+                Fail(line, "duplicate state", state->name);
+            for (i = 3; i < count; i++)
+            {
+                if (strcmp(tokens[i], "guard") == 0) state->actions |= GEN_GUARD;
+                else if (strcmp(tokens[i], "entry") == 0) state->actions |= GEN_ENTRY;
+                else if (strcmp(tokens[i], "exit") == 0) state->actions |= GEN_EXIT;
+                else Fail(line, "unknown state action", tokens[i]);
+            }
+            strcpy(state->id, "ST_");
+            UpperSnake(state->id + 3, state->name);
+            _actions |= state->actions;
+            _stateCount++;
+        }
+        else if (strcmp(tokens[0], "event") == 0 && count == 3)
+        {
+            GenEvent* event = &_events[_eventCount];
+            const char* name = tokens[1];
+            size_t prefixLen = strlen(_prefix);
+
+            if (_eventCount == GEN_MAX_EVENTS)
+                Fail(line, "too many events", NULL);
+            if (_prefix[0] == 0)
+                Fail(line, "events prefix must precede the first event", NULL);
+            CopyName(event->func, tokens[1], line);
+            CopyName(event->data, tokens[2], line);
+            for (i = 0; i < _eventCount; i++)
+            {
+                if (strcmp(_events[i].func, event->func) == 0)
+                    Fail(line, "duplicate event", event->func);
+            }
+
+            // MTR_SetSpeed becomes MTR_SET_SPEED_EVENT
+            if (strncmp(name, _prefix, prefixLen) == 0 && name[prefixLen] == '_')
+                name += prefixLen + 1;
+            strcpy(event->id, _prefix);
+            strcat(event->id, "_");
+            UpperSnake(event->id + strlen(event->id), name);
+            strcat(event->id, "_EVENT");
+            event->line = line;
+            _eventCount++;
+        }
+        else if (count == 3 && strcmp(tokens[1], "->") == 0)
+        {
+            GenTransition* t;
+
+            if (_eventCount == 0)
+                Fail(line, "transition outside an event", NULL);
+            if (_transitionCount == capacity)
+            {
+                capacity = capacity ? capacity * 2 : 256;
+                _transitions = (GenTransition*)realloc(_transitions, capacity * sizeof(GenTransition));
+                if (_transitions == NULL)
+                    Fail(line, "out of memory", NULL);
+            }
+            t = &_transitions[_transitionCount++];
+            t->event = _eventCount - 1;
+            if (strcmp(tokens[0], "*") == 0)
+                strcpy(t->from, "*");
+            else
+                CopyName(t->from, tokens[0], line);
+            CopyName(t->to, tokens[2], line);
+            t->line = line;
+        }
+        else
+            Fail(line, "cannot parse", tokens[0]);
+    }
+
+    if (_machine[0] == 0)
+        Fail(line, "missing machine", NULL);
+    if (_stateCount == 0)
+        Fail(line, "no states", NULL);
+}
+
+// Fills the [event][state] matrix. Explicit transitions win over "*".
+static void Resolve(void)
+{
+    unsigned char set[GEN_MAX_EVENTS][GEN_MAX_STATES];
+    int pass, i, s;
+
+    memset(_matrix, GEN_IGNORED, sizeof(_matrix));
+    memset(set, 0, sizeof(set));
+
+    for (pass = 0; pass < 2; pass++)
+    {
+        for (i = 0; i < _transitionCount; i++)
+        {
+            const GenTransition* t = &_transitions[i];
+            int wildcard = strcmp(t->from, "*") == 0;
+            int from = wildcard ? -1 : FindState(t->from);
+            int to;
+
+            if (wildcard != (pass == 1))
+                continue;
+            if (!wildcard && from < 0)
+                Fail(t->line, "unknown state", t->from);
+
+            if (strcmp(t->to, "CANNOT_HAPPEN") == 0)
+                to = GEN_CANNOT_HAPPEN;
+            else if (strcmp(t->to, "EVENT_IGNORED") == 0)
+                to = GEN_IGNORED;
+            else if ((to = FindState(t->to)) < 0)
+                Fail(t->line, "unknown state", t->to);
+
+            if (!wildcard)
+            {
+                if (set[t->event][from] == 1)
+                    Fail(t->line, "duplicate transition from", t->from);
+                _matrix[t->event][from] = (unsigned char)to;
+                set[t->event][from] = 1;
+                continue;
+            }
+
+            for (s = 0; s < _stateCount; s++)
+            {
+                if (set[t->event][s] == 2)
+                    Fail(t->line, "duplicate * transition", NULL);
+                if (set[t->event][s] == 0)
+                {
+                    _matrix[t->event][s] = (unsigned char)to;
+                    set[t->event][s] = 2;
+                }
+            }
+        }
+    }
+}
+
+static const char* Target(int to)
+{
+    if (to == GEN_IGNORED)
+        return "EVENT_IGNORED";
+    if (to == GEN_CANNOT_HAPPEN)
+        return "CANNOT_HAPPEN";
+    return _states[to].id;
+}
+
+static void WriteHeader(FILE* fp, const char* base)
+{
+    char guard[GEN_MAX_NAME * 2];
+    int i;
+
+    UpperSnake(guard, BaseName(base));
+    fprintf(fp, "// Generated by sm_gen from %s. Do not edit.\n\n", _file);
+    fprintf(fp, "#ifndef _%s_SM_H\n#define _%s_SM_H\n\n", guard, guard);
+    fprintf(fp, "#include \"StateMachine.h\"\n\n");
+
+    fprintf(fp, "// %s event IDs, the rows of the transition matrix (SM_DispatchById)\n", _machine);
+    fprintf(fp, "enum %sEvents\n{\n", _machine);
+    for (i = 0; i < _eventCount; i++)
+        fprintf(fp, "    %s,\n", _events[i].id);
+    fprintf(fp, "    %s_MAX_EVENTS\n};\n\n", _prefix);
+
+    fprintf(fp, "// %s state machine type, for SM_DEFINE_TYPED\n", _machine);
+    fprintf(fp, "SM_CONST_DECLARE(%s)\n\n", _machine);
+
+    for (i = 0; i < _eventCount; i++)
+        fprintf(fp, "EVENT_DECLARE(%s, %s)\n", _events[i].func, _events[i].data);
+
+    fprintf(fp, "\n#endif // _%s_SM_H\n", guard);
+}
+
+static void WriteEngine(FILE* fp)
+{
+    int i;
+
+    fprintf(fp, "// Generated state engine. Executes as _SM_StateEngine%s with the state\n", _actions ? "Ex" : "");
+    fprintf(fp, "// functions called directly. Builds with engine hooks use the generic engine.\n");
+    fprintf(fp, "#if defined(USE_SM_METRICS) || defined(USE_SM_TRACE) || defined(USE_SM_RECORD)\n");
+    fprintf(fp, "    #define %sEngine NULL\n#else\n", _machine);
+    fprintf(fp, "static void %sEngine(SM_StateMachine* self, const SM_StateMachineConst* selfConst)\n{\n", _machine);
+    fprintf(fp, "    void* pDataTemp = NULL;\n");
+    if (_actions & GEN_GUARD)
+        fprintf(fp, "    BOOL guardResult = TRUE;\n");
+    fprintf(fp, "\n    (void)selfConst;\n\n");
+    fprintf(fp, "    while (self->eventGenerated) {\n");
+    fprintf(fp, "        ASSERT_TRUE(self->newState < ST_MAX_STATES);\n\n");
+    fprintf(fp, "        pDataTemp = self->pEventData;\n");
+    fprintf(fp, "        self->pEventData = NULL;\n");
+    fprintf(fp, "        self->eventGenerated = FALSE;\n\n");
+
+    if (_actions & GEN_GUARD)
+    {
+        fprintf(fp, "        switch (self->newState) {\n");
+        for (i = 0; i < _stateCount; i++)
+        {
+            if (_states[i].actions & GEN_GUARD)
+                fprintf(fp, "            case %s: guardResult = GD_%s(self, pDataTemp); break;\n", _states[i].id, _states[i].name);
+        }
+        fprintf(fp, "            default: guardResult = TRUE; break;\n        }\n\n");
+        fprintf(fp, "        if (guardResult == TRUE) {\n");
+    }
+    else
+        fprintf(fp, "        {\n");
+
+    if (_actions & (GEN_ENTRY | GEN_EXIT))
+    {
+        fprintf(fp, "            if (self->newState != self->currentState) {\n");
+        if (_actions & GEN_EXIT)
+        {
+            fprintf(fp, "                switch (self->currentState) {\n");
+            for (i = 0; i < _stateCount; i++)
+            {
+                if (_states[i].actions & GEN_EXIT)
+                    fprintf(fp, "                    case %s: EX_%s(self); break;\n", _states[i].id, _states[i].name);
+            }
+            fprintf(fp, "                    default: break;\n                }\n");
+        }
+        if (_actions & GEN_ENTRY)
+        {
+            fprintf(fp, "                switch (self->newState) {\n");
+            for (i = 0; i < _stateCount; i++)
+            {
+                if (_states[i].actions & GEN_ENTRY)
+                    fprintf(fp, "                    case %s: EN_%s(self, pDataTemp); break;\n", _states[i].id, _states[i].name);
+            }
+            fprintf(fp, "                    default: break;\n                }\n");
+        }
+        fprintf(fp, "                ASSERT_TRUE(self->eventGenerated == FALSE);\n            }\n\n");
+    }
+
+    fprintf(fp, "            self->currentState = self->newState;\n\n");
+    fprintf(fp, "            switch (self->currentState) {\n");
+    for (i = 0; i < _stateCount; i++)
+        fprintf(fp, "                case %s: ST_%s(self, pDataTemp); break;\n", _states[i].id, _states[i].name);
+    fprintf(fp, "                default: break;\n            }\n        }\n\n");
+
+    fprintf(fp, "        if (pDataTemp) {\n");
+    fprintf(fp, "            _SM_FreeEventData(self, pDataTemp);\n");
+    fprintf(fp, "            pDataTemp = NULL;\n        }\n    }\n}\n#endif\n\n");
+}
+
+static void WriteTables(FILE* fp)
+{
+    int i, e;
+
+    fprintf(fp, "// Generated by sm_gen from %s. Do not edit.\n", _file);
+    fprintf(fp, "// Included once by the %s source file, ahead of the state function definitions.\n\n", _machine);
+
+    fprintf(fp, "// States, in state map order\nenum %sStates\n{\n", _machine);
+    for (i = 0; i < _stateCount; i++)
+        fprintf(fp, "    %s,\n", _states[i].id);
+    fprintf(fp, "    ST_MAX_STATES\n};\n\n");
+
+    for (i = 0; i < _stateCount; i++)
+    {
+        fprintf(fp, "STATE_DECLARE(%s, %s)\n", _states[i].name, _states[i].data);
+        if (_states[i].actions & GEN_GUARD)
+            fprintf(fp, "GUARD_DECLARE(%s, %s)\n", _states[i].name, _states[i].data);
+        if (_states[i].actions & GEN_ENTRY)
+            fprintf(fp, "ENTRY_DECLARE(%s, %s)\n", _states[i].name, _states[i].data);
+        if (_states[i].actions & GEN_EXIT)
+            fprintf(fp, "EXIT_DECLARE(%s)\n", _states[i].name);
+    }
+
+    fprintf(fp, "\n// Transition matrix, one row per event ID\n");
+    fprintf(fp, "BEGIN_TRANSITION_MATRIX(%s, ST_MAX_STATES)\n", _machine);
+    for (e = 0; e < _eventCount; e++)
+    {
+        fprintf(fp, "    BEGIN_TRANSITION_ROW(%s)\n", _events[e].id);
+        for (i = 0; i < _stateCount; i++)
+        {
+            char entry[GEN_MAX_NAME * 2];
+            snprintf(entry, sizeof(entry), "TRANSITION_MAP_ENTRY(%s)", Target(_matrix[e][i]));
+            fprintf(fp, "        %-48s// %s\n", entry, _states[i].id);
+        }
+        fprintf(fp, "    END_TRANSITION_ROW\n");
+    }
+    fprintf(fp, "END_TRANSITION_MATRIX\n\n");
+
+    fprintf(fp, "BEGIN_STATE_MAP%s(%s)\n", _actions ? "_EX" : "", _machine);
+    for (i = 0; i < _stateCount; i++)
+    {
+        const GenState* s = &_states[i];
+        char guard[GEN_MAX_NAME + 4] = "0", entry[GEN_MAX_NAME + 4] = "0", exit[GEN_MAX_NAME + 4] = "0";
+
+        if (!_actions)
+            fprintf(fp, "    STATE_MAP_ENTRY(ST_%s)\n", s->name);
+        else if (!s->actions)
+            fprintf(fp, "    STATE_MAP_ENTRY_EX(ST_%s)\n", s->name);
+        else
+        {
+            if (s->actions & GEN_GUARD)
+                strcat(strcpy(guard, "GD_"), s->name);
+            if (s->actions & GEN_ENTRY)
+                strcat(strcpy(entry, "EN_"), s->name);
+            if (s->actions & GEN_EXIT)
+                strcat(strcpy(exit, "EX_"), s->name);
+            fprintf(fp, "    STATE_MAP_ENTRY_ALL_EX(ST_%s, %s, %s, %s)\n", s->name, guard, entry, exit);
+        }
+    }
+    fprintf(fp, "};\n");
+    fprintf(fp, "SM_MATRIX_ROW_CHECK(%s)\n\n", _machine);
+
+    WriteEngine(fp);
+
+    fprintf(fp, "const SM_StateMachineConst %sConst = { \"%s\", ST_MAX_STATES,\n", _machine, _machine);
+    if (_actions)
+        fprintf(fp, "    NULL, %sStateMap, ", _machine);
+    else
+        fprintf(fp, "    %sStateMap, NULL, ", _machine);
+    fprintf(fp, "%sMatrix[0], %s_MAX_EVENTS, %sEngine };\n\n", _machine, _prefix, _machine);
+
+    for (e = 0; e < _eventCount; e++)
+    {
+        fprintf(fp, "EVENT_DEFINE(%s, %s)\n{\n", _events[e].func, _events[e].data);
+        fprintf(fp, "    TRANSITION_MATRIX_EVENT(%s, %s, pEventData)\n}\n\n", _machine, _events[e].id);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    char path[512];
+    FILE* fp;
+
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s <description.sm> <output base name>\n", argv[0]);
+        return 1;
+    }
+
+    _path = argv[1];
+    _file = BaseName(_path);
+    fp = fopen(_path, "r");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "cannot open %s\n", _path);
+        return 1;
+    }
+    Parse(fp);
+    fclose(fp);
+    Resolve();
+
+    snprintf(path, sizeof(path), "%s_sm.h", argv[2]);
+    fp = fopen(path, "w");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "cannot create %s\n", path);
+        return 1;
+    }
+    WriteHeader(fp, argv[2]);
+    fclose(fp);
+
+    snprintf(path, sizeof(path), "%s_sm.inc", argv[2]);
+    fp = fopen(path, "w");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "cannot create %s\n", path);
+        return 1;
+    }
+    WriteTables(fp);
+    fclose(fp);
+
+    printf("%s: %d states, %d events, %d transitions\n", _machine, _stateCount, _eventCount, _transitionCount);
+    return 0;
+}
@@ -0,0 +1,119 @@
+// Decodes a TRC_Dump() file (see Trace.h) into a readable timeline. The
+// per-thread rings are merged and sorted by timestamp; times are printed in
+// microseconds relative to the oldest record.
+//
+// gcc -O2 -I.. trace_decode.c -o trace_decode
+// trace_decode sm.trace [machine name]
+
+#include "Trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char* guardNames[] = { "", " guard pass", " guard FAIL" };
+
+static TRC_FileName* names;
+static UINT32 nameCount;
+
+static int CompareRecords(const void* a, const void* b)
+{
+    const TRC_Record* ra = (const TRC_Record*)a;
+    const TRC_Record* rb = (const TRC_Record*)b;
+
+    if (ra->timestamp != rb->timestamp)
+        return ra->timestamp < rb->timestamp ? -1 : 1;
+    return 0;
+}
+
+static const char* FindName(UINT64 name)
+{
+    UINT32 i;
+    for (i=0; i<nameCount; i++)
+    {
+        if (names[i].name == name)
+            return names[i].text;
+    }
+    return "?";
+}
+
+int main(int argc, char* argv[])
+{
+    TRC_FileHeader header;
+    TRC_Record* records = NULL;
+    const char* filter = NULL;
+    char event[16];
+    UINT32 i, count = 0, threads = 0;
+    FILE* fp;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <trace file> [machine name]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2)
+        filter = argv[2];
+
+    fp = fopen(argv[1], "rb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "cannot open %s\n", argv[1]);
+        return 1;
+    }
+
+    if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != TRC_FILE_MAGIC ||
+        header.version != TRC_FILE_VERSION || header.recordSize != sizeof(TRC_Record))
+    {
+        fprintf(stderr, "%s is not a version %d trace dump\n", argv[1], TRC_FILE_VERSION);
+        fclose(fp);
+        return 1;
+    }
+
+    names = (TRC_FileName*)calloc(header.nameCount + 1, sizeof(TRC_FileName));
+    records = (TRC_Record*)calloc(header.recordCount + 1, sizeof(TRC_Record));
+    if (names == NULL || records == NULL ||
+        fread(names, sizeof(TRC_FileName), header.nameCount, fp) != header.nameCount ||
+        fread(records, sizeof(TRC_Record), header.recordCount, fp) != header.recordCount)
+    {
+        fprintf(stderr, "%s is truncated\n", argv[1]);
+        fclose(fp);
+        return 1;
+    }
+    fclose(fp);
+    nameCount = header.nameCount;
+
+    // Drop padding records and records of other machines
+    for (i=0; i<header.recordCount; i++)
+    {
+        if (records[i].machine == 0)
+            continue;
+        if (filter && strcmp(filter, FindName(records[i].name)) != 0)
+            continue;
+        if (records[i].thread >= threads)
+            threads = records[i].thread + 1;
+        records[count++] = records[i];
+    }
+
+    qsort(records, count, sizeof(TRC_Record), CompareRecords);
+
+    printf("%u transitions, %u threads\n", count, threads);
+    for (i=0; i<count; i++)
+    {
+        const TRC_Record* r = &records[i];
+
+        if (r->eventId == TRC_EVENT_INTERNAL)
+            strcpy(event, "internal");
+        else if (r->eventId == TRC_EVENT_NONE)
+            strcpy(event, "external");
+        else
+            sprintf(event, "event %u", r->eventId);
+
+        printf("%14.3f us  T%-3u %-20s %3u -> %-3u %s%s\n",
+            (double)(r->timestamp - records[0].timestamp) / 1000.0,
+            r->thread, FindName(r->name), r->oldState, r->newState, event,
+            r->guard <= TRC_GUARD_FAIL ? guardNames[r->guard] : " guard ?");
+    }
+
+    free(records);
+    free(names);
+    return 0;
+}
@@ -2,11 +2,41 @@
 #include "fb_allocator.h"
 #include "DataTypes.h"
 #include "Fault.h"
+#include "Thread.h"
 #include <string.h>
 
+// The free blocks one thread caches for one allocator (see XAllocData::cache)
+typedef struct
+{
+    ALLOC_Allocator* allocator;
+    UINT32 capacity;                // 0 until first used by the thread
+    UINT32 count;
+    UINT32 reserved;                // Share of ALLOC_Allocator::cached, >= count
+    void* blocks[XALLOC_MAGAZINE_SIZE];
+} XALLOC_Magazine;
+
+// Each cached allocator owns one magazine slot in every thread
+static TH_THREAD_LOCAL XALLOC_Magazine _magazines[XALLOC_CACHE_SLOTS];
+static TH_THREAD_LOCAL BOOL _cacheRegistered;
+static TH_THREAD_LOCAL BOOL _cacheClosed;
+static ATOMIC32 _cacheSlots;
+
+// ALLOC_Allocator::cacheSlot of an allocator not cached
+#define XALLOC_NO_CACHE     0xFFFFFFFF
+
+// XAllocData::lookupState
+enum { XALLOC_LOOKUP_NONE, XALLOC_LOOKUP_BUILDING, XALLOC_LOOKUP_READY };
+
 static void* XALLOC_PutAllocatorPtrInBlock(void* block, ALLOC_Allocator* allocator);
 static ALLOC_Allocator* XALLOC_GetAllocatorPtrFromBlock(void* block);
 static ALLOC_Allocator* XALLOC_GetAllocator(XAllocData* self, size_t size);
+static BOOL XALLOC_BuildLookup(XAllocData* self);
+static UINT32 XALLOC_AssignSlot(ALLOC_Allocator* allocator);
+static XALLOC_Magazine* XALLOC_GetMagazine(ALLOC_Allocator* allocator, BOOL assign);
+static BOOL XALLOC_Reserve(XALLOC_Magazine* magazine, UINT32 count);
+static void XALLOC_Release(XALLOC_Magazine* magazine, UINT32 keep);
+static void XALLOC_Flush(XALLOC_Magazine* magazine, UINT32 count);
+static void XALLOC_ThreadExit(void* arg);
 
 //----------------------------------------------------------------------------
 // XALLOC_PutAllocatorPtrInBlock
@@ -64,12 +94,41 @@ static void* XALLOC_GetBlockPtr(void* block)
     return --pAllocatorInBlock;
 }
 
+//----------------------------------------------------------------------------
+// XALLOC_BuildLookup
+//----------------------------------------------------------------------------
+static BOOL XALLOC_BuildLookup(XAllocData* self)
+{
+    UINT32 entry;
+    UINT16 i = 0;
+
+    // Only one thread builds the table; others search until it is ready
+    if (!ATOMIC_CompareExchange32(&self->lookupState, XALLOC_LOOKUP_NONE, XALLOC_LOOKUP_BUILDING))
+        return FALSE;
+
+    // Entries hold an allocator index
+    ASSERT_TRUE(self->maxAllocators <= 0xFF);
+
+    for (entry = 0; entry < XALLOC_LOOKUP_ENTRIES; entry++)
+    {
+        // Skip allocators too small for every size within the granule
+        while (i < self->maxAllocators && (!self->allocators[i] || 
+            self->allocators[i]->blockSize + XALLOC_LOOKUP_GRANULE <= entry * XALLOC_LOOKUP_GRANULE))
+            i++;
+        self->lookup[entry] = (UINT8)i;
+    }
+
+    ATOMIC_Store32(&self->lookupState, XALLOC_LOOKUP_READY);
+    return TRUE;
+}
+
 //----------------------------------------------------------------------------
 // XALLOC_GetAllocator
 //----------------------------------------------------------------------------
 static ALLOC_Allocator* XALLOC_GetAllocator(XAllocData* self, size_t size)
 {
     UINT16 i = 0;
+    size_t entry;
     ALLOC_Allocator* pAllocator = NULL;
 
     ASSERT_TRUE(self);
@@ -78,8 +137,18 @@ static ALLOC_Allocator* XALLOC_GetAllocator(XAllocData* self, size_t size)
     // Add overhead for the additional memory required.
     size += XALLOC_BLOCK_META_DATA_SIZE;
 
-    // Iterate over all allocators 
-    for (i=0; i<self->maxAllocators; i++)
+    // Start at the first allocator that may hold the size's granule. 
+    // Without a lookup table entry, start at the smallest allocator.
+    entry = (size + XALLOC_LOOKUP_GRANULE - 1) / XALLOC_LOOKUP_GRANULE;
+    if (entry < XALLOC_LOOKUP_ENTRIES && 
+        (ATOMIC_Load32(&self->lookupState) == XALLOC_LOOKUP_READY || XALLOC_BuildLookup(self)))
+    {
+        i = self->lookup[entry];
+    }
+
+    // Iterate over the remaining allocators. From a lookup table entry the 
+    // first allocator fits, unless its block ends below size within the granule.
+    for (; i<self->maxAllocators; i++)
     {
         // Can the allocator instance handle the requested size?
         if (self->allocators[i] && self->allocators[i]->blockSize >= size)
@@ -93,12 +162,143 @@ static ALLOC_Allocator* XALLOC_GetAllocator(XAllocData* self, size_t size)
     return pAllocator;
 } 
 
+//----------------------------------------------------------------------------
+// XALLOC_AssignSlot
+//----------------------------------------------------------------------------
+static UINT32 XALLOC_AssignSlot(ALLOC_Allocator* allocator)
+{
+    UINT32 slot = XALLOC_NO_CACHE;
+
+    // Only cache pools large enough to share XALLOC_CACHE_SHARE ways
+    if (allocator->maxBlocks / XALLOC_CACHE_SHARE >= 2)
+    {
+        slot = ATOMIC_FetchAdd32(&_cacheSlots, 1) + 1;
+        if (slot > XALLOC_CACHE_SLOTS)
+            slot = XALLOC_NO_CACHE;
+    }
+
+    // Another thread may have assigned the allocator a slot meanwhile
+    if (!ATOMIC_CompareExchange32(&allocator->cacheSlot, 0, slot))
+        slot = ATOMIC_Load32(&allocator->cacheSlot);
+    return slot;
+}
+
+//----------------------------------------------------------------------------
+// XALLOC_GetMagazine
+//----------------------------------------------------------------------------
+static XALLOC_Magazine* XALLOC_GetMagazine(ALLOC_Allocator* allocator, BOOL assign)
+{
+    UINT32 slot = ATOMIC_Load32(&allocator->cacheSlot);
+    XALLOC_Magazine* magazine = NULL;
+
+    if (slot == 0 && assign)
+        slot = XALLOC_AssignSlot(allocator);
+    if (slot == 0 || slot == XALLOC_NO_CACHE || _cacheClosed)
+        return NULL;
+
+    magazine = &_magazines[slot - 1];
+    if (magazine->capacity == 0)
+    {
+        // First use on this thread. A thread holds at most 
+        // 1/XALLOC_CACHE_SHARE of the pool.
+        magazine->allocator = allocator;
+        magazine->capacity = allocator->maxBlocks / XALLOC_CACHE_SHARE;
+        if (magazine->capacity > XALLOC_MAGAZINE_SIZE)
+            magazine->capacity = XALLOC_MAGAZINE_SIZE;
+
+        // Return the cached blocks when the thread exits
+        if (!_cacheRegistered)
+        {
+            _cacheRegistered = TRUE;
+            TH_AtExit(XALLOC_ThreadExit, NULL);
+        }
+    }
+    return magazine;
+}
+
+//----------------------------------------------------------------------------
+// XALLOC_Reserve
+//----------------------------------------------------------------------------
+static BOOL XALLOC_Reserve(XALLOC_Magazine* magazine, UINT32 count)
+{
+    ALLOC_Allocator* allocator = magazine->allocator;
+    UINT32 limit = allocator->maxBlocks / XALLOC_CACHE_LIMIT;
+    UINT32 cached;
+
+    // Grow the magazine's share of the blocks all threads may cache, 
+    // unless the share would pass the limit
+    do
+    {
+        cached = ATOMIC_Load32(&allocator->cached);
+        if (cached + count > limit)
+            return FALSE;
+    } while (!ATOMIC_CompareExchange32(&allocator->cached, cached, cached + count));
+
+    magazine->reserved += count;
+    return TRUE;
+}
+
+//----------------------------------------------------------------------------
+// XALLOC_Release
+//----------------------------------------------------------------------------
+static void XALLOC_Release(XALLOC_Magazine* magazine, UINT32 keep)
+{
+    // Give back the share beyond the cached blocks and keep
+    UINT32 target = magazine->count > keep ? magazine->count : keep;
+
+    if (magazine->reserved > target)
+    {
+        ATOMIC_FetchAdd32(&magazine->allocator->cached, (UINT32)0 - (magazine->reserved - target));
+        magazine->reserved = target;
+    }
+}
+
+//----------------------------------------------------------------------------
+// XALLOC_Flush
+//----------------------------------------------------------------------------
+static void XALLOC_Flush(XALLOC_Magazine* magazine, UINT32 count)
+{
+    // Return the oldest blocks; the most recently freed are likely in the CPU cache
+    ALLOC_FreeBatch(magazine->allocator, magazine->blocks, count);
+    magazine->count -= count;
+    memmove(magazine->blocks, magazine->blocks + count, magazine->count * sizeof(void*));
+}
+
+//----------------------------------------------------------------------------
+// XALLOC_ThreadExit
+//----------------------------------------------------------------------------
+static void XALLOC_ThreadExit(void* arg)
+{
+    (void)arg;
+    XALLOC_FlushCache();
+
+    // Blocks freed later on this thread go straight to their pools
+    _cacheClosed = TRUE;
+}
+
+//----------------------------------------------------------------------------
+// XALLOC_FlushCache
+//----------------------------------------------------------------------------
+void XALLOC_FlushCache(void)
+{
+    UINT32 i;
+
+    for (i=0; i<XALLOC_CACHE_SLOTS; i++)
+    {
+        if (_magazines[i].count)
+            XALLOC_Flush(&_magazines[i], _magazines[i].count);
+        if (_magazines[i].reserved)
+            XALLOC_Release(&_magazines[i], 0);
+    }
+}
+
 //----------------------------------------------------------------------------
 // XALLOC_Alloc
 //----------------------------------------------------------------------------
 void* XALLOC_Alloc(XAllocData* self, size_t size)
 {
     ALLOC_Allocator* pAllocator;
+    XALLOC_Magazine* magazine = NULL;
     void* pBlockMemory = NULL;
     void* pClientMemory = NULL;
 
@@ -110,8 +310,30 @@ void* XALLOC_Alloc(XAllocData* self, size_t size)
     // An allocator found to handle memory request?
     if (pAllocator)
     {
-        // Get a fixed memory block from the allocator instance
-        pBlockMemory = ALLOC_Alloc(pAllocator, size + XALLOC_BLOCK_META_DATA_SIZE);
+        if (self->cache)
+            magazine = XALLOC_GetMagazine(pAllocator, TRUE);
+
+        if (magazine)
+        {
+            // Take a block from this thread's cache, refilled half full 
+            // from the allocator instance when empty. An emptied cache 
+            // gives back its share of the cache limit beyond a refill.
+            if (magazine->count == 0 && 
+                (magazine->reserved >= magazine->capacity / 2 || XALLOC_Reserve(magazine, magazine->capacity / 2)))
+                magazine->count = ALLOC_AllocBatch(pAllocator, magazine->blocks, magazine->capacity / 2);
+            if (magazine->count)
+                pBlockMemory = magazine->blocks[--magazine->count];
+            if (magazine->count == 0)
+                XALLOC_Release(magazine, magazine->capacity / 2);
+        }
+
+        // Not cached, or past the cache limit
+        if (!pBlockMemory)
+        {
+            // Get a fixed memory block from the allocator instance
+            pBlockMemory = ALLOC_Alloc(pAllocator, size + XALLOC_BLOCK_META_DATA_SIZE);
+        }
+
         if (pBlockMemory)
         {
             // Set the block ALLOC_Allocator* ptr within the raw memory block region
@@ -133,6 +355,7 @@ void* XALLOC_Alloc(XAllocData* self, size_t size)
 void XALLOC_Free(void* ptr)
 {
     ALLOC_Allocator* pAllocator = NULL;
+    XALLOC_Magazine* magazine = NULL;
     void* pBlock = NULL;
 
     if (!ptr)
@@ -145,8 +368,27 @@ void XALLOC_Free(void* ptr)
         // Convert the client pointer into the original raw block pointer
         pBlock = XALLOC_GetBlockPtr(ptr);
 
-        // Deallocate the fixed memory block
-        ALLOC_Free(pAllocator, pBlock);
+        // A cached allocator's block goes to this thread's cache, whichever 
+        // thread allocated it, within the cache limit. A full cache returns 
+        // half to the allocator.
+        magazine = XALLOC_GetMagazine(pAllocator, FALSE);
+        if (magazine && magazine->count == magazine->reserved)
+        {
+            if (magazine->count == magazine->capacity)
+                XALLOC_Flush(magazine, magazine->capacity / 2);
+            else if (!XALLOC_Reserve(magazine, magazine->capacity - magazine->reserved < magazine->capacity / 2 ? 
+                magazine->capacity - magazine->reserved : magazine->capacity / 2))
+                magazine = NULL;
+        }
+        if (magazine)
+        {
+            magazine->blocks[magazine->count++] = pBlock;
+        }
+        else
+        {
+            // Deallocate the fixed memory block
+            ALLOC_Free(pAllocator, pBlock);
+        }
     }
 } 
 
@@ -210,7 +452,23 @@ void* XALLOC_Calloc(XAllocData* self, size_t num, size_t size)
     }
 
     return pMem;
-} 
+}
 
+//----------------------------------------------------------------------------
+// XALLOC_GetStats
+//----------------------------------------------------------------------------
+UINT16 XALLOC_GetStats(XAllocData* self, ALLOC_Stats* stats, UINT16 maxStats)
+{
+    UINT16 i, count = 0;
 
+    ASSERT_TRUE(self);
+    ASSERT_TRUE(stats || maxStats == 0);
 
+    // One snapshot per size class, smallest block first
+    for (i=0; i<self->maxAllocators && count<maxStats; i++)
+    {
+        if (self->allocators[i])
+            ALLOC_GetStats(self->allocators[i], &stats[count++]);
+    }
+    return count;
+}
@@ -43,6 +43,35 @@
 // void MYALLOC_Free(void* ptr);
 // void* MYALLOC_Realloc(void *ptr, size_t new_size);
 // void* MYALLOC_Calloc(size_t num, size_t size);
+//
+// An XAllocData with cache set to TRUE keeps a per-thread cache of free 
+// blocks for each of its allocators. The common alloc and free then take or
+// put a block in the calling thread's cache, with no atomic operation. An 
+// empty cache is refilled with half a cache of blocks from the allocator 
+// and a full cache returns half its blocks, both in one batch. A block may
+// be freed on any thread; it joins that thread's cache. Cached blocks count
+// as in use by the allocator. A thread's cache is returned to the 
+// allocators when the thread exits, or with XALLOC_FlushCache().
+//
+// A thread caches at most XALLOC_MAGAZINE_SIZE blocks and at most 
+// 1/XALLOC_CACHE_SHARE of an allocator's blocks. All threads together cache
+// at most 1/XALLOC_CACHE_LIMIT of an allocator's blocks; past that, allocs
+// and frees go straight to the allocator, so idle threads cannot strand a 
+// pool in their caches. Allocators too small to cache two blocks per 
+// thread, and allocators beyond the first XALLOC_CACHE_SLOTS cached in the
+// process, are used directly.
+//
+// static XAllocData self = { allocators, MAX_ALLOCATORS, TRUE };
+//
+// XALLOC_Alloc() finds the allocator for a request size with a table 
+// lookup, however many allocators there are. The table maps each 
+// XALLOC_LOOKUP_GRANULE bytes of request size up to XALLOC_LOOKUP_MAX_SIZE
+// to the first allocator that may hold it, and is built on the first 
+// XALLOC_Alloc() of each XAllocData. Larger requests search the allocators.
+// An XAllocData has at most 255 allocators.
+//
+// XALLOC_GetStats() snapshots the usage of each size class. Blocks in the
+// per-thread caches count as in use.
 
 #ifndef _X_ALLOCATOR_H
 #define _X_ALLOCATOR_H
@@ -57,6 +86,29 @@ extern "C" {
 // Overhead bytes added to each XALLOC memory block
 #define XALLOC_BLOCK_META_DATA_SIZE  sizeof(ALLOC_Allocator*)
 
+// Per-thread cache limits (see XAllocData::cache)
+#ifndef XALLOC_MAGAZINE_SIZE
+#define XALLOC_MAGAZINE_SIZE    32      // Blocks cached per thread and allocator
+#endif
+#ifndef XALLOC_CACHE_SHARE
+#define XALLOC_CACHE_SHARE      8       // A thread caches at most 1/8 of a pool
+#endif
+#ifndef XALLOC_CACHE_LIMIT
+#define XALLOC_CACHE_LIMIT      4       // All threads cache at most 1/4 of a pool
+#endif
+#ifndef XALLOC_CACHE_SLOTS
+#define XALLOC_CACHE_SLOTS      32      // Allocators cached per process
+#endif
+
+// Size-to-allocator lookup table (see XAllocData::lookup)
+#ifndef XALLOC_LOOKUP_MAX_SIZE
+#define XALLOC_LOOKUP_MAX_SIZE  4096    // Largest request size looked up
+#endif
+#define XALLOC_LOOKUP_GRANULE   8
+#define XALLOC_LOOKUP_ENTRIES \
+    ((XALLOC_LOOKUP_MAX_SIZE + XALLOC_BLOCK_META_DATA_SIZE + XALLOC_LOOKUP_GRANULE - 1) / \
+        XALLOC_LOOKUP_GRANULE + 1)
+
 typedef struct
 {
     // Array of allocator instances sorted from smallest to largest block
@@ -64,12 +116,23 @@ typedef struct
 
     // Number of allocator instances stored within the allocators array
     const UINT16 maxAllocators;
+
+    // Cache free blocks per thread
+    const BOOL cache;
+
+    // Size-to-allocator lookup, built on first use; leave zero initialized.
+    // Entry n is the index of the first allocator whose block holds more 
+    // than (n - 1) * XALLOC_LOOKUP_GRANULE bytes, or maxAllocators if none.
+    ATOMIC32 lookupState;
+    UINT8 lookup[XALLOC_LOOKUP_ENTRIES];
 } XAllocData;
 
 void* XALLOC_Alloc(XAllocData* self, size_t size);
 void XALLOC_Free(void* ptr);
 void* XALLOC_Realloc(XAllocData* self, void *ptr, size_t new_size);
 void* XALLOC_Calloc(XAllocData* self, size_t num, size_t size);
+void XALLOC_FlushCache(void);
+UINT16 XALLOC_GetStats(XAllocData* self, ALLOC_Stats* stats, UINT16 maxStats);
 
 #ifdef __cplusplus
 }